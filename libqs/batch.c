@@ -0,0 +1,125 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include "qsprivate.h"
+
+/* Batch solving.  Every job is a whole qsSolveMCMCCtx search run on one
+ * worker of the context's pool, so small matrices pay for threads once
+ * per batch rather than per step.  Each worker has a context of its own
+ * that the batch context keeps between batches, and with it the search
+ * workspace for the last leaf count it solved.  A workspace is laid out
+ * for one leaf count, so jobs are handed out largest first: a worker then
+ * only builds a new one when the leaf count drops, and the long jobs do
+ * not end up last.  Job i is seeded from one draw of the batch context's
+ * stream and i, so its tree does not depend on the pool or the order. */
+
+struct BatchJob {
+  int leaf_count;
+  int index;
+};
+
+struct BatchRun {
+  struct QSTree **results;
+  double *scores;
+  const int *leaf_counts;
+  const double *const *distmatrices;
+  struct BatchJob *order;           // largest leaf count first
+  uint64_t seed;
+  struct QSTContext **workers;
+  struct QSTSolverStats *stats;     // one per worker, NULL without ctx stats
+};
+
+static int compareJobs(const void *a, const void *b) {
+  const struct BatchJob *x = (const struct BatchJob *) a, *y = (const struct BatchJob *) b;
+  if (x->leaf_count != y->leaf_count) {
+    return y->leaf_count - x->leaf_count;
+  }
+  return x->index - y->index;
+}
+
+static void batchTask(void *obj, int task_index, int worker) {
+  struct BatchRun *run = (struct BatchRun *) obj;
+  struct QSTContext *ctx = run->workers[worker];
+  int job = run->order[task_index].index;
+  qsSeedContext(ctx, run->seed ^ (job + 1) * 0x9e3779b97f4a7c15ULL);
+  run->scores[job] = qsSolveMCMCCtx(&run->results[job], run->leaf_counts[job],
+                                    run->distmatrices[job], ctx);
+}
+
+/* Gives ctx's workers, one per thread of its pool, its search settings. */
+static struct QSTContext **batchWorkers(struct QSTContext *ctx, int worker_count) {
+  int i;
+  if (ctx->batch_worker_count < worker_count) {
+    ctx->batch_workers = realloc(ctx->batch_workers, worker_count * sizeof(struct QSTContext *));
+    for (i = ctx->batch_worker_count; i < worker_count; ++i) {
+      ctx->batch_workers[i] = qsNewContext(0);
+    }
+    ctx->batch_worker_count = worker_count;
+  }
+  for (i = 0; i < worker_count; ++i) {
+    struct QSTContext *worker = ctx->batch_workers[i];
+    worker->chain_count = ctx->chain_count;
+    worker->step_mode = ctx->step_mode;
+    qsSetContextLeanMemory(worker, ctx->lean);
+    qsSetContextScoreCache(worker, ctx->cache);
+    qsSetContextScreening(worker, ctx->screen_samples, ctx->screen_top);
+  }
+  return ctx->batch_workers;
+}
+
+static void addStats(struct QSTSolverStats *total, const struct QSTSolverStats *part) {
+  total->steps += part->steps;
+  total->stays += part->stays;
+  total->candidates += part->candidates;
+  total->full_scores += part->full_scores;
+  total->agreement_checks += part->agreement_checks;
+  total->best_score = part->best_score > total->best_score ? part->best_score
+                                                           : total->best_score;
+  total->path_ns += part->path_ns;
+  total->enumerate_ns += part->enumerate_ns;
+  total->score_ns += part->score_ns;
+  total->agreement_ns += part->agreement_ns;
+}
+
+void qsSolveMCMCBatchCtx(struct QSTree **results, double *scores, int job_count,
+                         const int *leaf_counts, const double *const *distmatrices,
+                         struct QSTContext *ctx) {
+  int worker_count = ctx->pool ? qsThreadPoolSize(ctx->pool) : 1;
+  struct BatchRun run;
+  int i;
+  if (worker_count < 1) {
+    worker_count = 1;
+  }
+  if (job_count < 0) {
+    fprintf(stderr, "Error, a batch cannot have %d jobs.\n", job_count);
+    exit(1);
+  }
+  run.results = results;
+  run.scores = scores;
+  run.leaf_counts = leaf_counts;
+  run.distmatrices = distmatrices;
+  run.order = malloc((job_count + 1) * sizeof(struct BatchJob));
+  for (i = 0; i < job_count; ++i) {
+    run.order[i].leaf_count = leaf_counts[i];
+    run.order[i].index = i;
+  }
+  qsort(run.order, job_count, sizeof(struct BatchJob), compareJobs);
+  run.seed = qsContextRandom(ctx);
+  run.workers = batchWorkers(ctx, worker_count);
+  run.stats = NULL;
+  if (ctx->stats != NULL) {
+    run.stats = calloc(worker_count, sizeof(struct QSTSolverStats));
+    for (i = 0; i < worker_count; ++i) {
+      qsResetSolverStats(&run.stats[i]);
+      qsSetContextStats(run.workers[i], &run.stats[i]);
+    }
+  }
+  qsThreadPoolRun(ctx->pool, job_count, batchTask, &run);
+  if (run.stats != NULL) {
+    for (i = 0; i < worker_count; ++i) {
+      addStats(ctx->stats, &run.stats[i]);
+      qsSetContextStats(run.workers[i], NULL);
+    }
+    free(run.stats);
+  }
+  free(run.order);
+}
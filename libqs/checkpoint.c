@@ -0,0 +1,246 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "qsprivate.h"
+
+/* Solver checkpoints.  A checkpoint holds the whole of a QSTSolverState
+ * between two steps, so a search loaded from one takes exactly the steps
+ * the original would have taken next.  All fields are in host byte order:
+ *
+ *   header   magic "QSCHKPT1", byte order tag, leaf and chain counts, step
+ *            mode, the chain that stepped last, whether the search is
+ *            over, the step count that sets beta, the last score, the
+ *            random stream and a hash of the distance matrix
+ *   chains   per chain the Metropolis running totals, which carry rounding
+ *            a fresh scoring would not reproduce, then the tree's node
+ *            lists as they are; the kernel numbering is part of the state
+ *            because the next mutation drawn depends on it
+ *   trailer  a hash of everything before it
+ *
+ * That is about 8 bytes per leaf per chain, so writing one is cheap next
+ * to a step.  It goes to path.tmp, is synced and then renamed over path,
+ * so path always holds a complete checkpoint. */
+
+#define QST_CHECKPOINT_MAGIC "QSCHKPT1"
+#define QST_CHECKPOINT_BYTE_ORDER 0x01020304
+
+struct QSTCheckpointHeader {
+  char magic[8];
+  uint32_t byte_order;
+  uint32_t leaf_count;
+  uint32_t tree_count;
+  uint32_t step_mode;
+  uint32_t tree_pointer;
+  uint32_t done;
+  uint64_t itercount;
+  double score;
+  uint64_t rng[4];
+  uint64_t matrix_hash;
+};
+
+struct QSTCheckpointChain {
+  uint32_t scored;                // nonzero when the Metropolis state below is live
+  uint32_t scored_moves;
+  double scored_score;
+  struct QSTScoreTotals scored_totals;
+};
+
+static uint64_t hashBytes(uint64_t hash, const void *data, size_t size) {
+  const unsigned char *bytes = (const unsigned char *) data;
+  size_t i;
+  for (i = 0; i < size; ++i) {
+    hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+static size_t checkpointSize(uint32_t leaf_count, uint32_t tree_count) {
+  return sizeof(struct QSTCheckpointHeader) +
+         tree_count * (sizeof(struct QSTCheckpointChain) +
+                       QST_NODE_COUNT(leaf_count) * sizeof(uint16_t)) +
+         sizeof(uint64_t);
+}
+
+static void badCheckpoint(const char *path, const char *why) {
+  fprintf(stderr, "Error, %s is not a usable checkpoint: %s.\n", path, why);
+  exit(1);
+}
+
+void qsSaveSolverState(struct QSTSolverState *state, const char *path) {
+  struct QSTCheckpointHeader header;
+  size_t size = checkpointSize(state->leaf_count, state->tree_count), tree_size;
+  char *buf = malloc(size), *cur = buf;
+  int i;
+  if (state->rng == NULL) {
+    fprintf(stderr, "Error, a search drawing from rand() cannot be checkpointed.\n");
+    exit(1);
+  }
+  if (state->matrix_hash == 0) {
+    state->matrix_hash = qsHashDistances(state->model->distmatrix, state->leaf_count);
+  }
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, QST_CHECKPOINT_MAGIC, 8);
+  header.byte_order = QST_CHECKPOINT_BYTE_ORDER;
+  header.leaf_count = state->leaf_count;
+  header.tree_count = state->tree_count;
+  header.step_mode = state->step_mode;
+  header.tree_pointer = state->tree_pointer;
+  header.done = state->done;
+  header.itercount = state->itercount;
+  header.score = state->score;
+  memcpy(header.rng, state->rng->s, sizeof(header.rng));
+  header.matrix_hash = state->matrix_hash;
+  memcpy(cur, &header, sizeof(header));
+  cur += sizeof(header);
+  tree_size = QST_NODE_COUNT(state->leaf_count) * sizeof(uint16_t);
+  for (i = 0; i < state->tree_count; ++i) {
+    const struct QSTSearchWorkspace *ws = state->workspaces[i];
+    struct QSTCheckpointChain chain;
+    memset(&chain, 0, sizeof(chain));
+    if (ws->scored_matrix == qsScoredMatrixKey(state->model) &&
+        qsTreeCompare(ws->scored, state->trees[i]) == 0) {
+      chain.scored = 1;
+      chain.scored_moves = ws->scored_moves;
+      chain.scored_score = ws->scored_score;
+      chain.scored_totals = ws->scored_totals;
+    }
+    memcpy(cur, &chain, sizeof(chain));
+    cur += sizeof(chain);
+    memcpy(cur, state->trees[i], tree_size);
+    cur += tree_size;
+  }
+  uint64_t check = hashBytes(0xcbf29ce484222325ULL, buf, cur - buf);
+  memcpy(cur, &check, sizeof(check));
+
+  size_t len = strlen(path);
+  char *temp_path = malloc(len + 5);
+  memcpy(temp_path, path, len);
+  memcpy(temp_path + len, ".tmp", 5);
+  FILE *fp = fopen(temp_path, "wb");
+  if (fp == NULL) {
+    fprintf(stderr, "Error, cannot create %s: %s\n", temp_path, strerror(errno));
+    exit(1);
+  }
+  if (fwrite(buf, 1, size, fp) != size || fflush(fp) != 0 || fsync(fileno(fp)) != 0 ||
+      fclose(fp) != 0) {
+    fprintf(stderr, "Error, cannot write %s: %s\n", temp_path, strerror(errno));
+    exit(1);
+  }
+  if (rename(temp_path, path) != 0) {
+    fprintf(stderr, "Error, cannot rename %s to %s: %s\n", temp_path, path, strerror(errno));
+    exit(1);
+  }
+  free(temp_path);
+  free(buf);
+}
+
+struct QSTSolverState *qsLoadSolverStateCtx(const char *path, int leaf_count,
+                                            const double *distmatrix, struct QSTContext *ctx) {
+  struct QSTCheckpointHeader header;
+  FILE *fp = fopen(path, "rb");
+  long size;
+  int i;
+  if (fp == NULL) {
+    fprintf(stderr, "Error, cannot open %s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+  fseek(fp, 0, SEEK_END);
+  size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  if (size < (long) sizeof(header)) {
+    badCheckpoint(path, "truncated header");
+  }
+  char *buf = malloc(size), *cur = buf;
+  if (fread(buf, 1, size, fp) != (size_t) size) {
+    fprintf(stderr, "Error, cannot read %s.\n", path);
+    exit(1);
+  }
+  fclose(fp);
+  memcpy(&header, buf, sizeof(header));
+  cur += sizeof(header);
+  if (memcmp(header.magic, QST_CHECKPOINT_MAGIC, 8) != 0) {
+    badCheckpoint(path, "no checkpoint magic");
+  }
+  if (header.byte_order != QST_CHECKPOINT_BYTE_ORDER) {
+    badCheckpoint(path, "written with the other byte order");
+  }
+  if (header.tree_count < 1 || header.tree_count > 10 ||
+      (size_t) size != checkpointSize(header.leaf_count, header.tree_count)) {
+    badCheckpoint(path, "wrong size for its leaf and chain counts");
+  }
+  uint64_t check;
+  memcpy(&check, buf + size - sizeof(check), sizeof(check));
+  if (check != hashBytes(0xcbf29ce484222325ULL, buf, size - sizeof(check))) {
+    badCheckpoint(path, "checksum mismatch");
+  }
+  if (header.leaf_count != (uint32_t) leaf_count ||
+      header.matrix_hash != qsHashDistances(distmatrix, leaf_count)) {
+    badCheckpoint(path, "saved for a different distance matrix");
+  }
+  if (header.step_mode != QST_STEP_HEAT_BATH && header.step_mode != QST_STEP_METROPOLIS &&
+      header.step_mode != QST_STEP_SCREENED) {
+    badCheckpoint(path, "unknown step mode");
+  }
+  struct QSTSolverState *state =
+    qsNewSolverState(leaf_count, distmatrix, header.tree_count, &ctx->rng, ctx->pool, NULL,
+                     ctx->lean, header.step_mode, 0);
+  size_t tree_size = QST_NODE_COUNT(leaf_count) * sizeof(uint16_t);
+  for (i = 0; i < state->tree_count; ++i) {
+    struct QSTCheckpointChain chain;
+    memcpy(&chain, cur, sizeof(chain));
+    cur += sizeof(chain);
+    memcpy(state->trees[i], cur, tree_size);
+    cur += tree_size;
+    const uint16_t *nodes = (const uint16_t *) state->trees[i];
+    uint32_t k;
+    for (k = 0; k < QST_NODE_COUNT(leaf_count); ++k) {
+      if (nodes[k] >= QST_NODELIST_COUNT(leaf_count)) {
+        badCheckpoint(path, "a chain's tree is damaged");
+      }
+    }
+    if (qsVerifyTree(state->trees[i]) != 0) {
+      badCheckpoint(path, "a chain's tree is damaged");
+    }
+    if (chain.scored) {
+      struct QSTSearchWorkspace *ws = state->workspaces[i];
+      qsLoadWorkspaceTree(ws, state->trees[i]);
+      qsCopyTreeOver(ws->scored, state->trees[i]);
+      ws->scored_matrix = qsScoredMatrixKey(state->model);
+      ws->scored_moves = chain.scored_moves;
+      ws->scored_score = chain.scored_score;
+      ws->scored_totals = chain.scored_totals;
+    }
+  }
+  state->tree_pointer = header.tree_pointer % header.tree_count;
+  state->done = header.done != 0;
+  state->itercount = header.itercount;
+  state->score = header.score;
+  state->matrix_hash = header.matrix_hash;
+  memcpy(ctx->rng.s, header.rng, sizeof(header.rng));
+  qsAttachSolverState(state, ctx);
+  free(buf);
+  return state;
+}
+
+double qsSolveMCMCCheckpointCtx(struct QSTree **result, int leaf_count, const double *distmatrix,
+                                const char *path, double interval, struct QSTContext *ctx) {
+  struct QSTSolverState *state;
+  if (access(path, F_OK) == 0) {
+    state = qsLoadSolverStateCtx(path, leaf_count, distmatrix, ctx);
+  } else {
+    state = qsNewSolverStateCtx(leaf_count, distmatrix, ctx);
+  }
+  double saved_at = qsSecondsNow();
+  while (!qsAdvanceSolverState(state, 1)) {
+    if (qsSecondsNow() - saved_at >= interval) {
+      qsSaveSolverState(state, path);
+      saved_at = qsSecondsNow();
+    }
+  }
+  qsSaveSolverState(state, path);
+  double score = qsSolverStateResult(state, result);
+  qsFreeSolverState(state);
+  return score;
+}
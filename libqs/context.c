@@ -0,0 +1,149 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include "qsprivate.h"
+
+/* A solver context owns everything a search needs beyond its inputs: a
+ * random stream, scratch buffers and settings.  Contexts share nothing,
+ * so independent searches can run on separate threads, and a search run
+ * from a given seed can be replayed exactly. */
+
+struct QSTContext *qsNewContext(uint64_t seed) {
+  struct QSTContext *ctx = calloc(sizeof(struct QSTContext), 1);
+  qsSeedContext(ctx, seed);
+  return ctx;
+}
+
+void qsFreeContext(struct QSTContext *ctx) {
+  int i;
+  for (i = 0; i < ctx->batch_worker_count; ++i) {
+    qsFreeContext(ctx->batch_workers[i]);
+  }
+  free(ctx->batch_workers);
+  if (ctx->workspace != NULL) {
+    qsFreeSearchWorkspace(ctx->workspace);
+  }
+  free(ctx->scratch);
+  free(ctx);
+}
+
+void qsSeedContext(struct QSTContext *ctx, uint64_t seed) {
+  qsRandomSeed(&ctx->rng, seed);
+}
+
+uint64_t qsContextRandom(struct QSTContext *ctx) {
+  return qsRandomNext(&ctx->rng);
+}
+
+void qsSetContextThreadPool(struct QSTContext *ctx, struct QSTThreadPool *pool) {
+  ctx->pool = pool;
+  if (ctx->workspace != NULL && pool != NULL &&
+      ctx->workspace->worker_count < qsThreadPoolSize(pool)) {
+    qsFreeSearchWorkspace(ctx->workspace);
+    ctx->workspace = NULL;
+  }
+}
+
+void qsSetContextChainCount(struct QSTContext *ctx, int chain_count) {
+  if (chain_count != 0 && (chain_count < 2 || chain_count > 10)) {
+    fprintf(stderr, "Error, chain count must be 0 or between 2 and 10, not %d.\n", chain_count);
+    exit(1);
+  }
+  ctx->chain_count = chain_count;
+}
+
+void qsSetContextStepMode(struct QSTContext *ctx, int step_mode) {
+  if (step_mode != QST_STEP_HEAT_BATH && step_mode != QST_STEP_METROPOLIS &&
+      step_mode != QST_STEP_SCREENED) {
+    fprintf(stderr, "Error, unknown step mode %d.\n", step_mode);
+    exit(1);
+  }
+  ctx->step_mode = step_mode;
+}
+
+void qsSetContextLeanMemory(struct QSTContext *ctx, int lean) {
+  ctx->lean = lean != 0;
+  if (ctx->workspace != NULL && qsIsLeanSearchWorkspace(ctx->workspace) != ctx->lean) {
+    qsFreeSearchWorkspace(ctx->workspace);
+    ctx->workspace = NULL;
+  }
+}
+
+struct QSTSearchWorkspace *qsContextWorkspace(struct QSTContext *ctx, uint32_t leaf_count) {
+  if (ctx->workspace != NULL && ctx->workspace->leaf_count != leaf_count) {
+    qsFreeSearchWorkspace(ctx->workspace);
+    ctx->workspace = NULL;
+  }
+  if (ctx->workspace == NULL) {
+    int worker_count = ctx->pool ? qsThreadPoolSize(ctx->pool) : 1;
+    ctx->workspace = ctx->lean ? qsNewLeanSearchWorkspace(leaf_count, worker_count)
+                               : qsNewSearchWorkspace(leaf_count, worker_count);
+  }
+  qsAttachWorkspace(ctx->workspace, ctx);
+  return ctx->workspace;
+}
+
+/* Gives workspace the stats, score cache and screening settings of ctx,
+ * or none of them when ctx is NULL. */
+void qsAttachWorkspace(struct QSTSearchWorkspace *workspace, const struct QSTContext *ctx) {
+  workspace->stats = ctx != NULL ? ctx->stats : NULL;
+  workspace->cache = ctx != NULL ? ctx->cache : NULL;
+  workspace->screen_samples = ctx != NULL ? ctx->screen_samples : 0;
+  workspace->screen_top = ctx != NULL ? ctx->screen_top : 0;
+}
+
+void qsSetContextStats(struct QSTContext *ctx, struct QSTSolverStats *stats) {
+  ctx->stats = stats;
+  if (ctx->workspace != NULL) {
+    qsAttachWorkspace(ctx->workspace, ctx);
+  }
+}
+
+void qsSetContextScoreCache(struct QSTContext *ctx, struct QSTScoreCache *cache) {
+  ctx->cache = cache;
+  if (ctx->workspace != NULL) {
+    qsAttachWorkspace(ctx->workspace, ctx);
+  }
+}
+
+void qsSetContextScreening(struct QSTContext *ctx, int sample_count, int top_count) {
+  if (sample_count < 0 || top_count < 0 || top_count > QST_SCREEN_TOP_MAX) {
+    fprintf(stderr, "Error, screening needs a sample count of 0 or more and from 0 to %d "
+            "exactly scored neighbors.\n", QST_SCREEN_TOP_MAX);
+    exit(1);
+  }
+  ctx->screen_samples = sample_count;
+  ctx->screen_top = top_count;
+  if (ctx->workspace != NULL) {
+    qsAttachWorkspace(ctx->workspace, ctx);
+  }
+}
+
+void qsResetSolverStats(struct QSTSolverStats *stats) {
+  memset(stats, 0, sizeof(*stats));
+#ifdef QST_STATS
+  stats->enabled = 1;
+#endif
+}
+
+uint16_t *qsContextScratch(struct QSTContext *ctx, uint32_t leaf_count) {
+  if (ctx->scratch_leaves < leaf_count) {
+    free(ctx->scratch);
+    ctx->scratch = malloc(QST_SAMPLE_SCRATCH_SIZE(leaf_count));
+    ctx->scratch_leaves = leaf_count;
+  }
+  return ctx->scratch;
+}
+
+uint64_t qsSampleMutationCtx(const struct QSTree *tree, struct QSTContext *ctx) {
+  return qsSampleMutationWith(tree, &ctx->rng, qsContextScratch(ctx, qsLeafCount(tree)));
+}
+
+void qsApplyRandomMutationCtx(struct QSTree *tree, struct QSTContext *ctx) {
+  qsApplyRandomMutationWith(tree, &ctx->rng, qsContextScratch(ctx, qsLeafCount(tree)));
+}
+
+struct QSTree *qsNewRandomTreeCtx(uint32_t leaf_count, struct QSTContext *ctx) {
+  struct QSTree *tree = qsNewTree(leaf_count);
+  qsRandomizeTreeWith(tree, &ctx->rng, qsContextScratch(ctx, leaf_count));
+  return tree;
+}
@@ -0,0 +1,147 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include "qsprivate.h"
+
+/* Sampled scoring.  The score is the ratio of two sums over quartets,
+ *
+ *   S = sum (max - cost) / sum (max - min)
+ *
+ * with max and min the largest and smallest of the three pairings' costs,
+ * so a sample of quartets gives the ratio estimator and, by the delta
+ * method, its standard error from the spread of the residuals
+ * (max - cost) - S (max - min).  Quartets are drawn by their rank in
+ * colexicographic order, one from each of sample_count equal slices of
+ * the ranks, which stratifies the sample over the leaves.  Distances in
+ * the tree come from a tree index, so no path matrix is built and the
+ * memory needed grows only a little faster than the leaf count.  A pilot
+ * sample sets the size of the real one from the target error. */
+
+#define QST_ESTIMATE_Z 1.959963984540054     // two sided 95%
+#define QST_ESTIMATE_PILOT 1024
+
+struct SampleSums {
+  uint64_t count;
+  double y, x, yy, xx, xy;
+};
+
+static uint64_t choose(uint64_t n, int k) {
+  uint64_t result = 1;
+  int i;
+  if (n < (uint64_t) k) {
+    return 0;
+  }
+  for (i = 0; i < k; ++i) {
+    result = result * (n - i) / (i + 1);
+  }
+  return result;
+}
+
+/* The quartet a < b < c < d of colexicographic rank, that is
+ * rank = C(a,1) + C(b,2) + C(c,3) + C(d,4). */
+static void unrankQuartet(uint64_t rank, uint32_t leaf_count, uint32_t quartet[4]) {
+  uint32_t hi = leaf_count;
+  int k;
+  for (k = 4; k >= 1; --k) {
+    uint32_t lo = k - 1;
+    while (hi - lo > 1) {
+      uint32_t mid = lo + (hi - lo) / 2;
+      if (choose(mid, k) <= rank) {
+        lo = mid;
+      } else {
+        hi = mid;
+      }
+    }
+    quartet[k - 1] = lo;
+    rank -= choose(lo, k);
+    hi = lo;
+  }
+}
+
+static void addQuartet(struct SampleSums *sums, const struct QSTTreeIndex *index,
+                       const double *distmatrix, uint32_t n, const uint32_t q[4]) {
+  double s0 = distmatrix[q[0]*n + q[1]] + distmatrix[q[2]*n + q[3]];
+  double s1 = distmatrix[q[0]*n + q[2]] + distmatrix[q[1]*n + q[3]];
+  double s2 = distmatrix[q[0]*n + q[3]] + distmatrix[q[1]*n + q[2]];
+  int topology = qsTreeIndexQuartetTopology(index, q[0], q[1], q[2], q[3]);
+  double cost = topology == 0 ? s0 : (topology == 1 ? s1 : s2);
+  double mn = s0, mx = s0;
+  if (s1 < mn) { mn = s1; }
+  if (s1 > mx) { mx = s1; }
+  if (s2 < mn) { mn = s2; }
+  if (s2 > mx) { mx = s2; }
+  double y = mx - cost, x = mx - mn;
+  sums->count += 1;
+  sums->y += y;
+  sums->x += x;
+  sums->yy += y * y;
+  sums->xx += x * x;
+  sums->xy += x * y;
+}
+
+static void sampleQuartets(struct SampleSums *sums, const struct QSTTreeIndex *index,
+                           const double *distmatrix, uint32_t n, uint64_t total,
+                           uint64_t sample_count, struct QSTRandom *rng) {
+  double width = (double) total / sample_count;
+  uint32_t q[4];
+  uint64_t i;
+  memset(sums, 0, sizeof(*sums));
+  for (i = 0; i < sample_count; ++i) {
+    uint64_t rank = (uint64_t) ((i + qsRandomUnit(rng)) * width);
+    unrankQuartet(rank < total ? rank : total - 1, n, q);
+    addQuartet(sums, index, distmatrix, n, q);
+  }
+}
+
+/* Ratio estimate and its variance. */
+static double sampleRatio(const struct SampleSums *sums, double *variance) {
+  double ratio = sums->y / sums->x;
+  double mean_x = sums->x / sums->count;
+  double residual = sums->yy - 2 * ratio * sums->xy + ratio * ratio * sums->xx;
+  if (residual < 0 || sums->count < 2) {
+    residual = 0;
+  }
+  *variance = residual / (sums->count - 1) / (sums->count * mean_x * mean_x);
+  return ratio;
+}
+
+double qsEstimateTreeScoreCtx(const struct QSTree *tree, const double *distmatrix,
+                              double target_error, struct QSTScoreEstimate *estimate,
+                              struct QSTContext *ctx) {
+  uint32_t n = qsLeafCount(tree);
+  uint64_t total = choose(n, 4), sample_count = QST_ESTIMATE_PILOT;
+  struct QSTTreeIndex *index = qsNewTreeIndex(tree);
+  struct SampleSums sums;
+  double variance;
+  if (target_error <= 0) {
+    fprintf(stderr, "Error, the target error must be positive.\n");
+    exit(1);
+  }
+  if (total > sample_count) {
+    sampleQuartets(&sums, index, distmatrix, n, total, sample_count, &ctx->rng);
+    sampleRatio(&sums, &variance);
+    double needed = ceil(QST_ESTIMATE_Z * QST_ESTIMATE_Z * variance * sums.count /
+                         (target_error * target_error));
+    if (needed > sample_count) {
+      sample_count = needed < (double) total ? (uint64_t) needed : total;
+    }
+  }
+  memset(estimate, 0, sizeof(*estimate));
+  if (sample_count >= total) {
+    estimate->score = qsScoreTreeIndexed(tree, index, distmatrix);
+    estimate->low = estimate->high = estimate->score;
+    estimate->sample_count = total;
+    estimate->exact = 1;
+  } else {
+    sampleQuartets(&sums, index, distmatrix, n, total, sample_count, &ctx->rng);
+    estimate->score = sampleRatio(&sums, &variance);
+    estimate->standard_error = sqrt(variance);
+    estimate->low = estimate->score - QST_ESTIMATE_Z * estimate->standard_error;
+    estimate->high = estimate->score + QST_ESTIMATE_Z * estimate->standard_error;
+    estimate->low = estimate->low < 0 ? 0 : estimate->low;
+    estimate->high = estimate->high > 1 ? 1 : estimate->high;
+    estimate->sample_count = sample_count;
+  }
+  qsFreeTreeIndex(index);
+  return estimate->score;
+}
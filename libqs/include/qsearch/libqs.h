@@ -8,23 +8,259 @@ struct QSTDirectedEdge {
   uint32_t from, to;
 };
 
+struct QSTScoreTotals {
+  double totmin, totmax, totcur;
+};
+
 struct QSTree;
 struct QSTUInt64Table;
+struct QSTScoreModel;
+struct QSTTreeIndex;
+struct QSTThreadPool;
+struct QSTSearchWorkspace;
+struct QSTTopologyHasher;
+struct QSTContext;
 
 struct QSTUInt64Table *qsNewUInt64Table(void);
 void qsAddUInt64ToTable(struct QSTUInt64Table *hashtab, uint64_t val);
 int qsIsUInt64InTable(const struct QSTUInt64Table *hashtab, uint64_t val);
+void qsResetUInt64Table(struct QSTUInt64Table *hashtab);
 void qsFreeUInt64Table(struct QSTUInt64Table *hashtab);
 
 double qsStepMCMC(struct QSTree *tree, const double *distmatrix, double beta);
+double qsStepMCMCWithModel(struct QSTree *tree, const struct QSTScoreModel *model, double beta);
+double qsStepMCMCParallel(struct QSTree *tree, const struct QSTScoreModel *model, double beta,
+                          struct QSTThreadPool *pool);
+double qsStepMCMCWorkspace(struct QSTree *tree, const struct QSTScoreModel *model, double beta,
+                           struct QSTThreadPool *pool, struct QSTSearchWorkspace *workspace);
 double qsSolveMCMC(struct QSTree **result, int leaf_count, const double *distmatrix);
 
+/* Step modes.  A heat bath step weighs every neighbor of the tree before
+ * choosing; a Metropolis step scores a single random proposal, which is
+ * far cheaper for large leaf counts.  qsStepMetropolisWorkspace keeps the
+ * tree it leaves in workspace and only rescores from scratch when a
+ * different tree is passed in.  A screened step is a heat bath step that
+ * weighs the neighbors by deltas estimated from a sample of the quartets
+ * each one changes, scoring exactly only the few that look best. */
+#define QST_STEP_HEAT_BATH 0
+#define QST_STEP_METROPOLIS 1
+#define QST_STEP_SCREENED 2
+double qsStepMetropolisWorkspace(struct QSTree *tree, const struct QSTScoreModel *model,
+                                 double beta, struct QSTThreadPool *pool,
+                                 struct QSTSearchWorkspace *workspace);
+double qsSolveMCMCWithMode(struct QSTree **result, int leaf_count, const double *distmatrix,
+                           int step_mode);
+double qsSolveMCMCThreaded(struct QSTree **result, int leaf_count, const double *distmatrix);
+
+/* Parallel tempering: replica_count chains run at the fixed betas, usually
+ * increasing, on the pool, and every steps_per_swap steps neighboring
+ * replicas trade places by the Metropolis criterion.  The search stops
+ * after round_count such rounds or at a perfect score, and returns the
+ * best tree any replica visited.  swap_attempts[i] and swap_accepts[i]
+ * count trades between betas[i] and betas[i+1]; an acceptance rate near
+ * zero for a pair means its betas are too far apart.  stats may be NULL.
+ * qsSolveTempering uses heat bath steps and a thread per replica; the Ctx
+ * version uses the context's pool, step mode and random stream. */
+#define QST_MAX_REPLICAS 32
+struct QSTTemperingStats {
+  int replica_count;
+  uint64_t round_count;
+  uint64_t swap_attempts[QST_MAX_REPLICAS - 1];
+  uint64_t swap_accepts[QST_MAX_REPLICAS - 1];
+  double best_score;
+};
+void qsGeometricLadder(double *betas, int replica_count, double beta_min, double beta_max);
+double qsSolveTempering(struct QSTree **result, int leaf_count, const double *distmatrix,
+                        const double *betas, int replica_count, int steps_per_swap,
+                        uint64_t round_count, struct QSTTemperingStats *stats);
+
+/* A context carries a seeded random stream, scratch buffers and solver
+ * settings.  The Ctx functions draw only from their context, so searches
+ * with separate contexts can run concurrently and a search is repeated
+ * exactly by reseeding.  The thread pool is borrowed; chain_count 0 picks
+ * the number of solver chains from the leaf count.  The step mode, heat
+ * bath unless set, applies to qsStepMCMCCtx and qsSolveMCMCCtx.  With lean
+ * memory set, the Ctx searches use lean workspaces.  Screened steps sample
+ * sample_count quartets per neighbor and score top_count neighbors
+ * exactly, 256 and 8 when set to 0; top_count is at most 64. */
+struct QSTContext *qsNewContext(uint64_t seed);
+void qsFreeContext(struct QSTContext *ctx);
+void qsSeedContext(struct QSTContext *ctx, uint64_t seed);
+uint64_t qsContextRandom(struct QSTContext *ctx);
+void qsSetContextThreadPool(struct QSTContext *ctx, struct QSTThreadPool *pool);
+void qsSetContextChainCount(struct QSTContext *ctx, int chain_count);
+void qsSetContextStepMode(struct QSTContext *ctx, int step_mode);
+void qsSetContextLeanMemory(struct QSTContext *ctx, int lean);
+void qsSetContextScreening(struct QSTContext *ctx, int sample_count, int top_count);
+struct QSTree *qsNewRandomTreeCtx(uint32_t leaf_count, struct QSTContext *ctx);
+void qsApplyRandomMutationCtx(struct QSTree *tree, struct QSTContext *ctx);
+uint64_t qsSampleMutationCtx(const struct QSTree *tree, struct QSTContext *ctx);
+double qsStepMCMCCtx(struct QSTree *tree, const struct QSTScoreModel *model, double beta,
+                     struct QSTContext *ctx);
+double qsSolveMCMCCtx(struct QSTree **result, int leaf_count, const double *distmatrix,
+                      struct QSTContext *ctx);
+/* Solves job_count independent matrices, job i having leaf_counts[i]
+ * leaves and distances distmatrices[i], with the settings of ctx.  The
+ * jobs are shared out over the threads of ctx's pool, one whole search
+ * per thread at a time, and each thread keeps its workspace from job to
+ * job and batch to batch.  results[i] and scores[i] are what
+ * qsSolveMCMCCtx gives for job i; they depend on ctx's seed and i only,
+ * not on the pool.  An attached QSTSolverStats gets the counts of all of
+ * them added. */
+void qsSolveMCMCBatchCtx(struct QSTree **results, double *scores, int job_count,
+                         const int *leaf_counts, const double *const *distmatrices,
+                         struct QSTContext *ctx);
+double qsSolveTemperingCtx(struct QSTree **result, int leaf_count, const double *distmatrix,
+                           const double *betas, int replica_count, int steps_per_swap,
+                           uint64_t round_count, struct QSTTemperingStats *stats,
+                           struct QSTContext *ctx);
+
+/* Counters and timers for the Ctx searches, for tuning beta schedules and
+ * chain counts.  Attach one to a context and every step and solve through
+ * it adds to the counts; the context only borrows it.  A step that stays
+ * is one where the tree did not move.  agreeing_chains is how many of the
+ * chain_count chains shared the most common topology at the last
+ * agreement check.  The times are in nanoseconds: path matrices and tree
+ * indexes, listing distinct neighbors, scoring (full and delta) and the
+ * agreement hashing.  Libraries configured with --disable-stats leave all
+ * of it zero, enabled included, and pay nothing for it. */
+struct QSTSolverStats {
+  int enabled;
+  uint64_t steps;
+  uint64_t stays;
+  uint64_t candidates;
+  uint64_t full_scores;
+  uint64_t agreement_checks;
+  int agreeing_chains;
+  int chain_count;
+  double best_score;
+  uint64_t path_ns;
+  uint64_t enumerate_ns;
+  uint64_t score_ns;
+  uint64_t agreement_ns;
+};
+void qsResetSolverStats(struct QSTSolverStats *stats);
+void qsSetContextStats(struct QSTContext *ctx, struct QSTSolverStats *stats);
+
+/* Estimate of a tree's score from a sample of its quartets, for trees
+ * too large to score exactly.  The sample is drawn from ctx's stream and
+ * is made large enough that the 95% confidence interval [low, high] is
+ * about target_error either side of the estimate; when that would take
+ * every quartet the score is computed exactly instead.  Memory use is
+ * near linear in the leaf count. */
+struct QSTScoreEstimate {
+  double score;
+  double low, high;
+  double standard_error;
+  uint64_t sample_count;
+  int exact;
+};
+double qsEstimateTreeScoreCtx(const struct QSTree *tree, const double *distmatrix,
+                              double target_error, struct QSTScoreEstimate *estimate,
+                              struct QSTContext *ctx);
+
+/* A score cache remembers full tree scorings by topology and distances,
+ * so that the Ctx searches look up a tree they have scored before instead
+ * of scoring it again.  It holds what fits in max_bytes and evicts by
+ * clock when full.  One cache can be shared by any number of contexts on
+ * any number of threads, over different distance matrices; lookups take
+ * no lock.  A hit gives exactly the score a fresh scoring would, so a
+ * search takes the same steps with a cache as without.  Matrices are told
+ * apart by their contents, hashed when a search or score model starts on
+ * them.  The counters are totals since the cache was made. */
+struct QSTScoreCache;
+struct QSTScoreCacheStats {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t insertions;
+  uint64_t evictions;
+  uint64_t capacity;                // entries
+};
+struct QSTScoreCache *qsNewScoreCache(size_t max_bytes);
+void qsFreeScoreCache(struct QSTScoreCache *cache);
+void qsClearScoreCache(struct QSTScoreCache *cache);
+void qsGetScoreCacheStats(const struct QSTScoreCache *cache, struct QSTScoreCacheStats *stats);
+void qsSetContextScoreCache(struct QSTContext *ctx, struct QSTScoreCache *cache);
+
+/* A qsSolveMCMCCtx search that can be stopped between any two steps,
+ * saved and carried on later, in this process or another, taking exactly
+ * the steps it would have taken without the break.  The state draws from
+ * ctx's random stream and uses its pool, which must outlive it; loading a
+ * checkpoint overwrites the stream and takes the step mode and chain count
+ * from the file.  qsAdvanceSolverState takes at most step_count steps and
+ * returns nonzero once the search is over.  qsSolveMCMCCheckpointCtx
+ * resumes from path if it exists and saves to it at least every interval
+ * seconds and at the end, so a rerun after the search finished returns the
+ * same tree at once. */
+struct QSTSolverState;
+struct QSTSolverState *qsNewSolverStateCtx(int leaf_count, const double *distmatrix,
+                                           struct QSTContext *ctx);
+int qsAdvanceSolverState(struct QSTSolverState *state, uint64_t step_count);
+double qsSolverStateResult(const struct QSTSolverState *state, struct QSTree **result);
+void qsSaveSolverState(struct QSTSolverState *state, const char *path);
+struct QSTSolverState *qsLoadSolverStateCtx(const char *path, int leaf_count,
+                                            const double *distmatrix, struct QSTContext *ctx);
+void qsFreeSolverState(struct QSTSolverState *state);
+double qsSolveMCMCCheckpointCtx(struct QSTree **result, int leaf_count, const double *distmatrix,
+                                const char *path, double interval, struct QSTContext *ctx);
+
+/* Anytime solving.  qsSolveMCMCAnytimeCtx runs the qsSolveMCMCCtx search
+ * until the chains agree or one of the options ends it first: seconds of
+ * wall clock, max_steps steps, or max_fail_count steps in a row that found
+ * no better score than any before.  Zero leaves a limit off.  The limits
+ * are checked between steps, so a search overruns its time by at most one
+ * step.  progress, if set, is called with the best tree so far, its score
+ * and the steps taken whenever the best score improves, and every
+ * progress_interval steps if that is nonzero; the tree is only valid
+ * during the call.  The search is cancelled when progress returns nonzero
+ * or when another thread sets *cancel.  A search cut short returns the
+ * best tree it saw; one that ends on its own returns what qsSolveMCMCCtx
+ * would.  reason, if not NULL, is set to one of the QST_SOLVE codes. */
+#define QST_SOLVE_AGREED 0
+#define QST_SOLVE_PERFECT 1
+#define QST_SOLVE_TIME_LIMIT 2
+#define QST_SOLVE_STEP_LIMIT 3
+#define QST_SOLVE_STAGNATED 4
+#define QST_SOLVE_CANCELLED 5
+struct QSTSolverOptions {
+  double seconds;
+  uint64_t max_steps;
+  uint64_t max_fail_count;
+  uint64_t progress_interval;
+  int (*progress)(const struct QSTree *best, double score, uint64_t steps, void *arg);
+  void *progress_arg;
+  const int *cancel;
+  const struct QSTree *const *starts;
+  int start_count;
+};
+void qsInitSolverOptions(struct QSTSolverOptions *options);
+double qsSolveMCMCAnytimeCtx(struct QSTree **result, int leaf_count, const double *distmatrix,
+                             const struct QSTSolverOptions *options, int *reason,
+                             struct QSTContext *ctx);
+
+/* Warm starts.  These run the qsSolveMCMCCtx search from the caller's
+ * trees instead of random ones, for refining a tree already solved, or
+ * one qsInsertLeaf grew, after the distances changed a little.  Chain i
+ * starts from starts[i] and the chains past start_count from those trees
+ * each moved by one random mutation; start_count is at most the number of
+ * chains.  The beta schedule starts where a search from random trees is
+ * already cold, so the starting trees are refined, not forgotten.  The
+ * anytime options take start trees the same way. */
+struct QSTSolverState *qsNewSolverStateFromCtx(const double *distmatrix,
+                                               const struct QSTree *const *starts,
+                                               int start_count, struct QSTContext *ctx);
+double qsSolveMCMCFromCtx(struct QSTree **result, const double *distmatrix,
+                          const struct QSTree *const *starts, int start_count,
+                          struct QSTContext *ctx);
+
 
 uint32_t qsTreeAllocationSize(uint32_t leaf_count);
 uint32_t qsInitializeTree(struct QSTree *tree, uint32_t leaf_count);
 struct QSTree *qsNewTree(uint32_t leaf_count);
 struct QSTree *qsNewCloneOf(const struct QSTree *orig);
 struct QSTree *qsNewRandomTree(uint32_t leaf_count);
+// tree with leaf n added where it best fits distmatrix, which has n + 1 leaves
+struct QSTree *qsInsertLeaf(const struct QSTree *tree, const double *distmatrix);
 void qsFreeTree(struct QSTree *tree);
 uint32_t qsCopyTreeOver(struct QSTree *destination, const struct QSTree *source);
 uint32_t qsLeafCount(const struct QSTree *tree);
@@ -33,6 +269,47 @@ uint32_t qsIsConnected(const struct QSTree *tree, uint32_t a, uint32_t b);
 uint32_t qsVerifyTree(const struct QSTree *tree);
 double qsScoreTree(const struct QSTree *tree, const uint16_t *pathmatrix,
  const double *distmatrix);   // same size as tree leaf count squared
+double qsScoreTreeTotals(const struct QSTree *tree, const uint16_t *pathmatrix,
+ const double *distmatrix, struct QSTScoreTotals *totals);
+// change in totcur caused by mutation_code; only quartets straddling a moved subtree are visited
+double qsScoreMutationDelta(const struct QSTree *tree, const uint16_t *fullpathmatrix,
+ const double *distmatrix, uint64_t mutation_code);
+double qsScoreFromTotals(const struct QSTScoreTotals *totals, double delta);
+// per distance matrix cache of the quartet normalizers for repeated scoring
+struct QSTScoreModel *qsNewScoreModel(uint32_t leaf_count, const double *distmatrix);
+void qsFreeScoreModel(struct QSTScoreModel *model);
+uint32_t qsScoreModelLeafCount(const struct QSTScoreModel *model);
+double qsScoreTreeWithModel(const struct QSTree *tree, const uint16_t *pathmatrix,
+ const struct QSTScoreModel *model);
+double qsScoreTreeTotalsWithModel(const struct QSTree *tree, const uint16_t *pathmatrix,
+ const struct QSTScoreModel *model, struct QSTScoreTotals *totals);
+const char *qsScoreKernelName(void);
+// distance layouts: doubles or floats, full square or packed upper triangle
+#define QST_DIST_DENSE   0
+#define QST_DIST_FLOAT32 1
+#define QST_DIST_PACKED  2
+// totals still accumulate in double whatever the layout
+double qsScoreTreeTotalsLayout(const struct QSTree *tree, const uint16_t *pathmatrix,
+ const void *distances, int layout, struct QSTThreadPool *pool, struct QSTScoreTotals *totals);
+double qsScoreTreeFloat(const struct QSTree *tree, const uint16_t *pathmatrix,
+ const float *distmatrix);
+double qsScoreTreePacked(const struct QSTree *tree, const uint16_t *pathmatrix,
+ const double *packed);
+uint64_t qsDistanceLayoutCount(uint32_t leaf_count, int layout);
+void qsWriteDistanceLayout(void *distances, int layout, const double *distmatrix,
+                           uint32_t leaf_count);
+// thread_count <= 0 means one thread per online CPU
+struct QSTThreadPool *qsNewThreadPool(int thread_count);
+void qsFreeThreadPool(struct QSTThreadPool *pool);
+int qsThreadPoolSize(const struct QSTThreadPool *pool);
+int qsOnlineCPUCount(void);
+// same result bit for bit whatever the pool size; pool may be NULL
+double qsScoreTreeParallel(const struct QSTree *tree, const uint16_t *pathmatrix,
+ const double *distmatrix, struct QSTThreadPool *pool);
+double qsScoreTreeTotalsParallel(const struct QSTree *tree, const uint16_t *pathmatrix,
+ const double *distmatrix, struct QSTThreadPool *pool, struct QSTScoreTotals *totals);
+double qsScoreTreeTotalsWithModelParallel(const struct QSTree *tree, const uint16_t *pathmatrix,
+ const struct QSTScoreModel *model, struct QSTThreadPool *pool, struct QSTScoreTotals *totals);
 uint32_t qsNormalizeTree(struct QSTree *tree);
 int qsTreeCompare(const struct QSTree *tree_a, const struct QSTree *tree_b);
 int qsPathFromTo(const struct QSTree *tree, const uint16_t *fullpathmatrix, int a, int b, uint16_t *path_buffer);
@@ -46,8 +323,64 @@ void qsApplyMutation(struct QSTree *tree,
                         const uint16_t *fullpathmatrix,
                         uint64_t mutation_code);
 void qsApplyRandomMutation(struct QSTree *tree);
+uint64_t qsSampleMutation(const struct QSTree *tree);
 void qsScrambleTree(struct QSTree *tree);
+
+/* Preallocated trees, path matrices and candidate buffers for repeated
+ * searches over trees of one leaf count.  worker_count is the largest
+ * thread pool size the workspace will be stepped with. */
+struct QSTSearchWorkspace *qsNewSearchWorkspace(uint32_t leaf_count, int worker_count);
+void qsFreeSearchWorkspace(struct QSTSearchWorkspace *workspace);
+/* A lean workspace steps from a tree index and a truncated path matrix
+ * instead of a (2n-2)^2 full path matrix, so its memory grows as the
+ * square of the leaf count (plus the heat bath candidate list) rather
+ * than four times that.  Searches from it give the same results. */
+struct QSTSearchWorkspace *qsNewLeanSearchWorkspace(uint32_t leaf_count, int worker_count);
+int qsIsLeanSearchWorkspace(const struct QSTSearchWorkspace *workspace);
+void qsIterateMutationsWorkspace(const struct QSTree *tree,
+                        const uint16_t *fullpathmatrix,
+                        struct QSTSearchWorkspace *workspace,
+                        void *obj,
+  int (*mutationHandler)(const struct QSTree *tree, const struct QSTree *nexttree, int sequence_number,
+                         uint64_t mutation_code, void *obj));
+
+// tree distance oracle: O(1) lowest common ancestor and distance queries
+struct QSTTreeIndex *qsNewTreeIndex(const struct QSTree *tree);
+void qsUpdateTreeIndex(struct QSTTreeIndex *index, const struct QSTree *tree);
+void qsFreeTreeIndex(struct QSTTreeIndex *index);
+uint32_t qsTreeIndexLCA(const struct QSTTreeIndex *index, uint32_t a, uint32_t b);
+uint32_t qsTreeIndexDistance(const struct QSTTreeIndex *index, uint32_t a, uint32_t b);
+uint32_t qsTreeIndexNextHop(const struct QSTTreeIndex *index, uint32_t a, uint32_t b);
+int qsTreeIndexQuartetTopology(const struct QSTTreeIndex *index,
+                               uint32_t a, uint32_t b, uint32_t c, uint32_t d);
+void qsTreeIndexWritePathMatrix(const struct QSTTreeIndex *index, uint16_t *pathmatrix);
+int qsPathFromToIndexed(const struct QSTree *tree, const struct QSTTreeIndex *index,
+                        int a, int b, uint16_t *path_buffer);
+double qsScoreTreeIndexed(const struct QSTree *tree, const struct QSTTreeIndex *index,
+ const double *distmatrix);
+void qsIterateMutationsIndexed(const struct QSTree *tree,
+                        const struct QSTTreeIndex *index,
+                        void *obj,
+  int (*mutationHandler)(const struct QSTree *tree, const struct QSTree *nexttree, int sequence_number,
+                         uint64_t mutation_code, void *obj));
+void qsApplyMutationIndexed(struct QSTree *tree,
+                        const struct QSTTreeIndex *index,
+                        uint64_t mutation_code);
+// pathmatrix is the truncated path matrix of tree
+double qsScoreMutationDeltaIndexed(const struct QSTree *tree, const struct QSTTreeIndex *index,
+ const uint16_t *pathmatrix, const double *distmatrix, uint64_t mutation_code);
+void qsWritePathMatrix(uint16_t *fullpathmatrix, const struct QSTree *tree);
 uint64_t qsTreeHash(const struct QSTree *tree);
+
+/* Hash of the leaf splits of a tree: equal for trees of the same shape
+ * whatever their kernel numbering.  A hasher loaded with a tree gives the
+ * hash of any of its neighbors in time proportional to the length of the
+ * path the mutation acts along. */
+uint64_t qsTreeTopologyHash(const struct QSTree *tree);
+struct QSTTopologyHasher *qsNewTopologyHasher(uint32_t leaf_count);
+void qsFreeTopologyHasher(struct QSTTopologyHasher *hasher);
+uint64_t qsLoadTopologyHasher(struct QSTTopologyHasher *hasher, const struct QSTree *tree);
+uint64_t qsTopologyHashAfterMutation(struct QSTTopologyHasher *hasher, uint64_t mutation_code);
 uint64_t qsTreeHashHex(const struct QSTree *tree, char hval[17]);
 
 #define QST_NODE_COUNT(leaf_count) (4*leaf_count - 6)
@@ -153,38 +486,7 @@ do {
   }                                                                        \
 } while(0)
 
-#define qstWritePathMatrix(path, utree)          do {                      \
-  const uint16_t *__ytree = (const uint16_t *) utree;                      \
-  if (__ytree[-1] < 4 || __ytree[-1] > 16000) {                            \
-    fprintf(stderr, "Error, bad __ytree length: %d\n", __ytree[-1]);       \
-    exit(1);                                                               \
-  }                                                                        \
-  path[-1] = QST_NODELIST_COUNT(__ytree[-1]);                              \
-  uint32_t n = path[-1];                                                   \
-  uint32_t i, j, k;                                                        \
-  for (i = 0; i < n; i += 1) {                                             \
-    for (j = 0; j < n; j += 1) {                                           \
-      path[i*n + j] = n;                                                   \
-    }                                                                      \
-    path[i*n + i] = 0;                                                     \
-  }                                                                        \
-  for (i = 0; i < n; i += 1) {                                             \
-    uint32_t neighbors_start  = QST_NLIST_BASE(__ytree, i);                \
-    uint32_t neighbors_length = QST_NLIST_SIZE(__ytree, i);                \
-    for (j = 0; j < neighbors_length; j += 1) {                            \
-      path[i*n + __ytree[neighbors_start + j]] = 1;                        \
-    }                                                                      \
-  }                                                                        \
-  for (k = 0; k < n; k += 1) {                                             \
-    for (i = 0; i < n; i += 1) {                                           \
-      for (j = 0; j < n; j += 1) {                                         \
-        if (path[i*n+j] > path[i*n+k] + path[k*n+j]) {                     \
-          path[i*n+j] = path[i*n+k] + path[k*n+j];                         \
-        }                                                                  \
-      }                                                                    \
-    }                                                                      \
-  }                                                                        \
-}  while (0)
+#define qstWritePathMatrix(path, utree) qsWritePathMatrix(path, (const struct QSTree *) (utree))
 
 #define qstMakeFixedStartingTree(utree)          do {                      \
   uint16_t *__ztree = (uint16_t *) utree;                                  \
@@ -1,6 +1,6 @@
 #include <stdlib.h>
 #include <stdio.h>
-#include "include/qsearch/libqs.h"
+#include "qsprivate.h"
 
 uint32_t qsTreeAllocationSize(uint32_t leaf_count) {
   return QST_BYTE_SIZE(uint16_t, leaf_count);
@@ -22,15 +22,6 @@ uint32_t qsInitializeTree(struct QSTree *tree, uint32_t leaf_count) {
   return 0;
 }
 
-struct QSTree *qsNewRandomTree(uint32_t leaf_count) {
-  struct QSTree *tree = qsNewTree(leaf_count);
-  int i;
-  for (i = 0; i < 10 * leaf_count; ++i) {
-    qsApplyRandomMutation(tree);
-  }
-  return tree;
-}
-
 struct QSTree *qsNewCloneOf(const struct QSTree *orig) {
   const uint16_t *tr = (uint16_t *) orig;
   int len;
@@ -57,7 +48,8 @@ void qsFreeTree(struct QSTree *tree) {
 }
 
 uint32_t qsCopyTreeOver(struct QSTree *destination, const struct QSTree *source) {
-  memcpy(destination, source, QST_BYTE_SIZE(uint16_t, ((uint16_t *)source)[-1]));
+  memcpy(((uint16_t *) destination) - 1, ((const uint16_t *) source) - 1,
+         QST_BYTE_SIZE(uint16_t, ((const uint16_t *) source)[-1]));
   return 0;
 }
 
@@ -118,51 +110,316 @@ uint32_t qsNormalizeTree(struct QSTree *tree) {
 }
 
 
-struct QSTScoreContext {
-  const struct QSTree *tree;
-  const double *distmatrix;   // same size as tree leaf count squared
-  const uint16_t *pathmatrix; // truncated with -1 holding length
-  double totmin, totmax, totcur;
+double qsScoreTree(const struct QSTree *tree, const uint16_t *pathmatrix,
+ const double *distmatrix) {
+  struct QSTScoreTotals totals;
+  return qsScoreTreeTotals(tree, pathmatrix, distmatrix, &totals);
+}
+
+double qsScoreTreeTotals(const struct QSTree *tree, const uint16_t *pathmatrix,
+ const double *distmatrix, struct QSTScoreTotals *totals) {
+  return qsScoreTreeTotalsParallel(tree, pathmatrix, distmatrix, NULL, totals);
+}
+
+double qsScoreFromTotals(const struct QSTScoreTotals *totals, double delta) {
+  return 1.0 - ((totals->totcur + delta - totals->totmin) /
+                (totals->totmax - totals->totmin));
+}
+
+/* Cost of the topology a path matrix induces on quartet a < b < c < d.
+ * In a binary tree two of the three pair sums are equal and the third,
+ * the consistent one, is strictly smaller. */
+static __inline__ double quartetCost(const double *distmatrix, int leaf_count,
+    const uint16_t *path, int stride, int a, int b, int c, int d) {
+  int t0 = path[a*stride + b] + path[c*stride + d];
+  int t1 = path[a*stride + c] + path[b*stride + d];
+  if (t0 < t1) {
+    return distmatrix[a*leaf_count + b] + distmatrix[c*leaf_count + d];
+  }
+  if (t1 < t0) {
+    return distmatrix[a*leaf_count + c] + distmatrix[b*leaf_count + d];
+  }
+  return distmatrix[a*leaf_count + d] + distmatrix[b*leaf_count + c];
+}
+
+struct QSTDeltaContext {
+  const double *distmatrix;
+  const uint16_t *oldpath; // full or truncated path matrix of the unmutated tree
+  const uint16_t *newpath; // truncated path matrix of the mutated tree
+  int leaf_count, oldstride;
+  double delta;
+};
+
+static void qsDeltaFuncPrivate(struct QSTDeltaContext *dc, int a, int b, int c, int d) {
+  int tmp;
+#define QST_SORT2(x, y) if (x > y) { tmp = x; x = y; y = tmp; }
+  QST_SORT2(a, b); QST_SORT2(c, d); QST_SORT2(a, c); QST_SORT2(b, d); QST_SORT2(b, c);
+#undef QST_SORT2
+  dc->delta +=
+    quartetCost(dc->distmatrix, dc->leaf_count, dc->newpath, dc->leaf_count, a, b, c, d) -
+    quartetCost(dc->distmatrix, dc->leaf_count, dc->oldpath, dc->oldstride, a, b, c, d);
+}
+
+/* Marks the leaves on the far side of the edge from -> start. */
+static void markSubtreeLeaves(const uint16_t *utree, int start, int from,
+                              uint8_t *mark, uint16_t *stack) {
+  int depth = 1;
+  stack[0] = start; stack[1] = from;
+  while (depth > 0) {
+    depth -= 1;
+    int cur = stack[2*depth], prev = stack[2*depth+1];
+    if (cur < utree[-1]) {
+      mark[cur] = 1;
+      continue;
+    }
+    int nlist = QST_NLIST_BASE(utree, cur);
+    int i;
+    for (i = 0; i < 3; ++i) {
+      int neighbor = utree[nlist+i];
+      if (neighbor == prev) { continue; }
+      stack[2*depth] = neighbor; stack[2*depth+1] = cur;
+      depth += 1;
+    }
+  }
+}
+
+/* Breadth-first distances from source to every node. */
+static void writeDistanceRow(const uint16_t *utree, int source, uint16_t *dist,
+                             uint16_t *queue) {
+  int node_count = QST_NODELIST_COUNT(utree[-1]);
+  int head = 0, tail = 0, i;
+  memset(dist, 0xff, node_count * sizeof(dist[0]));
+  dist[source] = 0;
+  queue[tail++] = source;
+  while (head < tail) {
+    int cur = queue[head++];
+    int nlist = QST_NLIST_BASE(utree, cur);
+    int nsize = QST_NLIST_SIZE(utree, cur);
+    for (i = 0; i < nsize; ++i) {
+      int neighbor = utree[nlist+i];
+      if (dist[neighbor] == 0xffff) {
+        dist[neighbor] = dist[cur] + 1;
+        queue[tail++] = neighbor;
+      }
+    }
+  }
+}
+
+/* Breadth-first distances between the first width nodes, written row by
+ * row with stride width: width is the leaf count for a truncated path
+ * matrix and the node count for a full one.  O(width * nodes) overall. */
+static void writePathRows(const struct QSTree *tree, uint16_t *pathmatrix, int width,
+                          uint16_t *queue, uint16_t *dist) {
+  const uint16_t *utree = (const uint16_t *) tree;
+  int s;
+  pathmatrix[-1] = width;
+  for (s = 0; s < width; ++s) {
+    writeDistanceRow(utree, s, dist, queue);
+    memcpy(&pathmatrix[s*width], dist, width * sizeof(dist[0]));
+  }
+}
+
+void qsWritePathMatrixScratch(uint16_t *fullpathmatrix, const struct QSTree *tree,
+                              uint16_t *scratch) {
+  const uint16_t *utree = (const uint16_t *) tree;
+  if (utree[-1] < 4 || utree[-1] > 16000) {
+    fprintf(stderr, "Error, bad tree length: %d\n", utree[-1]);
+    exit(1);
+  }
+  int node_count = QST_NODELIST_COUNT(utree[-1]);
+  writePathRows(tree, fullpathmatrix, node_count, scratch, scratch + node_count);
+}
+
+void qsWritePathMatrix(uint16_t *fullpathmatrix, const struct QSTree *tree) {
+  uint16_t *scratch = malloc(2 * qsNodeCount(tree) * sizeof(uint16_t));
+  qsWritePathMatrixScratch(fullpathmatrix, tree, scratch);
+  free(scratch);
+}
+
+struct QSTPathSource {
+  const uint16_t *fullpathmatrix;     // dense node to node distances, or
+  const struct QSTTreeIndex *index;   // an index of the same tree, or
+  const uint16_t *rows[2];            // distances from row_nodes only
+  int row_nodes[2];
 };
 
-static void qsScoreFuncPrivate(const struct QSTree *tree, struct QSTScoreContext *param, int a, int b, int c, int d) {
-  double scores[3];
-  int topos[3][4] = { { a, b, c, d }, { a, c, b, d }, { a, d, b, c } };
+static __inline__ int sourceDistance(const struct QSTree *tree,
+    const struct QSTPathSource *src, int a, int b) {
+  if (src->index != NULL) {
+    return qsTreeIndexDistance(src->index, a, b);
+  }
+  if (src->fullpathmatrix == NULL) {
+    if (b == src->row_nodes[0]) { return src->rows[0][a]; }
+    if (b == src->row_nodes[1]) { return src->rows[1][a]; }
+    if (a == src->row_nodes[0]) { return src->rows[0][b]; }
+    return src->rows[1][b];
+  }
+  return src->fullpathmatrix[a * QST_NODELIST_COUNT(((const uint16_t *) tree)[-1]) + b];
+}
+
+/* First node after a on the path from a to b, for a != b. */
+static int sourceNextHop(const struct QSTree *tree, const struct QSTPathSource *src,
+                         int a, int b) {
+  const uint16_t *utree = (const uint16_t *) tree;
+  int nlist = QST_NLIST_BASE(utree, a);
+  if (QST_NLIST_SIZE(utree, a) == 1) {
+    return utree[nlist];
+  }
+  if (src->index != NULL) {
+    return qsTreeIndexNextHop(src->index, a, b);
+  }
+  int i, best = utree[nlist], bestdist = sourceDistance(tree, src, best, b);
+  for (i = 1; i < 3; ++i) {
+    int dist = sourceDistance(tree, src, utree[nlist+i], b);
+    if (dist < bestdist) { best = utree[nlist+i]; bestdist = dist; }
+  }
+  return best;
+}
+
+static void applyMutation(struct QSTree *tree, const struct QSTPathSource *src,
+                          uint64_t mutation_code);
+
+void qsInitDeltaScratch(struct QSTDeltaScratch *scratch, uint32_t leaf_count) {
+  scratch->nexttree = qsNewTree(leaf_count);
+  scratch->newpath = qsNewPathMatrix(leaf_count);
+  scratch->queue = calloc(2 * QST_NODELIST_COUNT(leaf_count), sizeof(uint16_t));
+  scratch->members = calloc(leaf_count, sizeof(uint16_t));
+  scratch->moved = calloc(leaf_count, 1);
+  scratch->nextindex = NULL;
+}
+
+void qsFreeDeltaScratch(struct QSTDeltaScratch *scratch) {
+  qsFreeTree(scratch->nexttree);
+  qsFreePathMatrix(scratch->newpath);
+  free(scratch->queue);
+  free(scratch->members);
+  free(scratch->moved);
+  if (scratch->nextindex != NULL) {
+    qsFreeTreeIndex(scratch->nextindex);
+  }
+}
+
+double qsScoreMutationDelta(const struct QSTree *tree, const uint16_t *fullpathmatrix,
+ const double *distmatrix, uint64_t mutation_code_64) {
+  struct QSTDeltaScratch scratch;
+  qsInitDeltaScratch(&scratch, qsLeafCount(tree));
+  double delta = qsScoreMutationDeltaScratch(tree, fullpathmatrix, distmatrix,
+                                             mutation_code_64, &scratch);
+  qsFreeDeltaScratch(&scratch);
+  return delta;
+}
+
+/* Marks the leaves a mutation moves and lists them in dscratch->members,
+ * the smaller of the moved and unmoved sides first, and builds the
+ * mutated tree in dscratch->nexttree.  Only quartets with leaves on both
+ * sides can change topology.  Returns whether the moved side is first. */
+static int splitMovedLeaves(const struct QSTree *tree, const struct QSTPathSource *src,
+ uint64_t mutation_code_64, struct QSTDeltaScratch *dscratch, int *in_count, int *out_count) {
+  const uint16_t *utree = (const uint16_t *) tree;
+  const uint16_t *mutation_code = (const uint16_t *) &mutation_code_64;
+  int leaf_count = utree[-1];
   int i;
-  int leaf_count = ((uint16_t *) tree)[-1];
-  for (i = 0; i < 3; ++i) {
-    scores[i] = param->distmatrix[topos[i][0]*leaf_count+topos[i][1]] +
-                param->distmatrix[topos[i][2]*leaf_count+topos[i][3]];
-  }
-  double minScore = scores[0], maxScore = scores[0];
-  double s = scores[1];
-  const uint16_t *pathmatrix = param->pathmatrix;
-  if (s < minScore) { minScore = s; }
-  if (s > maxScore) { maxScore = s; }
-  s = scores[2];
-  if (s < minScore) { minScore = s; }
-  if (s > maxScore) { maxScore = s; }
-  for (i = 0; i < 3; ++i) {
-    int *q = &topos[i][0];
-    int consistent =
-     (pathmatrix[q[0]*leaf_count + q[1]] + pathmatrix[q[2]*leaf_count + q[3]] <
-        pathmatrix[q[0]*leaf_count + q[2]] + pathmatrix[q[1]*leaf_count + q[3]]);
-    if ( consistent ) {
-      param->totcur += scores[i];
-      param->totmin += minScore;
-      param->totmax += maxScore;
+  uint8_t *moved = dscratch->moved;
+  uint16_t *members = dscratch->members;
+  memset(moved, 0, leaf_count);
+  if (mutation_code[0] == 0) {
+    moved[mutation_code[1]] = 1;
+    moved[mutation_code[2]] = 1;
+  } else {
+    int k1 = mutation_code[1], k2 = mutation_code[2];
+    markSubtreeLeaves(utree, k1, sourceNextHop(tree, src, k1, k2), moved, dscratch->queue);
+    if (mutation_code[0] == 2) {
+      markSubtreeLeaves(utree, k2, sourceNextHop(tree, src, k2, k1), moved, dscratch->queue);
     }
   }
+  qsCopyTreeOver(dscratch->nexttree, tree);
+  applyMutation(dscratch->nexttree, src, mutation_code_64);
+  int m = 0, u = 0;
+  for (i = 0; i < leaf_count; ++i) { m += moved[i]; }
+  int inflag = (2 * m <= leaf_count) ? 1 : 0;
+  m = 0;
+  for (i = 0; i < leaf_count; ++i) {
+    if (moved[i] == inflag) { members[m++] = i; }
+  }
+  for (i = 0; i < leaf_count; ++i) {
+    if (moved[i] != inflag) { members[m + u++] = i; }
+  }
+  *in_count = m;
+  *out_count = u;
+  return inflag;
 }
 
-double qsScoreTree(const struct QSTree *tree, const uint16_t *pathmatrix,
- const double *distmatrix) {
-  struct QSTScoreContext sc;
-  sc.tree = tree; sc.pathmatrix = pathmatrix; sc.distmatrix = distmatrix;
-  sc.totmin = 0.0; sc.totmax = 0.0; sc.totcur = 0.0;
-  qstIterateQuartetsForTree(tree, qsScoreFuncPrivate, &sc);
-  double score = 1.0 - ((sc.totcur - sc.totmin) / (sc.totmax - sc.totmin));
-  return score;
+/* Which of the crossing quartets, by one, two or three leaves on the first
+ * side splitMovedLeaves lists, a mutation can change.  The moved leaves
+ * come in at most two clades that keep their own shape, and any two leaves
+ * of one clade stay paired against the rest, so quartets with three moved
+ * leaves never change.  A transfer moves one clade, so its quartets with
+ * two moved leaves cannot change either; only those of a swap or
+ * interchange, one leaf from each clade, can. */
+static void changingStrata(uint64_t mutation_code_64, int in_moved, int *strata) {
+  const uint16_t *mutation_code = (const uint16_t *) &mutation_code_64;
+  strata[0] = in_moved;
+  strata[1] = mutation_code[0] != 1;
+  strata[2] = !in_moved;
+}
+
+/* Delta scoring only reads leaf to leaf distances of the unmutated tree,
+ * so oldpath may be the full path matrix (oldstride the node count) or the
+ * truncated one (oldstride the leaf count); src finds the moved subtrees. */
+static double scoreMutationDelta(const struct QSTree *tree, const struct QSTPathSource *src,
+ const uint16_t *oldpath, int oldstride, const double *distmatrix, uint64_t mutation_code_64,
+ struct QSTDeltaScratch *dscratch) {
+  int leaf_count = ((const uint16_t *) tree)[-1];
+  int node_count = QST_NODELIST_COUNT(leaf_count);
+  int i, j, k, l, m, u, strata[3];
+  int in_moved = splitMovedLeaves(tree, src, mutation_code_64, dscratch, &m, &u);
+  changingStrata(mutation_code_64, in_moved, strata);
+  uint16_t *newpath = dscratch->newpath;
+  writePathRows(dscratch->nexttree, newpath, leaf_count, dscratch->queue,
+                dscratch->queue + node_count);
+  /* enumerate the crossing quartets that can change from whichever side
+   * is smaller */
+  uint16_t *in = dscratch->members, *out = dscratch->members + m;
+  struct QSTDeltaContext dc;
+  dc.distmatrix = distmatrix; dc.oldpath = oldpath; dc.newpath = newpath;
+  dc.leaf_count = leaf_count; dc.oldstride = oldstride; dc.delta = 0.0;
+  if (strata[0])
+    for (i = 0; i < m; ++i)
+      for (j = 0; j < u; ++j)
+        for (k = j + 1; k < u; ++k)
+          for (l = k + 1; l < u; ++l)
+            qsDeltaFuncPrivate(&dc, in[i], out[j], out[k], out[l]);
+  if (strata[1])
+    for (i = 0; i < m; ++i)
+      for (j = i + 1; j < m; ++j)
+        for (k = 0; k < u; ++k)
+          for (l = k + 1; l < u; ++l)
+            qsDeltaFuncPrivate(&dc, in[i], in[j], out[k], out[l]);
+  if (strata[2])
+    for (i = 0; i < m; ++i)
+      for (j = i + 1; j < m; ++j)
+        for (k = j + 1; k < m; ++k)
+          for (l = 0; l < u; ++l)
+            qsDeltaFuncPrivate(&dc, in[i], in[j], in[k], out[l]);
+  return dc.delta;
+}
+
+double qsScoreMutationDeltaScratch(const struct QSTree *tree, const uint16_t *fullpathmatrix,
+ const double *distmatrix, uint64_t mutation_code_64, struct QSTDeltaScratch *scratch) {
+  struct QSTPathSource src = { fullpathmatrix, NULL };
+  return scoreMutationDelta(tree, &src, fullpathmatrix, qsNodeCount(tree), distmatrix,
+                            mutation_code_64, scratch);
+}
+
+double qsScoreMutationDeltaIndexed(const struct QSTree *tree, const struct QSTTreeIndex *index,
+ const uint16_t *pathmatrix, const double *distmatrix, uint64_t mutation_code_64) {
+  struct QSTPathSource src = { NULL, index };
+  struct QSTDeltaScratch scratch;
+  qsInitDeltaScratch(&scratch, qsLeafCount(tree));
+  double delta = scoreMutationDelta(tree, &src, pathmatrix, qsLeafCount(tree), distmatrix,
+                                    mutation_code_64, &scratch);
+  qsFreeDeltaScratch(&scratch);
+  return delta;
 }
 
 int qsTreeCompare(const struct QSTree *tree_a, const struct QSTree *tree_b) {
@@ -230,22 +487,25 @@ void qsPrintTree(const struct QSTree *tree) {
   }
 }
 
-static int isNewMutation(const struct QSTree *tree,  const uint16_t *fullpathmatrix, uint64_t mut, struct QSTUInt64Table *old_trees, struct QSTree **holder) {
-  int result;
-  if (*holder)
-    qsFreeTree(*holder);
-  *holder = qsNewCloneOf(tree);
-  qsApplyMutation(*holder, fullpathmatrix, mut);
-  uint64_t hval = qsTreeHash(*holder);
-  result = qsIsUInt64InTable(old_trees, hval) ? 0 : 1;
-  if (result) {
-    qsAddUInt64ToTable(old_trees, hval);
+/* Neighbors are told apart by topology, so a mutation that only renumbers
+ * kernels or repeats an earlier neighbor is skipped before it is applied. */
+static int isNewMutation(const struct QSTree *tree,  const struct QSTPathSource *src, uint64_t mut, struct QSTUInt64Table *old_trees, struct QSTTopologyHasher *hasher, struct QSTree *holder) {
+  uint64_t hval = qsTopologyHashAfterMutation(hasher, mut);
+  if (qsIsUInt64InTable(old_trees, hval)) {
+    return 0;
   }
-  return result;
+  qsAddUInt64ToTable(old_trees, hval);
+  qsCopyTreeOver(holder, tree);
+  applyMutation(holder, src, mut);
+  return 1;
 }
 
-void qsIterateMutations(const struct QSTree *tree,
-                        const uint16_t *fullpathmatrix,
+/* old_trees must be empty; hasher is loaded with tree and holder is
+ * overwritten with each new neighbor. */
+static void iterateMutations(const struct QSTree *tree,
+                        const struct QSTPathSource *src,
+                        struct QSTUInt64Table *old_trees, struct QSTTopologyHasher *hasher,
+                        struct QSTree *holder,
                         void *obj,
   int (*mutationHandler)(const struct QSTree *tree, const struct QSTree *nexttree,  int sequence_number,
                          uint64_t mutation_code, void *obj)) {
@@ -254,21 +514,19 @@ void qsIterateMutations(const struct QSTree *tree,
   int kern_count = leaf_count - 2;
   int i, j, terminate;
   uint16_t mut[4];
-  struct QSTUInt64Table *old_trees = qsNewUInt64Table();
   uint16_t *utree = (uint16_t *) tree;
   uint64_t *m64 = (uint64_t *) &mut[0];
   mut[0] = 0;
   mut[3] = 0;
   int seqno = 0;
-  struct QSTree *holder = NULL;
-  qsAddUInt64ToTable(old_trees, qsTreeHash(tree));
+  qsAddUInt64ToTable(old_trees, qsLoadTopologyHasher(hasher, tree));
   for (i = 0; i < leaf_count; ++i) {
     mut[1] = i;
     for (j = 0; j < leaf_count; ++j) {
       if (i == j) { continue; }
-      if (fullpathmatrix[i*node_count + j] <= 2) { continue; }
+      if (sourceDistance(tree, src, i, j) <= 2) { continue; }
       mut[2] = j;
-      if (isNewMutation(tree, fullpathmatrix, *m64, old_trees, &holder)) {
+      if (isNewMutation(tree, src, *m64, old_trees, hasher, holder)) {
         terminate = mutationHandler(tree, holder, seqno, *m64, obj);
         if (terminate) { goto done; }
         seqno++;
@@ -276,25 +534,25 @@ void qsIterateMutations(const struct QSTree *tree,
     }
   }
   mut[0] = 1;
-  uint16_t path_buffer[16383];
   for (i = 0; i < node_count; ++i) {
     int jpre;
     mut[1] = i;
     for (jpre = 0; jpre < kern_count; ++jpre) {
       int j = jpre + leaf_count;
       if (i == j) { continue; }
-      if (fullpathmatrix[i*node_count + j] <= 2) { continue; }
+      if (sourceDistance(tree, src, i, j) <= 2) { continue; }
       int nlist = QST_NLIST_BASE(utree, j);
       int nsize = QST_NLIST_SIZE(utree, j);
       mut[2] = j;
-      int pathlen = qsPathFromTo(tree, fullpathmatrix, i, j, path_buffer);
+      int first_hop = sourceNextHop(tree, src, i, j);
+      int last_hop = sourceNextHop(tree, src, j, i);
       int mi;
       for (mi = 0; mi < nsize; mi++) {
         int m3 = utree[nlist + mi];
-        if (m3 == path_buffer[pathlen-2] || m3 == path_buffer[1])
+        if (m3 == last_hop || m3 == first_hop)
           continue;
         mut[3] = m3;
-        if (isNewMutation(tree, fullpathmatrix, *m64, old_trees, &holder)) {
+        if (isNewMutation(tree, src, *m64, old_trees, hasher, holder)) {
           terminate = mutationHandler(tree, holder, seqno, *m64, obj);
           if (terminate) { goto done; }
           seqno++;
@@ -311,10 +569,10 @@ void qsIterateMutations(const struct QSTree *tree,
     for (jpre = ipre; jpre < kern_count; ++jpre) {
       int j = jpre + leaf_count;
       if (i == j) { continue; }
-      if (fullpathmatrix[i*node_count + j] <= 2) { continue; }
+      if (sourceDistance(tree, src, i, j) <= 2) { continue; }
       mut[2] = j;
       mut[3] = 0;
-      if (isNewMutation(tree, fullpathmatrix, *m64, old_trees, &holder)) {
+      if (isNewMutation(tree, src, *m64, old_trees, hasher, holder)) {
         terminate = mutationHandler(tree, holder, seqno, *m64, obj);
         if (terminate) { goto done; }
         seqno++;
@@ -322,49 +580,479 @@ void qsIterateMutations(const struct QSTree *tree,
     }
   }
   done:
-    qsFreeUInt64Table(old_trees);
-    qsFreeTree(holder);
     return;
 }
 
-static int mutationCounter(const struct QSTree *tree, const struct QSTree *nexttree, int sequence_number,
-                       uint64_t mutation_code, void *obj) {
-  int *iptr = (int *) obj;
-  (*iptr) += 1;
-  return 0;
+static struct QSTSearchWorkspace *newSearchWorkspace(uint32_t leaf_count, int worker_count,
+                                                     int lean) {
+  struct QSTSearchWorkspace *workspace = calloc(sizeof(struct QSTSearchWorkspace), 1);
+  int i;
+  verifyLeafCount(leaf_count);
+  if (worker_count < 1) {
+    worker_count = 1;
+  }
+  workspace->leaf_count = leaf_count;
+  workspace->worker_count = worker_count;
+  workspace->holder = qsNewTree(leaf_count);
+  if (lean) {
+    workspace->index = qsNewTreeIndex(workspace->holder);
+  } else {
+    workspace->fullpathmatrix = qsNewFullPathMatrix(leaf_count);
+  }
+  workspace->pathmatrix = qsNewPathMatrix(leaf_count);
+  workspace->queue = calloc(2 * QST_NODELIST_COUNT(leaf_count), sizeof(uint16_t));
+  workspace->old_trees = qsNewUInt64Table();
+  workspace->hasher = qsNewTopologyHasher(leaf_count);
+  workspace->delta = calloc(worker_count, sizeof(struct QSTDeltaScratch));
+  for (i = 0; i < worker_count; ++i) {
+    qsInitDeltaScratch(&workspace->delta[i], leaf_count);
+  }
+  workspace->sample = malloc(QST_SAMPLE_SCRATCH_SIZE(leaf_count));
+  workspace->scored = qsNewTree(leaf_count);
+  return workspace;
 }
 
-static int mutationExtractor(const struct QSTree *tree,  const struct QSTree *nexttree, int sequence_number,
-                       uint64_t mutation_code, void *obj) {
-  uint64_t *mptr = (uint64_t *) obj;
-  if (sequence_number == mptr[0]) {
-    mptr[1] = mutation_code;
-  }
-  return 0;
+struct QSTSearchWorkspace *qsNewSearchWorkspace(uint32_t leaf_count, int worker_count) {
+  return newSearchWorkspace(leaf_count, worker_count, 0);
 }
 
+struct QSTSearchWorkspace *qsNewLeanSearchWorkspace(uint32_t leaf_count, int worker_count) {
+  return newSearchWorkspace(leaf_count, worker_count, 1);
+}
 
-void qsApplyRandomMutation(struct QSTree *tree) {
-  uint16_t *utree = (uint16_t *) tree;
-  int counter = 0;
-  uint64_t muta[2] = { 0, 0 };
-  uint16_t *fullpathmatrix = qsNewFullPathMatrix(utree[-1]);
-  qstWritePathMatrix(fullpathmatrix, tree);
-  qsIterateMutations(tree, fullpathmatrix, &counter, mutationCounter);
-  muta[0] = rand() % counter; // TODO
-  qsIterateMutations(tree, fullpathmatrix, muta, mutationExtractor);
-  if (muta[1] != 0) {
-    qsApplyMutation(tree, fullpathmatrix, muta[1]);
+int qsIsLeanSearchWorkspace(const struct QSTSearchWorkspace *workspace) {
+  return workspace->index != NULL;
+}
+
+struct QSTSearchWorkspace *qsNewSearchWorkspaceLike(const struct QSTSearchWorkspace *like,
+                                                    uint32_t leaf_count, int worker_count) {
+  return newSearchWorkspace(leaf_count, worker_count, like->index != NULL);
+}
+
+void qsFreeSearchWorkspace(struct QSTSearchWorkspace *workspace) {
+  int i;
+  for (i = 0; i < workspace->worker_count; ++i) {
+    qsFreeDeltaScratch(&workspace->delta[i]);
+  }
+  free(workspace->delta);
+  free(workspace->sample);
+  qsFreeTree(workspace->scored);
+  qsFreeUInt64Table(workspace->old_trees);
+  qsFreeTopologyHasher(workspace->hasher);
+  free(workspace->queue);
+  qsFreePathMatrix(workspace->pathmatrix);
+  if (workspace->index != NULL) {
+    qsFreeTreeIndex(workspace->index);
   } else {
-    fprintf(stderr, "Mutation logic error 001.\n");
+    qsFreeFullPathMatrix(workspace->fullpathmatrix);
+  }
+  qsFreeTree(workspace->holder);
+  free(workspace->codes);
+  free(workspace->weights);
+  free(workspace);
+}
+
+void qsReserveWorkspaceCandidates(struct QSTSearchWorkspace *workspace, int count) {
+  if (count <= workspace->capacity) {
+    return;
+  }
+  while (workspace->capacity < count) {
+    workspace->capacity = workspace->capacity ? 2 * workspace->capacity : 256;
+  }
+  workspace->codes = realloc(workspace->codes, workspace->capacity * sizeof(uint64_t));
+  workspace->weights = realloc(workspace->weights, workspace->capacity * sizeof(double));
+}
+
+static void checkWorkspace(const struct QSTSearchWorkspace *workspace, const struct QSTree *tree) {
+  if (workspace->leaf_count != qsLeafCount(tree)) {
+    fprintf(stderr, "Error, workspace built for %d leaves used with %d.\n",
+            workspace->leaf_count, qsLeafCount(tree));
     exit(1);
   }
-  qsFreeFullPathMatrix(fullpathmatrix);
+}
+
+void qsIterateMutations(const struct QSTree *tree,
+                        const uint16_t *fullpathmatrix,
+                        void *obj,
+  int (*mutationHandler)(const struct QSTree *tree, const struct QSTree *nexttree,  int sequence_number,
+                         uint64_t mutation_code, void *obj)) {
+  struct QSTPathSource src = { fullpathmatrix, NULL };
+  struct QSTUInt64Table *old_trees = qsNewUInt64Table();
+  struct QSTTopologyHasher *hasher = qsNewTopologyHasher(qsLeafCount(tree));
+  struct QSTree *holder = qsNewTree(qsLeafCount(tree));
+  iterateMutations(tree, &src, old_trees, hasher, holder, obj, mutationHandler);
+  qsFreeTree(holder);
+  qsFreeTopologyHasher(hasher);
+  qsFreeUInt64Table(old_trees);
+}
+
+void qsIterateMutationsWorkspace(const struct QSTree *tree,
+                        const uint16_t *fullpathmatrix,
+                        struct QSTSearchWorkspace *workspace,
+                        void *obj,
+  int (*mutationHandler)(const struct QSTree *tree, const struct QSTree *nexttree,  int sequence_number,
+                         uint64_t mutation_code, void *obj)) {
+  struct QSTPathSource src = { fullpathmatrix, NULL };
+  checkWorkspace(workspace, tree);
+  qsResetUInt64Table(workspace->old_trees);
+  iterateMutations(tree, &src, workspace->old_trees, workspace->hasher, workspace->holder,
+                   obj, mutationHandler);
+}
+
+/* The loaded tree's distances come from the full path matrix or, in a
+ * lean workspace, from the tree index. */
+static struct QSTPathSource workspaceSource(const struct QSTSearchWorkspace *workspace) {
+  struct QSTPathSource src = { workspace->fullpathmatrix, workspace->index };
+  return src;
+}
+
+void qsLoadWorkspaceTree(struct QSTSearchWorkspace *workspace, const struct QSTree *tree) {
+  checkWorkspace(workspace, tree);
+  if (workspace->index != NULL) {
+    int node_count = qsNodeCount(tree);
+    qsUpdateTreeIndex(workspace->index, tree);
+    writePathRows(tree, workspace->pathmatrix, workspace->leaf_count, workspace->queue,
+                  workspace->queue + node_count);
+  } else {
+    qsWritePathMatrixScratch(workspace->fullpathmatrix, tree, workspace->queue);
+    qstWriteTruncatedPathMatrix(workspace->pathmatrix, workspace->fullpathmatrix);
+  }
+}
+
+void qsIterateWorkspaceMutations(const struct QSTree *tree,
+                        struct QSTSearchWorkspace *workspace,
+                        void *obj,
+  int (*mutationHandler)(const struct QSTree *tree, const struct QSTree *nexttree,  int sequence_number,
+                         uint64_t mutation_code, void *obj)) {
+  struct QSTPathSource src = workspaceSource(workspace);
+  qsResetUInt64Table(workspace->old_trees);
+  iterateMutations(tree, &src, workspace->old_trees, workspace->hasher, workspace->holder,
+                   obj, mutationHandler);
+}
+
+double qsScoreWorkspaceMutationDelta(const struct QSTree *tree,
+ const struct QSTSearchWorkspace *workspace, const double *distmatrix, uint64_t mutation_code,
+ int worker) {
+  struct QSTPathSource src = workspaceSource(workspace);
+  if (workspace->index != NULL) {
+    return scoreMutationDelta(tree, &src, workspace->pathmatrix, workspace->leaf_count,
+                              distmatrix, mutation_code, &workspace->delta[worker]);
+  }
+  return scoreMutationDelta(tree, &src, workspace->fullpathmatrix, qsNodeCount(tree),
+                            distmatrix, mutation_code, &workspace->delta[worker]);
+}
+
+/* Distinct draws from [0, count), which must be at least k. */
+static void drawDistinct(struct QSTRandom *rng, int count, int k, int *picks) {
+  int i, j;
+  for (i = 0; i < k; ++i) {
+    do {
+      picks[i] = qsRandomNext(rng) % count;
+      for (j = 0; j < i && picks[j] != picks[i]; ++j) { }
+    } while (j < i);
+  }
+}
+
+static __inline__ double indexedQuartetCost(const double *distmatrix, int leaf_count,
+    const struct QSTTreeIndex *index, int a, int b, int c, int d) {
+  switch (qsTreeIndexQuartetTopology(index, a, b, c, d)) {
+    case 0: return distmatrix[a*leaf_count + b] + distmatrix[c*leaf_count + d];
+    case 1: return distmatrix[a*leaf_count + c] + distmatrix[b*leaf_count + d];
+  }
+  return distmatrix[a*leaf_count + d] + distmatrix[b*leaf_count + c];
+}
+
+/* Estimate of qsScoreWorkspaceMutationDelta from about sample_count of
+ * the crossing quartets that can change.  Those with one, two or three
+ * leaves on the smaller side are sampled as three strata, in proportion to
+ * their numbers, and the mutated tree is only indexed rather than given a
+ * path matrix.  With no more such quartets than samples the delta is
+ * exact. */
+double qsEstimateWorkspaceMutationDelta(const struct QSTree *tree,
+ const struct QSTSearchWorkspace *workspace, const double *distmatrix, uint64_t mutation_code,
+ int sample_count, struct QSTRandom *rng, int worker) {
+  struct QSTPathSource src = workspaceSource(workspace);
+  struct QSTDeltaScratch *dscratch = &workspace->delta[worker];
+  int leaf_count = workspace->leaf_count, m, u, kind, i, j, strata[3];
+  int in_moved = splitMovedLeaves(tree, &src, mutation_code, dscratch, &m, &u);
+  changingStrata(mutation_code, in_moved, strata);
+  double sizes[3];
+  sizes[0] = strata[0] ? m * (u * (u - 1.0) * (u - 2.0) / 6.0) : 0;
+  sizes[1] = strata[1] ? m * (m - 1.0) / 2.0 * (u * (u - 1.0) / 2.0) : 0;
+  sizes[2] = strata[2] ? m * (m - 1.0) * (m - 2.0) / 6.0 * u : 0;
+  double total = sizes[0] + sizes[1] + sizes[2];
+  if (total <= sample_count) {
+    return qsScoreWorkspaceMutationDelta(tree, workspace, distmatrix, mutation_code, worker);
+  }
+  if (dscratch->nextindex == NULL) {
+    dscratch->nextindex = qsNewTreeIndex(dscratch->nexttree);
+  } else {
+    qsUpdateTreeIndex(dscratch->nextindex, dscratch->nexttree);
+  }
+  const uint16_t *in = dscratch->members, *out = dscratch->members + m;
+  double delta = 0.0;
+  for (kind = 0; kind < 3; ++kind) {
+    if (sizes[kind] == 0) {
+      continue;
+    }
+    int draws = (int) (sample_count * sizes[kind] / total + 0.5), picks[4], q[4];
+    double sum = 0.0;
+    if (draws < 1) {
+      draws = 1;
+    }
+    for (i = 0; i < draws; ++i) {
+      drawDistinct(rng, m, kind + 1, picks);
+      drawDistinct(rng, u, 3 - kind, picks + kind + 1);
+      for (j = 0; j < 4; ++j) {
+        q[j] = j <= kind ? in[picks[j]] : out[picks[j]];
+      }
+      sum += indexedQuartetCost(distmatrix, leaf_count, dscratch->nextindex,
+                                q[0], q[1], q[2], q[3]) -
+             quartetCost(distmatrix, leaf_count, workspace->pathmatrix, leaf_count,
+                         q[0], q[1], q[2], q[3]);
+    }
+    delta += sizes[kind] * sum / draws;
+  }
+  return delta;
+}
+
+void qsApplyWorkspaceMutation(struct QSTree *tree, const struct QSTSearchWorkspace *workspace,
+                              uint64_t mutation_code) {
+  struct QSTPathSource src = workspaceSource(workspace);
+  applyMutation(tree, &src, mutation_code);
+}
+
+void qsIterateMutationsIndexed(const struct QSTree *tree,
+                        const struct QSTTreeIndex *index,
+                        void *obj,
+  int (*mutationHandler)(const struct QSTree *tree, const struct QSTree *nexttree,  int sequence_number,
+                         uint64_t mutation_code, void *obj)) {
+  struct QSTPathSource src = { NULL, index };
+  struct QSTUInt64Table *old_trees = qsNewUInt64Table();
+  struct QSTTopologyHasher *hasher = qsNewTopologyHasher(qsLeafCount(tree));
+  struct QSTree *holder = qsNewTree(qsLeafCount(tree));
+  iterateMutations(tree, &src, old_trees, hasher, holder, obj, mutationHandler);
+  qsFreeTree(holder);
+  qsFreeTopologyHasher(hasher);
+  qsFreeUInt64Table(old_trees);
+}
+
+static uint64_t randomBelow(struct QSTRandom *rng, uint64_t bound) {
+  if (rng != NULL) {
+    return qsRandomNext(rng) % bound;
+  }
+  return ((((uint64_t) rand()) << 31) ^ (uint64_t) rand()) % bound;
+}
+
+/* Draws a mutation code uniformly from the codes iterateMutations tries:
+ * leaf swaps and subtree interchanges between i < j, and subtree
+ * transfers, in each case only between nodes more than two edges apart.
+ * A candidate is drawn from the box of all index combinations of one of
+ * the three classes, picked in proportion to box size, and drawn again
+ * when it is not valid, which keeps the result uniform across classes.
+ * Each try costs at most two breadth first searches.  On return src
+ * holds distance rows from both endpoints, enough for applyMutation.
+ * scratch is QST_SAMPLE_SCRATCH_SIZE bytes. */
+static uint64_t sampleMutation(const struct QSTree *tree, struct QSTRandom *rng,
+                               uint16_t *scratch, struct QSTPathSource *src) {
+  const uint16_t *utree = (const uint16_t *) tree;
+  uint64_t leaf_count = utree[-1];
+  uint64_t node_count = QST_NODELIST_COUNT(leaf_count);
+  uint64_t kern_count = leaf_count - 2;
+  uint64_t swap_box = leaf_count * leaf_count;
+  uint64_t transfer_box = node_count * kern_count * 3;
+  uint64_t interchange_box = kern_count * kern_count;
+  uint16_t *queue = scratch + 2 * node_count;
+  uint64_t m64;
+  uint16_t *mut = (uint16_t *) &m64;
+  memset(src, 0, sizeof(*src));
+  src->rows[0] = scratch;
+  src->rows[1] = scratch + node_count;
+  for (;;) {
+    uint64_t box = randomBelow(rng, swap_box + transfer_box + interchange_box);
+    int i, j;
+    m64 = 0;
+    if (box < swap_box) {
+      i = randomBelow(rng, leaf_count);
+      j = randomBelow(rng, leaf_count);
+      if (i >= j || utree[i] == utree[j]) { continue; }
+      mut[1] = i; mut[2] = j;
+      return m64;
+    }
+    if (box < swap_box + transfer_box) {
+      i = randomBelow(rng, node_count);
+      j = leaf_count + randomBelow(rng, kern_count);
+      mut[0] = 1;
+      mut[3] = utree[QST_NLIST_BASE(utree, j) + randomBelow(rng, 3)];
+    } else {
+      i = leaf_count + randomBelow(rng, kern_count);
+      j = leaf_count + randomBelow(rng, kern_count);
+      if (i >= j) { continue; }
+      mut[0] = 2;
+    }
+    if (i == j) { continue; }
+    mut[1] = i; mut[2] = j;
+    src->row_nodes[0] = i;
+    src->row_nodes[1] = j;
+    writeDistanceRow(utree, j, scratch + node_count, queue);
+    if (src->rows[1][i] <= 2) { continue; }
+    writeDistanceRow(utree, i, scratch, queue);
+    if (mut[0] == 1 && (mut[3] == sourceNextHop(tree, src, j, i) ||
+                        mut[3] == sourceNextHop(tree, src, i, j))) {
+      continue;
+    }
+    return m64;
+  }
+}
+
+uint64_t qsSampleMutationWith(const struct QSTree *tree, struct QSTRandom *rng,
+                              uint16_t *scratch) {
+  struct QSTPathSource src;
+  return sampleMutation(tree, rng, scratch, &src);
+}
+
+void qsApplyRandomMutationWith(struct QSTree *tree, struct QSTRandom *rng, uint16_t *scratch) {
+  struct QSTPathSource src;
+  applyMutation(tree, &src, sampleMutation(tree, rng, scratch, &src));
+}
+
+void qsRandomizeTreeWith(struct QSTree *tree, struct QSTRandom *rng, uint16_t *scratch) {
+  int i;
+  for (i = 0; i < 10 * qsLeafCount(tree); ++i) {
+    qsApplyRandomMutationWith(tree, rng, scratch);
+  }
+}
+
+uint64_t qsSampleMutation(const struct QSTree *tree) {
+  uint16_t *scratch = malloc(QST_SAMPLE_SCRATCH_SIZE(qsLeafCount(tree)));
+  uint64_t mutation_code = qsSampleMutationWith(tree, NULL, scratch);
+  free(scratch);
+  return mutation_code;
+}
+
+void qsApplyRandomMutation(struct QSTree *tree) {
+  uint16_t *scratch = malloc(QST_SAMPLE_SCRATCH_SIZE(qsLeafCount(tree)));
+  qsApplyRandomMutationWith(tree, NULL, scratch);
+  free(scratch);
+}
+
+struct QSTree *qsNewRandomTree(uint32_t leaf_count) {
+  struct QSTree *tree = qsNewTree(leaf_count);
+  uint16_t *scratch = malloc(QST_SAMPLE_SCRATCH_SIZE(leaf_count));
+  qsRandomizeTreeWith(tree, NULL, scratch);
+  free(scratch);
+  return tree;
+}
+
+/* Adding a leaf leaves the topology among the old leaves alone, so only
+ * the quartets with the new leaf x tell insertion points apart.  With x
+ * hung off a new kernel in edge (u, v), x is 2 + min(d(u,p), d(v,p)) from
+ * an old leaf p, and two old leaves are one further apart when the edge
+ * lies between them; the smallest pair sum then gives each quartet's
+ * topology.  That is C(n,3) triples for each of the 2n-3 edges, about
+ * n^4/3 in all: O(n^4) and some 8 times the quartets of one full scoring,
+ * done serially. */
+static double insertionCost(const double *distmatrix, uint32_t leaf_count,
+                            const uint16_t *pathmatrix, const uint16_t *reach,
+                            const uint8_t *side) {
+  uint32_t n = leaf_count, x = leaf_count, a, b, c;
+  double cost = 0;
+  for (a = 0; a < n; ++a) {
+    for (b = a + 1; b < n; ++b) {
+      int ab = pathmatrix[a*n + b] + (side[a] != side[b]);
+      for (c = b + 1; c < n; ++c) {
+        int ac = pathmatrix[a*n + c] + (side[a] != side[c]);
+        int bc = pathmatrix[b*n + c] + (side[b] != side[c]);
+        int t0 = ab + reach[c], t1 = ac + reach[b], t2 = bc + reach[a];
+        if (t0 < t1 && t0 < t2) {
+          cost += distmatrix[a*(n+1) + b] + distmatrix[c*(n+1) + x];
+        } else if (t1 < t2) {
+          cost += distmatrix[a*(n+1) + c] + distmatrix[b*(n+1) + x];
+        } else {
+          cost += distmatrix[b*(n+1) + c] + distmatrix[a*(n+1) + x];
+        }
+      }
+    }
+  }
+  return cost;
+}
+
+struct QSTree *qsInsertLeaf(const struct QSTree *tree, const double *distmatrix) {
+  const uint16_t *utree = (const uint16_t *) tree;
+  uint32_t n = utree[-1], node_count = QST_NODELIST_COUNT(n), i, j, k, p;
+  struct QSTTreeIndex *index = qsNewTreeIndex(tree);
+  uint16_t *pathmatrix = qsNewPathMatrix(n);
+  uint16_t *reach = malloc(n * sizeof(uint16_t));
+  uint8_t *side = malloc(n);
+  uint32_t best_u = 0, best_v = 0;
+  double best_cost = 0;
+  int found = 0;
+  verifyLeafCount(n + 1);
+  qsTreeIndexWritePathMatrix(index, pathmatrix);
+  for (i = 0; i < node_count; ++i) {
+    for (k = 0; k < QST_NLIST_SIZE(utree, i); ++k) {
+      j = utree[QST_NLIST_BASE(utree, i) + k];
+      if (j < i) {
+        continue;
+      }
+      for (p = 0; p < n; ++p) {
+        uint32_t du = qsTreeIndexDistance(index, i, p), dv = qsTreeIndexDistance(index, j, p);
+        reach[p] = 2 + (du < dv ? du : dv);
+        side[p] = du < dv;
+      }
+      double cost = insertionCost(distmatrix, n, pathmatrix, reach, side);
+      if (!found || cost < best_cost) {
+        best_cost = cost;
+        best_u = i;
+        best_v = j;
+        found = 1;
+      }
+    }
+  }
+  /* kernels move up one to make room for leaf n; the new kernel is last */
+  struct QSTree *result = qsNewTree(n + 1);
+  uint16_t *rtree = (uint16_t *) result;
+  uint32_t kernel = 2 * n - 1;
+  QST_DISINTEGRATE_TREE(rtree);
+  for (i = 0; i < node_count; ++i) {
+    for (k = 0; k < QST_NLIST_SIZE(utree, i); ++k) {
+      j = utree[QST_NLIST_BASE(utree, i) + k];
+      if (j < i || (i == best_u && j == best_v)) {
+        continue;
+      }
+      uint32_t ri = i < n ? i : i + 1, rj = j < n ? j : j + 1;
+      QST_CONNECT_BOTH(uint16_t, rtree, ri, rj);
+    }
+  }
+  best_u = best_u < n ? best_u : best_u + 1;
+  best_v = best_v < n ? best_v : best_v + 1;
+  QST_CONNECT_BOTH(uint16_t, rtree, kernel, best_u);
+  QST_CONNECT_BOTH(uint16_t, rtree, kernel, best_v);
+  QST_CONNECT_BOTH(uint16_t, rtree, kernel, n);
+  qsNormalizeTree(result);
+  free(side);
+  free(reach);
+  qsFreePathMatrix(pathmatrix);
+  qsFreeTreeIndex(index);
+  return result;
 }
 
 void qsApplyMutation(struct QSTree *tree,
                         const uint16_t *fullpathmatrix,
-                        uint64_t mutation_code_64) {
+                        uint64_t mutation_code) {
+  struct QSTPathSource src = { fullpathmatrix, NULL };
+  applyMutation(tree, &src, mutation_code);
+}
+
+void qsApplyMutationIndexed(struct QSTree *tree,
+                        const struct QSTTreeIndex *index,
+                        uint64_t mutation_code) {
+  struct QSTPathSource src = { NULL, index };
+  applyMutation(tree, &src, mutation_code);
+}
+
+static void applyMutation(struct QSTree *tree, const struct QSTPathSource *src,
+                          uint64_t mutation_code_64) {
   uint16_t *utree = (uint16_t *) tree;
   uint16_t *mutation_code = (uint16_t *) &mutation_code_64;
   int mcode = mutation_code[0];
@@ -381,12 +1069,10 @@ void qsApplyMutation(struct QSTree *tree,
     return;
   }
   if (mcode == 1) { // subtree transfer
-    uint16_t path_buffer[16383];
     int k1 = mutation_code[1];
     int k2 = mutation_code[2];
     int m3 = mutation_code[3];
-    qsPathFromTo(tree, fullpathmatrix, k1, k2, path_buffer);
-    int i1 = path_buffer[1];
+    int i1 = sourceNextHop(tree, src, k1, k2);
     int nlist = QST_NLIST_BASE(utree, i1);
     QST_REMOVE_FROM_BOTH(uint16_t, utree, k1, i1);
     int ms[3], mc=0, mo;
@@ -409,12 +1095,10 @@ void qsApplyMutation(struct QSTree *tree,
     return;
   }
   if (mcode == 2) { // subtree interchange
-    uint16_t path_buffer[16383];
     int k1 = mutation_code[1];
     int k2 = mutation_code[2];
-    int pathlen = qsPathFromTo(tree, fullpathmatrix, k1, k2, path_buffer);
-    int n1 = path_buffer[1];
-    int n2 = path_buffer[pathlen-2];
+    int n1 = sourceNextHop(tree, src, k1, k2);
+    int n2 = sourceNextHop(tree, src, k2, k1);
     QST_REMOVE_FROM_BOTH(uint16_t, utree, n1, k1);
     QST_REMOVE_FROM_BOTH(uint16_t, utree, n2, k2);
     QST_CONNECT_BOTH(uint16_t, utree, n1, k2);
@@ -474,57 +1158,96 @@ uint64_t qsTreeHashHex(const struct QSTree *tree, char hval[17]) {
   return result;
 }
 
-struct QSTUInt64Node {
-  struct QSTUInt64Node *next;
+/* Open addressing set of 64 bit values with linear probing.  A slot is in
+ * use only when its generation matches the table's, so emptying the table
+ * is a counter increment; every value, 0 included, can be stored.  The
+ * table doubles whenever it becomes half full and keeps that size across
+ * resets, so a reused table settles at the size of the largest set it
+ * has held. */
+struct QSTUInt64Slot {
   uint64_t val;
+  uint32_t generation;
 };
 
 struct QSTUInt64Table {
-  uint32_t hashtab_size;
-  struct QSTUInt64Node *hashtab;
+  uint32_t size;                  // slots, a power of two
+  uint32_t count;
+  uint32_t generation;
+  struct QSTUInt64Slot *slots;
 };
 
+#define QST_UINT64_TABLE_INITIAL_SIZE 1024
+
+static __inline__ uint32_t uint64SlotIndex(const struct QSTUInt64Table *hashtab, uint64_t val) {
+  return (uint32_t) ((val * 0x9e3779b97f4a7c15ULL) >> 32) & (hashtab->size - 1);
+}
+
+static void allocateUInt64Slots(struct QSTUInt64Table *hashtab, uint32_t size) {
+  hashtab->size = size;
+  hashtab->count = 0;
+  hashtab->generation = 1;
+  hashtab->slots = calloc(size, sizeof(struct QSTUInt64Slot));
+  if (hashtab->slots == NULL) {
+    fprintf(stderr, "Error, cannot allocate hash table of %u slots.\n", size);
+    exit(1);
+  }
+}
+
 struct QSTUInt64Table *qsNewUInt64Table(void) {
   struct QSTUInt64Table *hashtab = calloc(sizeof(struct QSTUInt64Table), 1);
-  hashtab->hashtab_size = 111191;
-  hashtab->hashtab = calloc(sizeof(struct QSTUInt64Node), hashtab->hashtab_size);
+  allocateUInt64Slots(hashtab, QST_UINT64_TABLE_INITIAL_SIZE);
   return hashtab;
 }
 
+static void insertUInt64(struct QSTUInt64Table *hashtab, uint64_t val) {
+  uint32_t mask = hashtab->size - 1, i = uint64SlotIndex(hashtab, val);
+  while (hashtab->slots[i].generation == hashtab->generation) {
+    if (hashtab->slots[i].val == val) {
+      return;
+    }
+    i = (i + 1) & mask;
+  }
+  hashtab->slots[i].val = val;
+  hashtab->slots[i].generation = hashtab->generation;
+  hashtab->count += 1;
+}
+
 void qsAddUInt64ToTable(struct QSTUInt64Table *hashtab, uint64_t val) {
-  uint64_t reduced = val % hashtab->hashtab_size;
-  if (hashtab->hashtab[reduced].val == 0) {
-    hashtab->hashtab[reduced].val = val;
-    return;
+  if (2 * (hashtab->count + 1) > hashtab->size) {
+    struct QSTUInt64Slot *old = hashtab->slots;
+    uint32_t old_size = hashtab->size, old_generation = hashtab->generation, i;
+    allocateUInt64Slots(hashtab, 2 * old_size);
+    for (i = 0; i < old_size; ++i) {
+      if (old[i].generation == old_generation) {
+        insertUInt64(hashtab, old[i].val);
+      }
+    }
+    free(old);
   }
-  struct QSTUInt64Node *cur = calloc(sizeof(struct QSTUInt64Node), 1);
-  cur->val = val;
-  cur->next = hashtab->hashtab[reduced].next;
-  hashtab->hashtab[reduced].next = cur;
+  insertUInt64(hashtab, val);
 }
 
 int qsIsUInt64InTable(const struct QSTUInt64Table *hashtab, uint64_t val) {
-  uint64_t reduced = val % hashtab->hashtab_size;
-  struct QSTUInt64Node *cur = &hashtab->hashtab[reduced];
-  while (cur != NULL) {
-    if (val == cur->val) {
+  uint32_t mask = hashtab->size - 1, i = uint64SlotIndex(hashtab, val);
+  while (hashtab->slots[i].generation == hashtab->generation) {
+    if (hashtab->slots[i].val == val) {
       return 1;
     }
-    cur = cur->next;
+    i = (i + 1) & mask;
   }
   return 0;
 }
 
-void qsFreeUInt64Table(struct QSTUInt64Table *hashtab) {
-  int i;
-  for (i = 0; i < hashtab->hashtab_size; ++i) {
-    struct QSTUInt64Node *cur = hashtab->hashtab[i].next;
-    while (cur != NULL) {
-      struct QSTUInt64Node *next_cur = cur->next;
-      free(cur);
-      cur = next_cur;
-    }
+void qsResetUInt64Table(struct QSTUInt64Table *hashtab) {
+  hashtab->count = 0;
+  hashtab->generation += 1;
+  if (hashtab->generation == 0) {   // wrapped; stale slots could look live
+    memset(hashtab->slots, 0, hashtab->size * sizeof(struct QSTUInt64Slot));
+    hashtab->generation = 1;
   }
-  free(hashtab->hashtab);
+}
+
+void qsFreeUInt64Table(struct QSTUInt64Table *hashtab) {
+  free(hashtab->slots);
   free(hashtab);
 }
@@ -1,125 +1,969 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
-#include "include/qsearch/libqs.h"
+#include <pthread.h>
+#include "qsprivate.h"
 
 struct MCMCContext {
+  const struct QSTree *tree;
   const double *distmatrix;
+  struct QSTSearchWorkspace *workspace; // path matrices of tree, candidates
+  struct QSTScoreTotals totals;   // of the tree being stepped
   double beta;
-  double total_weight;
-  double nonmove_weight;
-  double cutoff_weight;
-  double last_score;
-  uint64_t mutation_code;
+  int count;                      // distinct neighbors, in enumeration order
+  uint64_t seed;                  // of the screening streams, one per neighbor
+  int samples;                    // quartets to screen each neighbor with
+  const int *chosen;              // neighbors to score exactly after screening
 };
 
-static double scoreToWeight(double score, double beta) {
+/* candidates scored per thread pool task */
+#define QST_CANDIDATE_BATCH 8
+
+/* accepted Metropolis moves between exact rescorings */
+#define QST_METROPOLIS_RESCORE 64
+
+static double scoreToLogWeight(double score, double beta) {
   double invprob = (1 - score) * beta;
   if (invprob < 0) { invprob = 0; }
-  return exp(-invprob);
+  return -invprob;
+}
+
+static double scoreToWeight(double score, double beta) {
+  return exp(scoreToLogWeight(score, beta));
+}
+
+static double drawUnit(struct QSTRandom *rng) {
+  return rng ? qsRandomUnit(rng) : (rand() % 1000000000) / 1000000000.0;
 }
 
 
-static int mutationAccumulator(const struct QSTree *tree,  const struct QSTree *nexttree, int sequence_number,
+static int mutationCollector(const struct QSTree *tree,  const struct QSTree *nexttree, int sequence_number,
                        uint64_t mutation_code, void *obj) {
   struct MCMCContext *mcc = (struct MCMCContext *) obj;
-  uint16_t *fullpathmatrix = qsNewFullPathMatrix(qsLeafCount(nexttree));
-  uint16_t *pathmatrix = qsNewPathMatrix(qsLeafCount(nexttree));
-  qstWritePathMatrix(fullpathmatrix, nexttree);
-  qstWriteTruncatedPathMatrix(pathmatrix, fullpathmatrix);
-  double score = qsScoreTree(nexttree, pathmatrix, mcc->distmatrix);
-  mcc->last_score = score;
-  qsFreePathMatrix(pathmatrix);
-  qsFreeFullPathMatrix(fullpathmatrix);
-  double weight = scoreToWeight(score, mcc->beta);
-  mcc->total_weight += weight;
-  if (mcc->cutoff_weight >= 0 && mcc->total_weight >= mcc->cutoff_weight) {
-    mcc->mutation_code = mutation_code;
-    return 1;
-  }
+  qsReserveWorkspaceCandidates(mcc->workspace, mcc->count + 1);
+  mcc->workspace->codes[mcc->count++] = mutation_code;
   return 0;
 }
 
+static void candidateWeightTask(void *obj, int task_index, int worker) {
+  struct MCMCContext *mcc = (struct MCMCContext *) obj;
+  struct QSTSearchWorkspace *ws = mcc->workspace;
+  int i = task_index * QST_CANDIDATE_BATCH;
+  int end = i + QST_CANDIDATE_BATCH < mcc->count ? i + QST_CANDIDATE_BATCH : mcc->count;
+  for (; i < end; ++i) {
+    double delta = qsScoreWorkspaceMutationDelta(mcc->tree, ws, mcc->distmatrix, ws->codes[i],
+                                                 worker);
+    ws->weights[i] = scoreToWeight(qsScoreFromTotals(&mcc->totals, delta), mcc->beta);
+  }
+}
 
-#if 0
-void qsApplyRandomMutation(struct QSTree *tree) {
-  uint16_t *utree = (uint16_t *) tree;
-  int counter = 0;
-  uint64_t muta[2] = { 0, 0 };
-  qstWritePathMatrix(fullpathmatrix, tree);
-  qsIterateMutations(tree, fullpathmatrix, &counter, mutationCounter);
-  muta[0] = rand() % counter; // TODO
-#endif
+/* The score cache key of tree: its topology, the distances and whether
+ * they were scored through a model, which rounds a little differently.
+ * A model hashes its distances once when it is made; bare distances are
+ * hashed every time, since a pointer says nothing about what it holds. */
+static uint64_t scoreCacheKey(struct QSTSearchWorkspace *workspace, const struct QSTree *tree,
+                              const double *distmatrix, const struct QSTScoreModel *model) {
+  uint64_t matrix = model != NULL ? model->hash + 1
+                                  : qsHashDistances(distmatrix, workspace->leaf_count);
+  return qsLoadTopologyHasher(workspace->hasher, tree) ^ matrix * 0xff51afd7ed558ccdULL;
+}
 
-double qsStepMCMC(struct QSTree *tree, const double *distmatrix, double beta) {
-  struct MCMCContext *mcc = calloc(sizeof(struct MCMCContext), 1);
-  uint16_t *fullpathmatrix = qsNewFullPathMatrix(qsLeafCount(tree));
-  uint16_t *pathmatrix = qsNewPathMatrix(qsLeafCount(tree));
-//  int leaf_count = qsLeafCount(tree);
-//  int node_count = qsNodeCount(tree);
-  qstWritePathMatrix(fullpathmatrix, tree);
-  qstWriteTruncatedPathMatrix(pathmatrix, fullpathmatrix);
-  double score = qsScoreTree(tree, pathmatrix, distmatrix);
-  mcc->distmatrix = distmatrix;
-  mcc->beta = beta;
-  mcc->nonmove_weight = scoreToWeight(score, beta);
-  mcc->total_weight = mcc->nonmove_weight;
-  mcc->cutoff_weight = -1;
-  qsIterateMutations(tree, fullpathmatrix, mcc, mutationAccumulator);
-  double normf = (rand() % 1000000000) / 1000000000.0;
-  mcc->cutoff_weight = normf * mcc->total_weight;
-  mcc->total_weight = mcc->nonmove_weight;
-  if (mcc->total_weight >= mcc->cutoff_weight) {
-    return score;
+/* Screening: weights holds each neighbor's estimated delta.  A neighbor
+ * samples from a stream seeded by its position, not its worker. */
+static void candidateScreenTask(void *obj, int task_index, int worker) {
+  struct MCMCContext *mcc = (struct MCMCContext *) obj;
+  struct QSTSearchWorkspace *ws = mcc->workspace;
+  struct QSTRandom stream;
+  int i = task_index * QST_CANDIDATE_BATCH;
+  int end = i + QST_CANDIDATE_BATCH < mcc->count ? i + QST_CANDIDATE_BATCH : mcc->count;
+  for (; i < end; ++i) {
+    qsRandomSeed(&stream, mcc->seed ^ (i + 1) * 0x9e3779b97f4a7c15ULL);
+    ws->weights[i] = qsEstimateWorkspaceMutationDelta(mcc->tree, ws, mcc->distmatrix,
+                                                      ws->codes[i], mcc->samples, &stream,
+                                                      worker);
+  }
+}
+
+static void chosenExactTask(void *obj, int task_index, int worker) {
+  struct MCMCContext *mcc = (struct MCMCContext *) obj;
+  struct QSTSearchWorkspace *ws = mcc->workspace;
+  int i = mcc->chosen[task_index];
+  ws->weights[i] = qsScoreWorkspaceMutationDelta(mcc->tree, ws, mcc->distmatrix, ws->codes[i],
+                                                 worker);
+}
+
+/* Scores exactly only the top neighbors with the lowest estimated deltas,
+ * ties going to the earlier, and gives the rest no weight.  The step is
+ * then greedier than a full heat bath step, so chains can settle in
+ * different local optima; a screened search is meant to run under limits. */
+static void screenCandidates(struct MCMCContext *mcc, struct QSTThreadPool *pool, int top) {
+  struct QSTSearchWorkspace *ws = mcc->workspace;
+  int chosen[QST_SCREEN_TOP_MAX];
+  double exact[QST_SCREEN_TOP_MAX];
+  int i, j, kept = 0;
+  qsThreadPoolRun(pool, (mcc->count + QST_CANDIDATE_BATCH - 1) / QST_CANDIDATE_BATCH,
+                  candidateScreenTask, mcc);
+  for (i = 0; i < mcc->count; ++i) {
+    if (kept == top && ws->weights[i] >= ws->weights[chosen[kept - 1]]) {
+      continue;
+    }
+    for (j = kept < top ? kept++ : kept - 1;
+         j > 0 && ws->weights[chosen[j - 1]] > ws->weights[i]; --j) {
+      chosen[j] = chosen[j - 1];
+    }
+    chosen[j] = i;
+  }
+  mcc->chosen = chosen;
+  qsThreadPoolRun(pool, kept, chosenExactTask, mcc);
+  mcc->chosen = NULL;
+  for (j = 0; j < kept; ++j) {
+    exact[j] = scoreToWeight(qsScoreFromTotals(&mcc->totals, ws->weights[chosen[j]]), mcc->beta);
+  }
+  memset(ws->weights, 0, mcc->count * sizeof(ws->weights[0]));
+  for (j = 0; j < kept; ++j) {
+    ws->weights[chosen[j]] = exact[j];
+  }
+}
+
+/* Full scoring of the tree loaded in workspace, through its score cache
+ * when it has one. */
+static double scoreTreeTotals(const struct QSTree *tree, const double *distmatrix,
+  const struct QSTScoreModel *model, struct QSTThreadPool *pool,
+  struct QSTSearchWorkspace *workspace, struct QSTScoreTotals *totals) {
+  struct QSTSolverStats *stats = workspace->stats;
+  uint64_t key = 0;
+  double score;
+  if (workspace->cache != NULL) {
+    key = scoreCacheKey(workspace, tree, distmatrix, model);
+    if (qsLookupScore(workspace->cache, key, &score, totals)) {
+      return score;
+    }
+  }
+  uint64_t since = QST_STATS_CLOCK(stats);
+  if (model != NULL) {
+    score = qsScoreTreeTotalsWithModelParallel(tree, workspace->pathmatrix, model, pool, totals);
+  } else {
+    score = qsScoreTreeTotalsParallel(tree, workspace->pathmatrix, distmatrix, pool, totals);
+  }
+  QST_STATS_SINCE(stats, score_ns, since);
+  QST_STATS_ADD(stats, full_scores, 1);
+  if (workspace->cache != NULL) {
+    qsStoreScore(workspace->cache, key, score, totals);
+  }
+  return score;
+}
+
+static void loadWorkspaceTree(struct QSTSearchWorkspace *workspace, const struct QSTree *tree) {
+  uint64_t since = QST_STATS_CLOCK(workspace->stats);
+  qsLoadWorkspaceTree(workspace, tree);
+  QST_STATS_SINCE(workspace->stats, path_ns, since);
+}
+
+/* Heat bath step: the tree stays put or moves to one of its neighbors
+ * with probability proportional to scoreToWeight.  Neighbors are listed
+ * once, weighted independently (on pool when there is one) and the move
+ * is read off a prefix sum taken in enumeration order, so the result does
+ * not depend on how many threads did the weighing.  The draw comes from
+ * rng, or from rand() when rng is NULL.  Every buffer comes out of
+ * workspace, so once its candidate arrays have grown to the neighborhood
+ * size a step makes no heap allocations.
+ *
+ * A screened step estimates every neighbor's delta from a sample of the
+ * quartets it changes and scores exactly only the few that look best.
+ * The screening streams are seeded by one draw per step, so it too is
+ * independent of the pool. */
+static double stepMCMC(struct QSTree *tree, const double *distmatrix,
+                       const struct QSTScoreModel *model, double beta,
+                       struct QSTThreadPool *pool, struct QSTRandom *rng,
+                       struct QSTSearchWorkspace *workspace, int screened) {
+  struct MCMCContext mcc;
+  int i;
+  int worker_count = pool ? qsThreadPoolSize(pool) : 1;
+  if (workspace->worker_count < worker_count) {
+    fprintf(stderr, "Error, workspace for %d workers used with %d.\n",
+            workspace->worker_count, worker_count);
+    exit(1);
+  }
+  struct QSTSolverStats *stats = workspace->stats;
+  workspace->scored_matrix = 0;
+  loadWorkspaceTree(workspace, tree);
+  double score = scoreTreeTotals(tree, distmatrix, model, pool, workspace, &mcc.totals);
+  mcc.tree = tree;
+  mcc.distmatrix = distmatrix;
+  mcc.workspace = workspace;
+  mcc.beta = beta;
+  mcc.count = 0;
+  uint64_t since = QST_STATS_CLOCK(stats);
+  qsIterateWorkspaceMutations(tree, workspace, &mcc, mutationCollector);
+  QST_STATS_SINCE(stats, enumerate_ns, since);
+  since = QST_STATS_CLOCK(stats);
+  QST_STATS_ADD(stats, candidates, mcc.count);
+  if (screened) {
+    mcc.seed = rng ? qsRandomNext(rng) : (((uint64_t) rand()) << 31) ^ (uint64_t) rand();
+    mcc.samples = workspace->screen_samples ? workspace->screen_samples : QST_SCREEN_SAMPLES;
+    screenCandidates(&mcc, pool, workspace->screen_top ? workspace->screen_top : QST_SCREEN_TOP);
   } else {
-    qsIterateMutations(tree, fullpathmatrix, mcc, mutationAccumulator);
+    qsThreadPoolRun(pool, (mcc.count + QST_CANDIDATE_BATCH - 1) / QST_CANDIDATE_BATCH,
+                    candidateWeightTask, &mcc);
+  }
+  QST_STATS_SINCE(stats, score_ns, since);
+  QST_STATS_ADD(stats, steps, 1);
+  double nonmove_weight = scoreToWeight(score, beta);
+  double total_weight = nonmove_weight;
+  for (i = 0; i < mcc.count; ++i) {
+    total_weight += workspace->weights[i];
+  }
+  double cutoff_weight = drawUnit(rng) * total_weight;
+  uint64_t mutation_code = 0;
+  total_weight = nonmove_weight;
+  for (i = 0; i < mcc.count && total_weight < cutoff_weight; ++i) {
+    total_weight += workspace->weights[i];
+    mutation_code = workspace->codes[i];
+  }
+  if (mutation_code != 0) {
+    /* rescore exactly so that deltas never accumulate rounding error */
+    qsApplyWorkspaceMutation(tree, workspace, mutation_code);
+    loadWorkspaceTree(workspace, tree);
+    score = scoreTreeTotals(tree, distmatrix, model, pool, workspace, &mcc.totals);
+  } else {
+    QST_STATS_ADD(stats, stays, 1);
+  }
+  return score;
+}
+
+/* Scores tree exactly and keeps it as the workspace's Metropolis state. */
+static double loadScoredTree(struct QSTree *tree, const double *distmatrix,
+                             const struct QSTScoreModel *model, struct QSTThreadPool *pool,
+                             struct QSTSearchWorkspace *workspace) {
+  loadWorkspaceTree(workspace, tree);
+  workspace->scored_score = scoreTreeTotals(tree, distmatrix, model, pool, workspace,
+                                            &workspace->scored_totals);
+  qsCopyTreeOver(workspace->scored, tree);
+  workspace->scored_matrix = qsScoredMatrixKey(model);
+  workspace->scored_moves = 0;
+  return workspace->scored_score;
+}
+
+/* Metropolis-Hastings step: one random mutation is proposed, scored by
+ * its delta alone, and accepted with probability
+ * min(1, scoreToWeight(new) / scoreToWeight(old)), the same temperature
+ * model the heat bath uses.  The proposal is treated as symmetric.  A step
+ * costs one delta scoring and a path matrix rebuild when it moves, against
+ * a delta scoring for every neighbor in the heat bath.
+ *
+ * The workspace remembers the tree it left behind, so the full scoring is
+ * only repeated when the caller hands in a different tree or model, or
+ * every QST_METROPOLIS_RESCORE accepted moves to shed rounding error.
+ * Models are told apart by their distance hash, not their address, which a
+ * later model may reuse; bare distances are rescored on every step.  A
+ * score that reaches 1 is always confirmed exactly. */
+static double stepMetropolis(struct QSTree *tree, const double *distmatrix,
+                             const struct QSTScoreModel *model, double beta,
+                             struct QSTThreadPool *pool, struct QSTRandom *rng,
+                             struct QSTSearchWorkspace *workspace) {
+  if (workspace->leaf_count != qsLeafCount(tree)) {
+    fprintf(stderr, "Error, workspace for %d leaves used with %d.\n",
+            workspace->leaf_count, qsLeafCount(tree));
+    exit(1);
+  }
+  uint64_t matrix = qsScoredMatrixKey(model);
+  if (matrix == 0 || workspace->scored_matrix != matrix ||
+      qsTreeCompare(tree, workspace->scored) != 0) {
+    loadScoredTree(tree, distmatrix, model, pool, workspace);
+  }
+  struct QSTSolverStats *stats = workspace->stats;
+  double score = workspace->scored_score;
+  uint64_t mutation_code = qsSampleMutationWith(tree, rng, workspace->sample);
+  uint64_t since = QST_STATS_CLOCK(stats);
+  double delta = qsScoreWorkspaceMutationDelta(tree, workspace, distmatrix, mutation_code, 0);
+  QST_STATS_SINCE(stats, score_ns, since);
+  QST_STATS_ADD(stats, candidates, 1);
+  QST_STATS_ADD(stats, steps, 1);
+  double proposed = qsScoreFromTotals(&workspace->scored_totals, delta);
+  double log_ratio = scoreToLogWeight(proposed, beta) - scoreToLogWeight(score, beta);
+  if (log_ratio < 0 && drawUnit(rng) >= exp(log_ratio)) {
+    QST_STATS_ADD(stats, stays, 1);
+    return score;
+  }
+  qsApplyWorkspaceMutation(tree, workspace, mutation_code);
+  if (++workspace->scored_moves >= QST_METROPOLIS_RESCORE || proposed >= 1.0 - 1e-9) {
+    return loadScoredTree(tree, distmatrix, model, pool, workspace);
   }
-  qsFreePathMatrix(pathmatrix);
-  qsFreeFullPathMatrix(fullpathmatrix);
-  score = mcc->last_score;
-  free(mcc);
+  loadWorkspaceTree(workspace, tree);
+  qsCopyTreeOver(workspace->scored, tree);
+  workspace->scored_totals.totcur += delta;
+  workspace->scored_score = proposed;
+  return proposed;
+}
+
+static double stepWithMode(int step_mode, struct QSTree *tree, const double *distmatrix,
+                           const struct QSTScoreModel *model, double beta,
+                           struct QSTThreadPool *pool, struct QSTRandom *rng,
+                           struct QSTSearchWorkspace *workspace) {
+  if (step_mode == QST_STEP_METROPOLIS) {
+    return stepMetropolis(tree, distmatrix, model, beta, pool, rng, workspace);
+  }
+  return stepMCMC(tree, distmatrix, model, beta, pool, rng, workspace,
+                  step_mode == QST_STEP_SCREENED);
+}
+
+static double stepMCMCOnce(struct QSTree *tree, const double *distmatrix,
+                           const struct QSTScoreModel *model, double beta,
+                           struct QSTThreadPool *pool) {
+  struct QSTSearchWorkspace *workspace =
+    qsNewSearchWorkspace(qsLeafCount(tree), pool ? qsThreadPoolSize(pool) : 1);
+  double score = stepMCMC(tree, distmatrix, model, beta, pool, NULL, workspace, 0);
+  qsFreeSearchWorkspace(workspace);
   return score;
 }
 
+double qsStepMCMC(struct QSTree *tree, const double *distmatrix, double beta) {
+  return stepMCMCOnce(tree, distmatrix, NULL, beta, NULL);
+}
+
+double qsStepMCMCWithModel(struct QSTree *tree, const struct QSTScoreModel *model, double beta) {
+  return stepMCMCOnce(tree, model->distmatrix, model, beta, NULL);
+}
+
+double qsStepMCMCParallel(struct QSTree *tree, const struct QSTScoreModel *model, double beta,
+                          struct QSTThreadPool *pool) {
+  return stepMCMCOnce(tree, model->distmatrix, model, beta, pool);
+}
+
+double qsStepMCMCWorkspace(struct QSTree *tree, const struct QSTScoreModel *model, double beta,
+                           struct QSTThreadPool *pool, struct QSTSearchWorkspace *workspace) {
+  return stepMCMC(tree, model->distmatrix, model, beta, pool, NULL, workspace, 0);
+}
+
+double qsStepMetropolisWorkspace(struct QSTree *tree, const struct QSTScoreModel *model,
+                                 double beta, struct QSTThreadPool *pool,
+                                 struct QSTSearchWorkspace *workspace) {
+  return stepMetropolis(tree, model->distmatrix, model, beta, pool, NULL, workspace);
+}
+
+/* Chains agree when their trees have the same topology; kernel numbering
+ * is an artifact of the mutation history. */
 static int areTreesEqual(struct QSTree **arr, int tree_count) {
   int i;
+  uint64_t hash = qsTreeTopologyHash(arr[0]);
   for (i = 1; i < tree_count; ++i) {
-    if (qsTreeCompare(arr[i], arr[0]) != 0) {
+    if (qsTreeTopologyHash(arr[i]) != hash) {
       return 0;
     }
   }
   return 1;
 }
 
-double qsSolveMCMC(struct QSTree **result, int leaf_count, const double *distmatrix) {
-  struct QSTree *trees[10];
-  int i;
+/* areTreesEqual, also recording in stats how many chains share the most
+ * common topology. */
+static int areTreesEqualStats(struct QSTree **arr, int tree_count,
+                              struct QSTSolverStats *stats) {
+#ifdef QST_STATS
+  if (stats != NULL) {
+    uint64_t since = qsStatsNanos(), hashes[10];
+    int i, j, most = 0;
+    for (i = 0; i < tree_count; ++i) {
+      hashes[i] = qsTreeTopologyHash(arr[i]);
+    }
+    for (i = 0; i < tree_count; ++i) {
+      int same = 0;
+      for (j = 0; j < tree_count; ++j) {
+        same += hashes[j] == hashes[i];
+      }
+      most = same > most ? same : most;
+    }
+    stats->agreement_checks += 1;
+    stats->agreeing_chains = most;
+    stats->chain_count = tree_count;
+    stats->agreement_ns += qsStatsNanos() - since;
+    return most == tree_count;
+  }
+#endif
+  return areTreesEqual(arr, tree_count);
+}
+
+static int chainCount(int leaf_count) {
   int tree_sizes[] = {5, 4, 4, 3, 3, 3};
-  int tree_count = 2;
   if (leaf_count < 4) {
     fprintf(stderr, "Error, leaf_count must be at least 4.\n");
     exit(1);
   }
   if (leaf_count < 10) {
-    tree_count = tree_sizes[leaf_count - 4];
+    return tree_sizes[leaf_count - 4];
+  }
+  return 2;
+}
+
+/* Round robin over tree_count chains started from random trees, all drawn
+ * from rng (rand() when NULL), until the chains agree on a topology or
+ * one of them scores perfectly.  Heat bath chains share workspace;
+ * Metropolis chains each keep their own so their scored state survives
+ * the turns of the others.  The search lives in a QSTSolverState so it
+ * can be stopped between any two steps and carried on, here or from a
+ * checkpoint.  workspace may be NULL to give the state one of its own,
+ * lean or not as lean says. */
+struct QSTSolverState *qsNewSolverState(int leaf_count, const double *distmatrix,
+                                        int tree_count, struct QSTRandom *rng,
+                                        struct QSTThreadPool *pool,
+                                        struct QSTSearchWorkspace *workspace, int lean,
+                                        int step_mode, int randomize) {
+  struct QSTSolverState *state = calloc(sizeof(struct QSTSolverState), 1);
+  int i;
+  int worker_count = pool ? qsThreadPoolSize(pool) : 1;
+  state->leaf_count = leaf_count;
+  state->tree_count = tree_count;
+  state->step_mode = step_mode;
+  state->rng = rng;
+  state->pool = pool;
+  if (workspace == NULL) {
+    workspace = lean ? qsNewLeanSearchWorkspace(leaf_count, worker_count)
+                     : qsNewSearchWorkspace(leaf_count, worker_count);
+    state->owns_workspace = 1;
   }
+  state->workspace = workspace;
+  uint16_t *scratch = malloc(QST_SAMPLE_SCRATCH_SIZE(leaf_count));
   for (i = 0; i < tree_count; ++i) {
-    trees[i] = qsNewRandomTree(leaf_count);
+    state->trees[i] = qsNewTree(leaf_count);
+    if (randomize) {
+      qsRandomizeTreeWith(state->trees[i], rng, scratch);
+    }
+    if (i == 0 || step_mode != QST_STEP_METROPOLIS) {
+      state->workspaces[i] = workspace;
+    } else {
+      state->workspaces[i] = qsNewSearchWorkspaceLike(workspace, leaf_count, worker_count);
+    }
+  }
+  free(scratch);
+  state->model = qsNewScoreModel(leaf_count, distmatrix);
+  state->tree_pointer = 0;
+  state->score = 0;
+  state->itercount = 5;
+  return state;
+}
+
+/* Points the state and every chain's workspace at the stats, score cache
+ * and screening settings of ctx, or at none of them when ctx is NULL. */
+void qsAttachSolverState(struct QSTSolverState *state, const struct QSTContext *ctx) {
+  int i;
+  state->stats = ctx != NULL ? ctx->stats : NULL;
+  qsAttachWorkspace(state->workspace, ctx);
+  for (i = 0; i < state->tree_count; ++i) {
+    qsAttachWorkspace(state->workspaces[i], ctx);
+  }
+}
+
+void qsFreeSolverState(struct QSTSolverState *state) {
+  int i;
+  for (i = 0; i < state->tree_count; ++i) {
+    qsFreeTree(state->trees[i]);
+    if (state->workspaces[i] != state->workspace) {
+      qsFreeSearchWorkspace(state->workspaces[i]);
+    }
+  }
+  if (state->owns_workspace) {
+    qsFreeSearchWorkspace(state->workspace);
   }
-  int tree_pointer = 0;
-  double score = 0;
-  uint64_t itercount = 5;
-  while (!areTreesEqual(trees, tree_count)) {
-    itercount += 1;
+  qsFreeScoreModel(state->model);
+  free(state);
+}
+
+/* Takes up to step_count steps; nonzero once the search is over. */
+int qsAdvanceSolverState(struct QSTSolverState *state, uint64_t step_count) {
+  const struct QSTScoreModel *model = state->model;
+  uint64_t steps;
+  for (steps = 0; !state->done && steps < step_count; ++steps) {
+    if (areTreesEqualStats(state->trees, state->tree_count, state->stats)) {
+      break;
+    }
+    state->itercount += 1;
+    double lg = log(state->itercount);
+    double beta = lg*lg*lg;
+    state->tree_pointer = (state->tree_pointer + 1) % state->tree_count;
+    state->score = stepWithMode(state->step_mode, state->trees[state->tree_pointer],
+                                model->distmatrix, model, beta, state->pool, state->rng,
+                                state->workspaces[state->tree_pointer]);
+//    printf("score for %d = %f\n", state->tree_pointer, state->score);
+    if (state->score == 1.0) {
+      state->done = 1;
+    }
+    if (state->stats != NULL && state->score > state->stats->best_score) {
+      state->stats->best_score = state->score;
+    }
+  }
+  if (!state->done && areTreesEqual(state->trees, state->tree_count)) {
+    if (state->itercount == 5) {
+      /* the chains started out agreeing, so nothing has been scored yet */
+      state->score = loadScoredTree(state->trees[state->tree_pointer], model->distmatrix,
+                                    model, state->pool, state->workspace);
+    }
+    state->done = 1;
+  }
+  return state->done;
+}
+
+double qsSolverStateResult(const struct QSTSolverState *state, struct QSTree **result) {
+  if (result != NULL) {
+    *result = qsNewCloneOf(state->trees[state->tree_pointer]);
+  }
+  return state->score;
+}
+
+static double solveMCMC(struct QSTree **result, int leaf_count, const double *distmatrix,
+                        int tree_count, struct QSTRandom *rng, struct QSTThreadPool *pool,
+                        struct QSTSearchWorkspace *workspace, int step_mode,
+                        const struct QSTContext *ctx) {
+  struct QSTSolverState *state = qsNewSolverState(leaf_count, distmatrix, tree_count, rng, pool,
+                                                  workspace, 0, step_mode, 1);
+  qsAttachSolverState(state, ctx);
+  while (!qsAdvanceSolverState(state, UINT64_MAX)) {
+  }
+  double score = qsSolverStateResult(state, result);
+  qsFreeSolverState(state);
+  return score;
+}
+
+static double solveMCMCOnce(struct QSTree **result, int leaf_count, const double *distmatrix,
+                            int step_mode) {
+  int tree_count = chainCount(leaf_count);
+  struct QSTSearchWorkspace *workspace = qsNewSearchWorkspace(leaf_count, 1);
+  double score = solveMCMC(result, leaf_count, distmatrix, tree_count, NULL, NULL, workspace,
+                           step_mode, NULL);
+  qsFreeSearchWorkspace(workspace);
+  return score;
+}
+
+double qsSolveMCMC(struct QSTree **result, int leaf_count, const double *distmatrix) {
+  return solveMCMCOnce(result, leaf_count, distmatrix, QST_STEP_HEAT_BATH);
+}
+
+double qsSolveMCMCWithMode(struct QSTree **result, int leaf_count, const double *distmatrix,
+                           int step_mode) {
+  if (step_mode != QST_STEP_HEAT_BATH && step_mode != QST_STEP_METROPOLIS &&
+      step_mode != QST_STEP_SCREENED) {
+    fprintf(stderr, "Error, unknown step mode %d.\n", step_mode);
+    exit(1);
+  }
+  return solveMCMCOnce(result, leaf_count, distmatrix, step_mode);
+}
+
+double qsStepMCMCCtx(struct QSTree *tree, const struct QSTScoreModel *model, double beta,
+                     struct QSTContext *ctx) {
+  double score = stepWithMode(ctx->step_mode, tree, model->distmatrix, model, beta, ctx->pool,
+                              &ctx->rng, qsContextWorkspace(ctx, qsLeafCount(tree)));
+  if (ctx->stats != NULL && score > ctx->stats->best_score) {
+    ctx->stats->best_score = score;
+  }
+  return score;
+}
+
+double qsSolveMCMCCtx(struct QSTree **result, int leaf_count, const double *distmatrix,
+                      struct QSTContext *ctx) {
+  int tree_count = ctx->chain_count ? ctx->chain_count : chainCount(leaf_count);
+  return solveMCMC(result, leaf_count, distmatrix, tree_count, &ctx->rng, ctx->pool,
+                   qsContextWorkspace(ctx, leaf_count), ctx->step_mode, ctx);
+}
+
+struct QSTSolverState *qsNewSolverStateCtx(int leaf_count, const double *distmatrix,
+                                           struct QSTContext *ctx) {
+  int tree_count = ctx->chain_count ? ctx->chain_count : chainCount(leaf_count);
+  struct QSTSolverState *state = qsNewSolverState(leaf_count, distmatrix, tree_count, &ctx->rng,
+                                                  ctx->pool, NULL, ctx->lean, ctx->step_mode, 1);
+  qsAttachSolverState(state, ctx);
+  return state;
+}
+
+/* Chains past start_count begin from the given trees moved by one random
+ * mutation, so the chains do not agree before they have searched.  The
+ * schedule starts at QST_WARM_ITERCOUNT, cold enough that a good start is
+ * refined rather than melted back into a random walk. */
+struct QSTSolverState *qsNewSolverStateFromCtx(const double *distmatrix,
+                                               const struct QSTree *const *starts,
+                                               int start_count, struct QSTContext *ctx) {
+  int leaf_count, tree_count, i;
+  if (start_count < 1) {
+    fprintf(stderr, "Error, a warm start needs at least one tree.\n");
+    exit(1);
+  }
+  leaf_count = qsLeafCount(starts[0]);
+  tree_count = ctx->chain_count ? ctx->chain_count : chainCount(leaf_count);
+  if (start_count > tree_count) {
+    fprintf(stderr, "Error, %d start trees for %d chains.\n", start_count, tree_count);
+    exit(1);
+  }
+  for (i = 1; i < start_count; ++i) {
+    if (qsLeafCount(starts[i]) != (uint32_t) leaf_count) {
+      fprintf(stderr, "Error, start tree %d has %d leaves, not %d.\n", i,
+              qsLeafCount(starts[i]), leaf_count);
+      exit(1);
+    }
+  }
+  struct QSTSolverState *state = qsNewSolverState(leaf_count, distmatrix, tree_count, &ctx->rng,
+                                                  ctx->pool, NULL, ctx->lean, ctx->step_mode, 0);
+  qsAttachSolverState(state, ctx);
+  uint16_t *scratch = qsContextScratch(ctx, leaf_count);
+  for (i = 0; i < tree_count; ++i) {
+    qsCopyTreeOver(state->trees[i], starts[i % start_count]);
+    if (i >= start_count) {
+      qsApplyRandomMutationWith(state->trees[i], &ctx->rng, scratch);
+    }
+  }
+  state->itercount = QST_WARM_ITERCOUNT;
+  if (areTreesEqual(state->trees, tree_count)) {
+    state->score = loadScoredTree(state->trees[0], state->model->distmatrix, state->model,
+                                  state->pool, state->workspace);
+  }
+  return state;
+}
+
+double qsSolveMCMCFromCtx(struct QSTree **result, const double *distmatrix,
+                          const struct QSTree *const *starts, int start_count,
+                          struct QSTContext *ctx) {
+  struct QSTSolverState *state = qsNewSolverStateFromCtx(distmatrix, starts, start_count, ctx);
+  while (!qsAdvanceSolverState(state, UINT64_MAX)) {
+  }
+  double score = qsSolverStateResult(state, result);
+  qsFreeSolverState(state);
+  return score;
+}
+
+void qsInitSolverOptions(struct QSTSolverOptions *options) {
+  memset(options, 0, sizeof(*options));
+}
+
+/* One step at a time, so every limit is looked at between two steps.  A
+ * clock read costs tens of nanoseconds next to a step's milliseconds. */
+double qsSolveMCMCAnytimeCtx(struct QSTree **result, int leaf_count, const double *distmatrix,
+                             const struct QSTSolverOptions *options, int *reason,
+                             struct QSTContext *ctx) {
+  struct QSTSolverState *state = options->start_count == 0
+    ? qsNewSolverStateCtx(leaf_count, distmatrix, ctx)
+    : qsNewSolverStateFromCtx(distmatrix, options->starts, options->start_count, ctx);
+  struct QSTree *best = qsNewTree(leaf_count);
+  double best_score = -1.0, deadline = 0, score;
+  uint64_t steps = 0, fail_count = 0;
+  int why = -1;
+  if (options->seconds > 0) {
+    deadline = qsSecondsNow() + options->seconds;
+  }
+  while (why < 0) {
+    if (qsAdvanceSolverState(state, 1)) {
+      why = state->score == 1.0 ? QST_SOLVE_PERFECT : QST_SOLVE_AGREED;
+      break;
+    }
+    steps += 1;
+    int improved = state->score > best_score;
+    if (improved) {
+      qsCopyTreeOver(best, state->trees[state->tree_pointer]);
+      best_score = state->score;
+      fail_count = 0;
+    } else {
+      fail_count += 1;
+    }
+    if (options->cancel != NULL && __atomic_load_n(options->cancel, __ATOMIC_ACQUIRE)) {
+      why = QST_SOLVE_CANCELLED;
+    } else if (options->progress != NULL &&
+               (improved || (options->progress_interval != 0 &&
+                             steps % options->progress_interval == 0)) &&
+               options->progress(best, best_score, steps, options->progress_arg)) {
+      why = QST_SOLVE_CANCELLED;
+    } else if (options->max_steps != 0 && steps >= options->max_steps) {
+      why = QST_SOLVE_STEP_LIMIT;
+    } else if (options->max_fail_count != 0 && fail_count >= options->max_fail_count) {
+      why = QST_SOLVE_STAGNATED;
+    } else if (deadline != 0 && qsSecondsNow() >= deadline) {
+      why = QST_SOLVE_TIME_LIMIT;
+    }
+  }
+  if (why == QST_SOLVE_AGREED || why == QST_SOLVE_PERFECT) {
+    score = qsSolverStateResult(state, result);
+  } else {
+    score = best_score;
+    if (result != NULL) {
+      *result = qsNewCloneOf(best);
+    }
+  }
+  if (reason != NULL) {
+    *reason = why;
+  }
+  qsFreeTree(best);
+  qsFreeSolverState(state);
+  return score;
+}
+
+struct MCMCSolve;
+
+struct MCMCChain {
+  struct MCMCSolve *solve;
+  struct QSTree *tree;            // owned by the chain thread until it exits
+  struct QSTRandom rng;
+  struct QSTSearchWorkspace *workspace;
+  uint64_t hash;                  // topology of tree, published after every step
+  double score;
+  pthread_t thread;
+};
+
+struct MCMCSolve {
+  const struct QSTScoreModel *model;
+  struct MCMCChain chains[10];
+  int chain_count;
+  uint64_t itercount;             // shared, so beta follows the serial schedule
+  int stop;
+  int winner;
+};
+
+/* Every chain checks for agreement after publishing its own step.  The
+ * first one to see all hashes equal, or to reach a perfect score, claims
+ * the stop flag; its tree is untouched from then on and becomes the
+ * result, while the others notice the flag before their next step. */
+static void *chainMain(void *arg) {
+  struct MCMCChain *chain = (struct MCMCChain *) arg;
+  struct MCMCSolve *solve = chain->solve;
+  int self = chain - solve->chains, i;
+  while (!__atomic_load_n(&solve->stop, __ATOMIC_ACQUIRE)) {
+    uint64_t itercount = __atomic_add_fetch(&solve->itercount, 1, __ATOMIC_RELAXED);
     double lg = log(itercount);
     double beta = lg*lg*lg;
-    tree_pointer = (tree_pointer + 1) % tree_count;
-    score = qsStepMCMC(trees[tree_pointer], distmatrix, beta);
-//    printf("score for %d = %f\n", tree_pointer, score);
-    if (score == 1.0) {
+    chain->score = stepMCMC(chain->tree, solve->model->distmatrix, solve->model, beta,
+                            NULL, &chain->rng, chain->workspace, 0);
+    uint64_t hash = qsLoadTopologyHasher(chain->workspace->hasher, chain->tree);
+    __atomic_store_n(&chain->hash, hash, __ATOMIC_RELEASE);
+    int agreed = chain->score == 1.0;
+    for (i = 0; i < solve->chain_count && !agreed; ++i) {
+      if (__atomic_load_n(&solve->chains[i].hash, __ATOMIC_ACQUIRE) != hash) {
+        break;
+      }
+    }
+    if (agreed || i == solve->chain_count) {
+      int expected = 0;
+      if (__atomic_compare_exchange_n(&solve->stop, &expected, 1, 0,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        solve->winner = self;
+      }
       break;
     }
   }
-  *result = qsNewCloneOf(trees[tree_pointer]);
+  return NULL;
+}
+
+/* Same search as qsSolveMCMC, with every chain stepping on its own thread
+ * and its own random stream.  The chain seeds are drawn from rand() before
+ * any thread starts; each chain's starting tree comes from its stream. */
+double qsSolveMCMCThreaded(struct QSTree **result, int leaf_count, const double *distmatrix) {
+  struct MCMCSolve solve;
+  int i;
+  solve.chain_count = chainCount(leaf_count);
+  solve.model = qsNewScoreModel(leaf_count, distmatrix);
+  solve.itercount = 5;
+  solve.stop = 0;
+  solve.winner = 0;
+  uint16_t *scratch = malloc(QST_SAMPLE_SCRATCH_SIZE(leaf_count));
+  for (i = 0; i < solve.chain_count; ++i) {
+    struct MCMCChain *chain = &solve.chains[i];
+    chain->solve = &solve;
+    qsRandomSeed(&chain->rng, ((uint64_t) rand() << 32) ^ (uint64_t) rand() ^ i);
+    chain->tree = qsNewTree(leaf_count);
+    qsRandomizeTreeWith(chain->tree, &chain->rng, scratch);
+    chain->workspace = qsNewSearchWorkspace(leaf_count, 1);
+    chain->hash = qsTreeTopologyHash(chain->tree);
+    chain->score = 0;
+  }
+  free(scratch);
+  /* the chains may start out agreeing, as the serial search checks first */
+  for (i = 1; i < solve.chain_count && solve.chains[i].hash == solve.chains[0].hash; ++i) {
+  }
+  if (i < solve.chain_count) {
+    for (i = 0; i < solve.chain_count; ++i) {
+      if (pthread_create(&solve.chains[i].thread, NULL, chainMain, &solve.chains[i]) != 0) {
+        fprintf(stderr, "Error, cannot start chain thread %d.\n", i);
+        exit(1);
+      }
+    }
+    for (i = 0; i < solve.chain_count; ++i) {
+      pthread_join(solve.chains[i].thread, NULL);
+    }
+  } else {
+    uint16_t *fullpathmatrix = qsNewFullPathMatrix(leaf_count);
+    uint16_t *pathmatrix = qsNewPathMatrix(leaf_count);
+    qstWritePathMatrix(fullpathmatrix, solve.chains[0].tree);
+    qstWriteTruncatedPathMatrix(pathmatrix, fullpathmatrix);
+    solve.chains[0].score = qsScoreTreeWithModel(solve.chains[0].tree, pathmatrix, solve.model);
+    qsFreePathMatrix(pathmatrix);
+    qsFreeFullPathMatrix(fullpathmatrix);
+  }
+  double score = solve.chains[solve.winner].score;
+  *result = qsNewCloneOf(solve.chains[solve.winner].tree);
+  for (i = 0; i < solve.chain_count; ++i) {
+    qsFreeTree(solve.chains[i].tree);
+    qsFreeSearchWorkspace(solve.chains[i].workspace);
+  }
+  qsFreeScoreModel((struct QSTScoreModel *) solve.model);
   return score;
 }
+
+/* Replica exchange.  Slot i of the ladder always runs at betas[i]; the
+ * replicas in the slots step independently for steps_per_swap steps, one
+ * pool task each, then neighboring slots offer to trade replicas.  Rounds
+ * alternate between the even and the odd pairs.  A trade between slots i
+ * and j is accepted with probability
+ * min(1, exp((betas[i] - betas[j]) * (score[j] - score[i]))), the
+ * Metropolis criterion for the weights of scoreToWeight.  A replica moves
+ * with its workspace, so Metropolis stepping keeps its scored state across
+ * a trade.  Every replica has its own random stream and the trades are
+ * drawn on the calling thread, so the run does not depend on the pool. */
+
+struct TemperingReplica {
+  struct QSTree *tree;
+  struct QSTSearchWorkspace *workspace;
+  double score;
+};
+
+struct TemperingSlot {
+  struct TemperingReplica replica;
+  struct QSTRandom rng;
+  struct QSTree *best;            // best tree seen in this slot
+  double best_score;
+};
+
+struct TemperingRun {
+  const struct QSTScoreModel *model;
+  const double *betas;
+  struct TemperingSlot slots[QST_MAX_REPLICAS];
+  int steps_per_swap;
+  int step_mode;
+};
+
+static void temperingTask(void *obj, int task_index, int worker) {
+  struct TemperingRun *run = (struct TemperingRun *) obj;
+  struct TemperingSlot *slot = &run->slots[task_index];
+  struct TemperingReplica *replica = &slot->replica;
+  int i;
+  for (i = 0; i < run->steps_per_swap && slot->best_score < 1.0; ++i) {
+    replica->score = stepWithMode(run->step_mode, replica->tree, run->model->distmatrix,
+                                  run->model, run->betas[task_index], NULL, &slot->rng,
+                                  replica->workspace);
+    if (replica->score > slot->best_score) {
+      slot->best_score = replica->score;
+      qsCopyTreeOver(slot->best, replica->tree);
+    }
+  }
+}
+
+static double solveTempering(struct QSTree **result, int leaf_count, const double *distmatrix,
+                             const double *betas, int replica_count, int steps_per_swap,
+                             uint64_t round_count, int step_mode, int lean,
+                             struct QSTRandom *rng, struct QSTThreadPool *pool,
+                             struct QSTTemperingStats *stats) {
+  struct TemperingRun run;
+  uint64_t round;
+  int i, best = 0;
+  if (replica_count < 2 || replica_count > QST_MAX_REPLICAS) {
+    fprintf(stderr, "Error, replica count must be between 2 and %d, not %d.\n",
+            QST_MAX_REPLICAS, replica_count);
+    exit(1);
+  }
+  if (steps_per_swap < 1) {
+    fprintf(stderr, "Error, steps per swap must be positive, not %d.\n", steps_per_swap);
+    exit(1);
+  }
+  run.model = qsNewScoreModel(leaf_count, distmatrix);
+  run.betas = betas;
+  run.steps_per_swap = steps_per_swap;
+  run.step_mode = step_mode;
+  uint16_t *scratch = malloc(QST_SAMPLE_SCRATCH_SIZE(leaf_count));
+  for (i = 0; i < replica_count; ++i) {
+    struct TemperingSlot *slot = &run.slots[i];
+    uint64_t seed = rng ? qsRandomNext(rng) : ((uint64_t) rand() << 32) ^ (uint64_t) rand() ^ i;
+    qsRandomSeed(&slot->rng, seed);
+    slot->replica.tree = qsNewTree(leaf_count);
+    qsRandomizeTreeWith(slot->replica.tree, &slot->rng, scratch);
+    slot->replica.workspace = lean ? qsNewLeanSearchWorkspace(leaf_count, 1)
+                                   : qsNewSearchWorkspace(leaf_count, 1);
+    slot->replica.score = loadScoredTree(slot->replica.tree, run.model->distmatrix, run.model,
+                                         NULL, slot->replica.workspace);
+    slot->best = qsNewCloneOf(slot->replica.tree);
+    slot->best_score = slot->replica.score;
+  }
+  free(scratch);
+  if (stats != NULL) {
+    memset(stats, 0, sizeof(*stats));
+    stats->replica_count = replica_count;
+  }
+  for (round = 0; round < round_count; ++round) {
+    for (i = 0; i < replica_count && run.slots[i].best_score < 1.0; ++i) { }
+    if (i < replica_count) {
+      break;
+    }
+    qsThreadPoolRun(pool, replica_count, temperingTask, &run);
+    for (i = round % 2; i + 1 < replica_count; i += 2) {
+      struct TemperingReplica *low = &run.slots[i].replica, *high = &run.slots[i+1].replica;
+      double log_ratio = (betas[i] - betas[i+1]) * (high->score - low->score);
+      int accepted = log_ratio >= 0 ||
+        (rng ? qsRandomUnit(rng) : (rand() % 1000000000) / 1000000000.0) < exp(log_ratio);
+      if (accepted) {
+        struct TemperingReplica held = *low;
+        *low = *high;
+        *high = held;
+      }
+      if (stats != NULL) {
+        stats->swap_attempts[i] += 1;
+        stats->swap_accepts[i] += accepted;
+      }
+    }
+    if (stats != NULL) {
+      stats->round_count += 1;
+    }
+  }
+  for (i = 1; i < replica_count; ++i) {
+    if (run.slots[i].best_score > run.slots[best].best_score) {
+      best = i;
+    }
+  }
+  double score = run.slots[best].best_score;
+  *result = qsNewCloneOf(run.slots[best].best);
+  if (stats != NULL) {
+    stats->best_score = score;
+  }
+  for (i = 0; i < replica_count; ++i) {
+    qsFreeTree(run.slots[i].replica.tree);
+    qsFreeSearchWorkspace(run.slots[i].replica.workspace);
+    qsFreeTree(run.slots[i].best);
+  }
+  qsFreeScoreModel((struct QSTScoreModel *) run.model);
+  return score;
+}
+
+void qsGeometricLadder(double *betas, int replica_count, double beta_min, double beta_max) {
+  int i;
+  if (replica_count < 2 || beta_min <= 0 || beta_max < beta_min) {
+    fprintf(stderr, "Error, cannot build a ladder of %d betas from %g to %g.\n",
+            replica_count, beta_min, beta_max);
+    exit(1);
+  }
+  for (i = 0; i < replica_count; ++i) {
+    betas[i] = beta_min * pow(beta_max / beta_min, i / (double) (replica_count - 1));
+  }
+}
+
+/* Heat bath replicas on a pool with a thread per replica, up to the number
+ * of online processors; replica seeds come from rand(). */
+double qsSolveTempering(struct QSTree **result, int leaf_count, const double *distmatrix,
+                        const double *betas, int replica_count, int steps_per_swap,
+                        uint64_t round_count, struct QSTTemperingStats *stats) {
+  int thread_count = replica_count < qsOnlineCPUCount() ? replica_count : qsOnlineCPUCount();
+  struct QSTThreadPool *pool = qsNewThreadPool(thread_count);
+  double score = solveTempering(result, leaf_count, distmatrix, betas, replica_count,
+                                steps_per_swap, round_count, QST_STEP_HEAT_BATH, 0, NULL,
+                                pool, stats);
+  qsFreeThreadPool(pool);
+  return score;
+}
+
+double qsSolveTemperingCtx(struct QSTree **result, int leaf_count, const double *distmatrix,
+                           const double *betas, int replica_count, int steps_per_swap,
+                           uint64_t round_count, struct QSTTemperingStats *stats,
+                           struct QSTContext *ctx) {
+  return solveTempering(result, leaf_count, distmatrix, betas, replica_count, steps_per_swap,
+                        round_count, ctx->step_mode, ctx->lean, &ctx->rng, ctx->pool,
+                        stats);
+}
@@ -0,0 +1,269 @@
+#ifndef __QSPRIVATE_H
+#define __QSPRIVATE_H
+
+/* Internal declarations shared between the libqs translation units.
+ * Nothing in here is exported from the shared library. */
+
+#include <time.h>
+#include "include/qsearch/libqs.h"
+
+struct QSTScoreModel {
+  uint32_t leaf_count;
+  double totmin, totmax;      // tree independent normalizers
+  double *distmatrix;         // private 32-byte aligned copy, leaf_count stride
+  uint64_t hash;              // qsHashDistances of distmatrix, for score cache keys
+};
+
+struct QSTTreeIndex {
+  uint32_t leaf_count, node_count;
+  uint32_t euler_count, levels;
+  uint16_t *parent, *depth;   // rooted at node leaf_count
+  uint32_t *first, *last;     // Euler tour positions bounding each subtree
+  uint16_t *sparse;           // levels rows; row 0 is the Euler tour itself
+  uint16_t *stack;            // traversal scratch
+};
+
+/* Scratch for scoring one mutation delta; each worker needs its own. */
+struct QSTDeltaScratch {
+  struct QSTree *nexttree;
+  uint16_t *newpath;          // truncated, of nexttree
+  uint16_t *queue;            // 2 * node count
+  uint16_t *members;          // leaf count
+  uint8_t *moved;             // leaf count
+  struct QSTTreeIndex *nextindex;  // of nexttree, made by the first sampled delta
+};
+
+struct QSTSearchWorkspace {
+  uint32_t leaf_count;
+  int worker_count;
+  struct QSTree *holder;      // neighbor handed to mutation handlers
+  uint16_t *fullpathmatrix;   // of the tree being searched from, NULL if lean
+  struct QSTTreeIndex *index; // same tree, in place of fullpathmatrix if lean
+  uint16_t *pathmatrix;       // truncated, same tree
+  uint16_t *queue;            // 2 * node count, breadth first search scratch
+  struct QSTUInt64Table *old_trees;
+  struct QSTTopologyHasher *hasher;
+  uint64_t *codes;            // candidate neighbors, capacity entries
+  double *weights;
+  int capacity;
+  struct QSTDeltaScratch *delta;  // worker_count of them
+  uint16_t *sample;           // mutation sampling scratch
+  /* Metropolis steps keep the last tree they left along with its path
+   * matrix and totals, and score only proposals while it is unchanged. */
+  struct QSTree *scored;
+  uint64_t scored_matrix;     // qsScoredMatrixKey of the model scored_totals are for, 0 if stale
+  struct QSTScoreTotals scored_totals;
+  double scored_score;
+  int scored_moves;           // accepted since the last exact scoring
+  struct QSTSolverStats *stats;  // counters for steps from here, may be NULL
+  int screen_samples;            // screened steps, as set by the context
+  int screen_top;
+  struct QSTScoreCache *cache;   // full scorings to share, may be NULL
+};
+
+/* Identifies the distances kept Metropolis totals were summed over: the
+ * model's hash, never 0.  Bare distances get 0, which never matches, as
+ * a pointer says nothing about what it points at by the next step. */
+static __inline__ uint64_t qsScoredMatrixKey(const struct QSTScoreModel *model) {
+  return model != NULL ? model->hash | 1 : 0;
+}
+
+static __inline__ double qsSecondsNow(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+/* Solver statistics, compiled in only with QST_STATS.  The counters live
+ * in a caller's QSTSolverStats reached through the workspace, and are
+ * only touched by the thread stepping it, never by pool tasks. */
+#ifdef QST_STATS
+static __inline__ uint64_t qsStatsNanos(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+#define QST_STATS_ADD(stats, field, count) \
+  do { if ((stats) != NULL) { (stats)->field += (count); } } while (0)
+#define QST_STATS_CLOCK(stats) ((stats) != NULL ? qsStatsNanos() : 0)
+#define QST_STATS_SINCE(stats, field, since) QST_STATS_ADD(stats, field, qsStatsNanos() - (since))
+#else
+#define QST_STATS_ADD(stats, field, count) do { (void) (stats); } while (0)
+#define QST_STATS_CLOCK(stats) ((void) (stats), (uint64_t) 0)
+#define QST_STATS_SINCE(stats, field, since) do { (void) (stats); (void) (since); } while (0)
+#endif
+
+int qsLookupScore(struct QSTScoreCache *cache, uint64_t key, double *score,
+                  struct QSTScoreTotals *totals);
+void qsStoreScore(struct QSTScoreCache *cache, uint64_t key, double score,
+                  const struct QSTScoreTotals *totals);
+uint64_t qsHashDistances(const double *distmatrix, uint32_t leaf_count);
+
+void qsInitDeltaScratch(struct QSTDeltaScratch *scratch, uint32_t leaf_count);
+void qsFreeDeltaScratch(struct QSTDeltaScratch *scratch);
+double qsScoreMutationDeltaScratch(const struct QSTree *tree, const uint16_t *fullpathmatrix,
+ const double *distmatrix, uint64_t mutation_code, struct QSTDeltaScratch *scratch);
+
+/* qsWritePathMatrix with caller supplied scratch of 2 * node count. */
+void qsWritePathMatrixScratch(uint16_t *fullpathmatrix, const struct QSTree *tree,
+                              uint16_t *scratch);
+
+/* Searching from the tree loaded into a workspace: distances come from
+ * the full path matrix, or from the tree index in a lean workspace. */
+void qsLoadWorkspaceTree(struct QSTSearchWorkspace *workspace, const struct QSTree *tree);
+void qsIterateWorkspaceMutations(const struct QSTree *tree,
+                        struct QSTSearchWorkspace *workspace,
+                        void *obj,
+  int (*mutationHandler)(const struct QSTree *tree, const struct QSTree *nexttree,  int sequence_number,
+                         uint64_t mutation_code, void *obj));
+double qsScoreWorkspaceMutationDelta(const struct QSTree *tree,
+ const struct QSTSearchWorkspace *workspace, const double *distmatrix, uint64_t mutation_code,
+ int worker);
+void qsApplyWorkspaceMutation(struct QSTree *tree, const struct QSTSearchWorkspace *workspace,
+                              uint64_t mutation_code);
+
+/* Grows the workspace candidate arrays to hold at least count entries. */
+void qsReserveWorkspaceCandidates(struct QSTSearchWorkspace *workspace, int count);
+
+/* xoshiro256** generator, for code that must not share the C library's
+ * global rand() state with other threads. */
+struct QSTRandom {
+  uint64_t s[4];
+};
+
+static __inline__ uint64_t qsRandomRotl(uint64_t x, int k) {
+  return (x << k) | (x >> (64 - k));
+}
+
+static __inline__ void qsRandomSeed(struct QSTRandom *rng, uint64_t seed) {
+  int i;
+  for (i = 0; i < 4; ++i) {   // splitmix64 expansion of the seed
+    uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    rng->s[i] = z ^ (z >> 31);
+  }
+}
+
+static __inline__ uint64_t qsRandomNext(struct QSTRandom *rng) {
+  uint64_t *s = rng->s;
+  uint64_t result = qsRandomRotl(s[1] * 5, 7) * 9;
+  uint64_t t = s[1] << 17;
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = qsRandomRotl(s[3], 45);
+  return result;
+}
+
+/* uniform in [0, 1) */
+static __inline__ double qsRandomUnit(struct QSTRandom *rng) {
+  return (qsRandomNext(rng) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Mutation sampling from rng, or from rand() when rng is NULL, with
+ * caller supplied scratch of QST_SAMPLE_SCRATCH_SIZE(leaf_count) bytes.
+ * qsRandomizeTreeWith applies the 10 * leaf_count random mutations that
+ * qsNewRandomTree starts from. */
+#define QST_SAMPLE_SCRATCH_SIZE(leaf_count) (3 * QST_NODELIST_COUNT(leaf_count) * sizeof(uint16_t))
+uint64_t qsSampleMutationWith(const struct QSTree *tree, struct QSTRandom *rng,
+                              uint16_t *scratch);
+void qsApplyRandomMutationWith(struct QSTree *tree, struct QSTRandom *rng, uint16_t *scratch);
+void qsRandomizeTreeWith(struct QSTree *tree, struct QSTRandom *rng, uint16_t *scratch);
+double qsEstimateWorkspaceMutationDelta(const struct QSTree *tree,
+ const struct QSTSearchWorkspace *workspace, const double *distmatrix, uint64_t mutation_code,
+ int sample_count, struct QSTRandom *rng, int worker);
+
+/* Screened heat bath steps, unless a context sets otherwise: quartets
+ * sampled per neighbor, and how many of the best neighbors are then
+ * scored exactly, at most QST_SCREEN_TOP_MAX. */
+#define QST_SCREEN_SAMPLES 256
+#define QST_SCREEN_TOP 8
+#define QST_SCREEN_TOP_MAX 64
+
+/* Step count a warm started search takes its first beta from. */
+#ifndef QST_WARM_ITERCOUNT
+#define QST_WARM_ITERCOUNT 1000
+#endif
+
+struct QSTContext {
+  struct QSTRandom rng;
+  struct QSTThreadPool *pool;       // borrowed, may be NULL
+  int chain_count;                  // solver chains, 0 to pick by leaf count
+  struct QSTSearchWorkspace *workspace;  // for the leaf count last stepped
+  uint16_t *scratch;                // sampling scratch
+  uint32_t scratch_leaves;          // leaf count scratch is sized for
+  int step_mode;                    // QST_STEP_HEAT_BATH or QST_STEP_METROPOLIS
+  int lean;                         // workspaces without full path matrices
+  struct QSTSolverStats *stats;     // borrowed, may be NULL
+  struct QSTScoreCache *cache;      // borrowed, may be NULL
+  int screen_samples;               // QST_STEP_SCREENED settings
+  int screen_top;
+  struct QSTContext **batch_workers;  // one per pool thread, kept between batches
+  int batch_worker_count;
+};
+
+/* The state of a qsSolveMCMC style search between two steps, which is
+ * everything a checkpoint has to record. */
+struct QSTSolverState {
+  int leaf_count;
+  int tree_count;
+  int step_mode;
+  struct QSTree *trees[10];
+  struct QSTSearchWorkspace *workspaces[10];  // of each chain, heat bath chains share
+  struct QSTSearchWorkspace *workspace;
+  int owns_workspace;
+  struct QSTScoreModel *model;
+  struct QSTRandom *rng;            // borrowed, NULL for rand()
+  struct QSTThreadPool *pool;       // borrowed, may be NULL
+  int tree_pointer;                 // chain that stepped last
+  uint64_t itercount;               // beta is log(itercount) cubed
+  double score;
+  int done;
+  uint64_t matrix_hash;             // for checkpoints, 0 until first needed
+  struct QSTSolverStats *stats;     // borrowed, may be NULL
+};
+void qsAttachSolverState(struct QSTSolverState *state, const struct QSTContext *ctx);
+void qsAttachWorkspace(struct QSTSearchWorkspace *workspace, const struct QSTContext *ctx);
+struct QSTSolverState *qsNewSolverState(int leaf_count, const double *distmatrix,
+                                        int tree_count, struct QSTRandom *rng,
+                                        struct QSTThreadPool *pool,
+                                        struct QSTSearchWorkspace *workspace, int lean,
+                                        int step_mode, int randomize);
+
+/* A workspace of the same kind as like, lean or not. */
+struct QSTSearchWorkspace *qsNewSearchWorkspaceLike(const struct QSTSearchWorkspace *like,
+                                                    uint32_t leaf_count, int worker_count);
+
+/* Context buffers sized for leaf_count, reallocated only when it changes. */
+struct QSTSearchWorkspace *qsContextWorkspace(struct QSTContext *ctx, uint32_t leaf_count);
+uint16_t *qsContextScratch(struct QSTContext *ctx, uint32_t leaf_count);
+
+/* Accumulates the quartets whose two smallest indices are a and some b in
+ * [b_begin, b_end) into totals.  totmin and totmax are only accumulated
+ * when with_bounds is nonzero.  pathmatrix is truncated to leaves. */
+void qsScoreQuartetRange(const uint16_t *pathmatrix, const double *distmatrix,
+                         uint32_t leaf_count, uint32_t a, uint32_t b_begin, uint32_t b_end,
+                         int with_bounds, struct QSTScoreTotals *totals);
+
+/* All quartets, in fixed chunks spread over pool (which may be NULL). */
+void qsScoreQuartetChunks(const uint16_t *pathmatrix, const double *distmatrix,
+                          uint32_t leaf_count, int with_bounds, struct QSTThreadPool *pool,
+                          struct QSTScoreTotals *totals);
+
+/* The same for distances in any QST_DIST layout. */
+void qsScoreQuartetRangeLayout(const uint16_t *pathmatrix, const void *distances, int layout,
+                               uint32_t leaf_count, uint32_t a, uint32_t b_begin, uint32_t b_end,
+                               int with_bounds, struct QSTScoreTotals *totals);
+void qsScoreQuartetChunksLayout(const uint16_t *pathmatrix, const void *distances, int layout,
+                                uint32_t leaf_count, int with_bounds, struct QSTThreadPool *pool,
+                                struct QSTScoreTotals *totals);
+
+/* Runs task(obj, i, worker) for every i in [0, task_count) on the pool's
+ * threads and the caller; worker is in [0, qsThreadPoolSize(pool)). */
+void qsThreadPoolRun(struct QSTThreadPool *pool, int task_count,
+                     void (*task)(void *obj, int task_index, int worker), void *obj);
+
+#endif
@@ -0,0 +1,496 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "qsprivate.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define QST_X86_KERNELS 1
+#endif
+
+/* Every scoring kernel walks quartets a < b < c < d with d innermost.  For
+ * a fixed (a, b, c) the three topology costs of each d are one scalar plus
+ * one element of a contiguous distance row, and the two path sums that pick
+ * the consistent topology are likewise a scalar plus a contiguous path row:
+ *
+ *   ab|cd : D[a][b] + D[c][d]     P[a][b] + P[c][d]
+ *   ac|bd : D[a][c] + D[b][d]     P[a][c] + P[b][d]
+ *   ad|bc : D[a][d] + D[b][c]     (the remaining case)
+ *
+ * so the d loop streams five rows and vectorizes without gathers.  Only
+ * D[x][y] with x < y is ever read, which is what lets the distances be
+ * stored as the packed upper triangle: row x then holds just the columns
+ * past x, and D[x][y] sits at rowBase(x) + y either way.  Float distances
+ * are widened to double as they are loaded, so every layout sums in
+ * double. */
+
+typedef void (*QSTScoreKernel)(const uint16_t *pathmatrix, const void *distances, int packed,
+                               uint32_t leaf_count, uint32_t a, uint32_t b_begin, uint32_t b_end,
+                               int with_bounds, struct QSTScoreTotals *totals);
+
+static __inline__ ptrdiff_t rowBase(uint32_t n, uint32_t x, int packed) {
+  ptrdiff_t px = x;
+  return packed ? px * n - px * (px + 1) / 2 - px - 1 : px * n;
+}
+
+/* Scalar run over d in [d, n) for one (a, b, c); also the SIMD tail.  The
+ * distance rows are given by their offsets ra, rb, rc into dist. */
+#define QST_DEFINE_SCORE_RUN(NAME, T)                                                        \
+static __inline__ void NAME(const uint16_t *pa, const uint16_t *pb, const uint16_t *pc,      \
+                            const T *dist, ptrdiff_t ra, ptrdiff_t rb, ptrdiff_t rc,         \
+                            uint32_t b, uint32_t c, uint32_t d, uint32_t n,                  \
+                            int with_bounds, struct QSTScoreTotals *acc) {                   \
+  const int pab = pa[b], pac = pa[c];                                                        \
+  const double dab = dist[ra + b], dac = dist[ra + c], dbc = dist[rb + c];                   \
+  for (; d < n; d += 1) {                                                                    \
+    const double s0 = dab + (double) dist[rc + d], s1 = dac + (double) dist[rb + d];         \
+    const double s2 = (double) dist[ra + d] + dbc;                                           \
+    const int t0 = pab + pc[d], t1 = pac + pb[d];                                            \
+    acc->totcur += t0 < t1 ? s0 : (t1 < t0 ? s1 : s2);                                       \
+    if (with_bounds) {                                                                       \
+      double mn = s0, mx = s0;                                                               \
+      if (s1 < mn) { mn = s1; }                                                              \
+      if (s1 > mx) { mx = s1; }                                                              \
+      if (s2 < mn) { mn = s2; }                                                              \
+      if (s2 > mx) { mx = s2; }                                                              \
+      acc->totmin += mn;                                                                     \
+      acc->totmax += mx;                                                                     \
+    }                                                                                        \
+  }                                                                                          \
+}
+
+QST_DEFINE_SCORE_RUN(scoreRun, double)
+QST_DEFINE_SCORE_RUN(scoreRunFloat, float)
+
+#define QST_DEFINE_SCALAR_KERNEL(NAME, RUN, T)                                               \
+static void NAME(const uint16_t *pathmatrix, const void *distances, int packed,              \
+                 uint32_t leaf_count, uint32_t a, uint32_t b_begin, uint32_t b_end,          \
+                 int with_bounds, struct QSTScoreTotals *totals) {                           \
+  const uint32_t n = leaf_count;                                                             \
+  const T *dist = (const T *) distances;                                                     \
+  struct QSTScoreTotals acc = { 0.0, 0.0, 0.0 };                                             \
+  uint32_t b, c;                                                                             \
+  for (b = b_begin; b < b_end; b += 1) {                                                     \
+    for (c = b + 1; c < n; c += 1) {                                                         \
+      RUN(pathmatrix + a*n, pathmatrix + b*n, pathmatrix + c*n, dist,                        \
+          rowBase(n, a, packed), rowBase(n, b, packed), rowBase(n, c, packed),               \
+          b, c, c + 1, n, with_bounds, &acc);                                                \
+    }                                                                                        \
+  }                                                                                          \
+  totals->totcur += acc.totcur;                                                              \
+  if (with_bounds) {                                                                         \
+    totals->totmin += acc.totmin;                                                            \
+    totals->totmax += acc.totmax;                                                            \
+  }                                                                                          \
+}
+
+QST_DEFINE_SCALAR_KERNEL(scoreRangeScalar, scoreRun, double)
+QST_DEFINE_SCALAR_KERNEL(scoreRangeScalarFloat, scoreRunFloat, float)
+
+#ifdef QST_X86_KERNELS
+
+static __inline__ double hsum128(__m128d v) {
+  return _mm_cvtsd_f64(_mm_add_sd(v, _mm_unpackhi_pd(v, v)));
+}
+
+static __inline__ __m128d loadPath2(const uint16_t *p) {
+  int32_t pair;
+  memcpy(&pair, p, sizeof(pair));
+  __m128i w = _mm_unpacklo_epi16(_mm_cvtsi32_si128(pair), _mm_setzero_si128());
+  return _mm_cvtepi32_pd(w);
+}
+
+static __inline__ __m128d loadDist2(const double *p) {
+  return _mm_loadu_pd(p);
+}
+
+static __inline__ __m128d loadDist2Float(const float *p) {
+  return _mm_cvtps_pd(_mm_castsi128_ps(_mm_loadl_epi64((const __m128i *) p)));
+}
+
+#define QST_DEFINE_SSE2_KERNEL(NAME, RUN, LOAD, T)                                           \
+static void NAME(const uint16_t *pathmatrix, const void *distances, int packed,              \
+                 uint32_t leaf_count, uint32_t a, uint32_t b_begin, uint32_t b_end,          \
+                 int with_bounds, struct QSTScoreTotals *totals) {                           \
+  const uint32_t n = leaf_count;                                                             \
+  const T *dist = (const T *) distances;                                                     \
+  __m128d vcur = _mm_setzero_pd(), vmin = _mm_setzero_pd(), vmax = _mm_setzero_pd();        \
+  struct QSTScoreTotals tail = { 0.0, 0.0, 0.0 };                                            \
+  const uint16_t *pa = pathmatrix + a*n;                                                     \
+  const ptrdiff_t ra = rowBase(n, a, packed);                                                \
+  uint32_t b, c, d;                                                                          \
+  for (b = b_begin; b < b_end; b += 1) {                                                     \
+    const uint16_t *pb = pathmatrix + b*n;                                                   \
+    const ptrdiff_t rb = rowBase(n, b, packed);                                              \
+    for (c = b + 1; c < n; c += 1) {                                                         \
+      const uint16_t *pc = pathmatrix + c*n;                                                 \
+      const ptrdiff_t rc = rowBase(n, c, packed);                                            \
+      const __m128d pab = _mm_set1_pd(pa[b]), pac = _mm_set1_pd(pa[c]);                     \
+      const __m128d dab = _mm_set1_pd(dist[ra + b]), dac = _mm_set1_pd(dist[ra + c]);       \
+      const __m128d dbc = _mm_set1_pd(dist[rb + c]);                                         \
+      for (d = c + 1; d + 2 <= n; d += 2) {                                                  \
+        __m128d s0 = _mm_add_pd(dab, LOAD(dist + (rc + d)));                                 \
+        __m128d s1 = _mm_add_pd(dac, LOAD(dist + (rb + d)));                                 \
+        __m128d s2 = _mm_add_pd(LOAD(dist + (ra + d)), dbc);                                 \
+        __m128d t0 = _mm_add_pd(pab, loadPath2(pc + d));                                     \
+        __m128d t1 = _mm_add_pd(pac, loadPath2(pb + d));                                     \
+        __m128d m0 = _mm_cmplt_pd(t0, t1), m1 = _mm_cmplt_pd(t1, t0);                        \
+        __m128d cur = _mm_or_pd(_mm_and_pd(m0, s0), _mm_andnot_pd(m0, s2));                  \
+        cur = _mm_or_pd(_mm_and_pd(m1, s1), _mm_andnot_pd(m1, cur));                         \
+        vcur = _mm_add_pd(vcur, cur);                                                        \
+        if (with_bounds) {                                                                   \
+          vmin = _mm_add_pd(vmin, _mm_min_pd(_mm_min_pd(s0, s1), s2));                       \
+          vmax = _mm_add_pd(vmax, _mm_max_pd(_mm_max_pd(s0, s1), s2));                       \
+        }                                                                                    \
+      }                                                                                      \
+      RUN(pa, pb, pc, dist, ra, rb, rc, b, c, d, n, with_bounds, &tail);                     \
+    }                                                                                        \
+  }                                                                                          \
+  totals->totcur += hsum128(vcur) + tail.totcur;                                             \
+  if (with_bounds) {                                                                         \
+    totals->totmin += hsum128(vmin) + tail.totmin;                                           \
+    totals->totmax += hsum128(vmax) + tail.totmax;                                           \
+  }                                                                                          \
+}
+
+QST_DEFINE_SSE2_KERNEL(scoreRangeSSE2, scoreRun, loadDist2, double)
+QST_DEFINE_SSE2_KERNEL(scoreRangeSSE2Float, scoreRunFloat, loadDist2Float, float)
+
+__attribute__((target("avx2")))
+static __inline__ double hsum256(__m256d v) {
+  __m128d lo = _mm256_castpd256_pd128(v), hi = _mm256_extractf128_pd(v, 1);
+  lo = _mm_add_pd(lo, hi);
+  return _mm_cvtsd_f64(_mm_add_sd(lo, _mm_unpackhi_pd(lo, lo)));
+}
+
+__attribute__((target("avx2")))
+static __inline__ __m256d loadPath4(const uint16_t *p) {
+  return _mm256_cvtepi32_pd(_mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i *) p)));
+}
+
+__attribute__((target("avx2")))
+static __inline__ __m256d loadDist4(const double *p) {
+  return _mm256_loadu_pd(p);
+}
+
+__attribute__((target("avx2")))
+static __inline__ __m256d loadDist4Float(const float *p) {
+  return _mm256_cvtps_pd(_mm_loadu_ps(p));
+}
+
+#define QST_DEFINE_AVX2_KERNEL(NAME, RUN, LOAD, T)                                           \
+__attribute__((target("avx2")))                                                              \
+static void NAME(const uint16_t *pathmatrix, const void *distances, int packed,              \
+                 uint32_t leaf_count, uint32_t a, uint32_t b_begin, uint32_t b_end,          \
+                 int with_bounds, struct QSTScoreTotals *totals) {                           \
+  const uint32_t n = leaf_count;                                                             \
+  const T *dist = (const T *) distances;                                                     \
+  __m256d vcur = _mm256_setzero_pd(), vmin = _mm256_setzero_pd();                            \
+  __m256d vmax = _mm256_setzero_pd();                                                        \
+  struct QSTScoreTotals tail = { 0.0, 0.0, 0.0 };                                            \
+  const uint16_t *pa = pathmatrix + a*n;                                                     \
+  const ptrdiff_t ra = rowBase(n, a, packed);                                                \
+  uint32_t b, c, d;                                                                          \
+  for (b = b_begin; b < b_end; b += 1) {                                                     \
+    const uint16_t *pb = pathmatrix + b*n;                                                   \
+    const ptrdiff_t rb = rowBase(n, b, packed);                                              \
+    for (c = b + 1; c < n; c += 1) {                                                         \
+      const uint16_t *pc = pathmatrix + c*n;                                                 \
+      const ptrdiff_t rc = rowBase(n, c, packed);                                            \
+      const __m256d pab = _mm256_set1_pd(pa[b]), pac = _mm256_set1_pd(pa[c]);               \
+      const __m256d dab = _mm256_set1_pd(dist[ra + b]), dac = _mm256_set1_pd(dist[ra + c]); \
+      const __m256d dbc = _mm256_set1_pd(dist[rb + c]);                                      \
+      for (d = c + 1; d + 4 <= n; d += 4) {                                                  \
+        __m256d s0 = _mm256_add_pd(dab, LOAD(dist + (rc + d)));                              \
+        __m256d s1 = _mm256_add_pd(dac, LOAD(dist + (rb + d)));                              \
+        __m256d s2 = _mm256_add_pd(LOAD(dist + (ra + d)), dbc);                              \
+        __m256d t0 = _mm256_add_pd(pab, loadPath4(pc + d));                                  \
+        __m256d t1 = _mm256_add_pd(pac, loadPath4(pb + d));                                  \
+        __m256d cur = _mm256_blendv_pd(s2, s0, _mm256_cmp_pd(t0, t1, _CMP_LT_OQ));           \
+        cur = _mm256_blendv_pd(cur, s1, _mm256_cmp_pd(t1, t0, _CMP_LT_OQ));                  \
+        vcur = _mm256_add_pd(vcur, cur);                                                     \
+        if (with_bounds) {                                                                   \
+          vmin = _mm256_add_pd(vmin, _mm256_min_pd(_mm256_min_pd(s0, s1), s2));              \
+          vmax = _mm256_add_pd(vmax, _mm256_max_pd(_mm256_max_pd(s0, s1), s2));              \
+        }                                                                                    \
+      }                                                                                      \
+      RUN(pa, pb, pc, dist, ra, rb, rc, b, c, d, n, with_bounds, &tail);                     \
+    }                                                                                        \
+  }                                                                                          \
+  totals->totcur += hsum256(vcur) + tail.totcur;                                             \
+  if (with_bounds) {                                                                         \
+    totals->totmin += hsum256(vmin) + tail.totmin;                                           \
+    totals->totmax += hsum256(vmax) + tail.totmax;                                           \
+  }                                                                                          \
+}
+
+QST_DEFINE_AVX2_KERNEL(scoreRangeAVX2, scoreRun, loadDist4, double)
+QST_DEFINE_AVX2_KERNEL(scoreRangeAVX2Float, scoreRunFloat, loadDist4Float, float)
+
+#endif
+
+static QSTScoreKernel chosen_kernel, chosen_float_kernel;
+static const char *chosen_kernel_name;
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+
+/* Resolved once, under pthread_once as the first scorings may come from
+ * several chain threads at a time; QSEARCH_KERNEL=scalar|sse2 caps the
+ * choice for testing. */
+static void chooseKernel(void) {
+  const char *forced = getenv("QSEARCH_KERNEL");
+  QSTScoreKernel kernel = scoreRangeScalar, float_kernel = scoreRangeScalarFloat;
+  const char *name = "scalar";
+#ifdef QST_X86_KERNELS
+  int cap = 2;
+  if (forced != NULL && strcmp(forced, "scalar") == 0) { cap = 0; }
+  if (forced != NULL && strcmp(forced, "sse2") == 0) { cap = 1; }
+  __builtin_cpu_init();
+  if (cap >= 1 && __builtin_cpu_supports("sse2")) {
+    kernel = scoreRangeSSE2;
+    float_kernel = scoreRangeSSE2Float;
+    name = "sse2";
+  }
+  if (cap >= 2 && __builtin_cpu_supports("avx2")) {
+    kernel = scoreRangeAVX2;
+    float_kernel = scoreRangeAVX2Float;
+    name = "avx2";
+  }
+#else
+  (void) forced;
+#endif
+  chosen_kernel_name = name;
+  chosen_float_kernel = float_kernel;
+  chosen_kernel = kernel;
+}
+
+const char *qsScoreKernelName(void) {
+  pthread_once(&kernel_once, chooseKernel);
+  return chosen_kernel_name;
+}
+
+void qsScoreQuartetRangeLayout(const uint16_t *pathmatrix, const void *distances, int layout,
+                               uint32_t leaf_count, uint32_t a, uint32_t b_begin, uint32_t b_end,
+                               int with_bounds, struct QSTScoreTotals *totals) {
+  pthread_once(&kernel_once, chooseKernel);
+  QSTScoreKernel kernel = (layout & QST_DIST_FLOAT32) ? chosen_float_kernel : chosen_kernel;
+  kernel(pathmatrix, distances, (layout & QST_DIST_PACKED) != 0, leaf_count, a, b_begin, b_end,
+         with_bounds, totals);
+}
+
+void qsScoreQuartetRange(const uint16_t *pathmatrix, const double *distmatrix,
+                         uint32_t leaf_count, uint32_t a, uint32_t b_begin, uint32_t b_end,
+                         int with_bounds, struct QSTScoreTotals *totals) {
+  qsScoreQuartetRangeLayout(pathmatrix, distmatrix, QST_DIST_DENSE, leaf_count, a, b_begin,
+                            b_end, with_bounds, totals);
+}
+
+/* Work is split into QST_SCORE_CHUNKS runs of consecutive (a, b) pairs
+ * holding roughly equal numbers of quartets; pair (a, b) owns C(n-1-b, 2)
+ * of them, so splitting on a alone would leave a = 0 with about 4/n of
+ * everything.  The chunk boundaries and the order the per chunk sums are
+ * added back together depend only on the leaf count, which keeps scores
+ * bit for bit identical whatever the number of threads. */
+#define QST_SCORE_CHUNKS 256
+
+static uint64_t choose3(uint64_t m) {
+  return m < 3 ? 0 : m * (m - 1) * (m - 2) / 6;
+}
+
+struct QSTScoreJob {
+  const uint16_t *pathmatrix;
+  const void *distances;
+  int layout;
+  uint32_t leaf_count;
+  int with_bounds;
+  uint32_t chunk_a[QST_SCORE_CHUNKS + 1], chunk_b[QST_SCORE_CHUNKS + 1];
+  struct QSTScoreTotals partial[QST_SCORE_CHUNKS];
+};
+
+static void planScoreChunks(struct QSTScoreJob *job) {
+  const uint32_t n = job->leaf_count;
+  const uint64_t total = choose3(n) * (n > 3 ? n - 3 : 0) / 4;
+  uint64_t before = 0;
+  uint32_t a, k = 1;
+  job->chunk_a[0] = 0;
+  job->chunk_b[0] = 1;
+  for (a = 0; a < n && k < QST_SCORE_CHUNKS; ++a) {
+    const uint64_t work_a = choose3(n - 1 - a);
+    while (k < QST_SCORE_CHUNKS &&
+           before + work_a >= total / QST_SCORE_CHUNKS * k) {
+      /* pairs (a, a+1 .. b-1) hold choose3(n-1-a) - choose3(n-b) quartets */
+      uint64_t need = total / QST_SCORE_CHUNKS * k - before;
+      uint32_t lo = a + 1, hi = n;
+      while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (work_a - choose3(n - mid) >= need) { hi = mid; } else { lo = mid + 1; }
+      }
+      job->chunk_a[k] = a;
+      job->chunk_b[k] = lo;
+      k += 1;
+    }
+    before += work_a;
+  }
+  for (; k <= QST_SCORE_CHUNKS; ++k) {
+    job->chunk_a[k] = n;
+    job->chunk_b[k] = n;
+  }
+}
+
+static void scoreChunkTask(void *obj, int chunk, int worker) {
+  struct QSTScoreJob *job = (struct QSTScoreJob *) obj;
+  const uint32_t n = job->leaf_count;
+  uint32_t a0 = job->chunk_a[chunk], b0 = job->chunk_b[chunk];
+  uint32_t a1 = job->chunk_a[chunk+1], b1 = job->chunk_b[chunk+1];
+  struct QSTScoreTotals *acc = &job->partial[chunk];
+  uint32_t a;
+  acc->totcur = 0.0; acc->totmin = 0.0; acc->totmax = 0.0;
+  for (a = a0; a <= a1 && a < n; ++a) {
+    uint32_t b_begin = (a == a0) ? b0 : a + 1;
+    uint32_t b_end = (a == a1) ? b1 : n;
+    if (b_begin < b_end) {
+      qsScoreQuartetRangeLayout(job->pathmatrix, job->distances, job->layout, n, a, b_begin,
+                                b_end, job->with_bounds, acc);
+    }
+  }
+}
+
+void qsScoreQuartetChunksLayout(const uint16_t *pathmatrix, const void *distances, int layout,
+                                uint32_t leaf_count, int with_bounds, struct QSTThreadPool *pool,
+                                struct QSTScoreTotals *totals) {
+  struct QSTScoreJob jobspace, *job = &jobspace;
+  int k;
+  job->pathmatrix = pathmatrix;
+  job->distances = distances;
+  job->layout = layout;
+  job->leaf_count = leaf_count;
+  job->with_bounds = with_bounds;
+  planScoreChunks(job);
+  qsThreadPoolRun(pool, QST_SCORE_CHUNKS, scoreChunkTask, job);
+  for (k = 0; k < QST_SCORE_CHUNKS; ++k) {
+    totals->totcur += job->partial[k].totcur;
+    if (with_bounds) {
+      totals->totmin += job->partial[k].totmin;
+      totals->totmax += job->partial[k].totmax;
+    }
+  }
+}
+
+void qsScoreQuartetChunks(const uint16_t *pathmatrix, const double *distmatrix,
+                          uint32_t leaf_count, int with_bounds, struct QSTThreadPool *pool,
+                          struct QSTScoreTotals *totals) {
+  qsScoreQuartetChunksLayout(pathmatrix, distmatrix, QST_DIST_DENSE, leaf_count, with_bounds,
+                             pool, totals);
+}
+
+struct QSTScoreModel *qsNewScoreModel(uint32_t leaf_count, const double *distmatrix) {
+  struct QSTScoreModel *model = calloc(sizeof(struct QSTScoreModel), 1);
+  struct QSTScoreTotals totals = { 0.0, 0.0, 0.0 };
+  void *mem = NULL;
+  if (posix_memalign(&mem, 32, sizeof(double) * leaf_count * leaf_count) != 0) {
+    fprintf(stderr, "Error, cannot allocate score model for %d leaves.\n", leaf_count);
+    exit(1);
+  }
+  model->leaf_count = leaf_count;
+  model->distmatrix = mem;
+  memcpy(model->distmatrix, distmatrix, sizeof(double) * leaf_count * leaf_count);
+  model->hash = qsHashDistances(model->distmatrix, leaf_count);
+  /* The bounds do not depend on the tree, but summing them through the same
+   * kernel as totcur keeps an optimal tree scoring exactly 1.0. */
+  struct QSTree *tree = qsNewTree(leaf_count);
+  uint16_t *fullpathmatrix = qsNewFullPathMatrix(leaf_count);
+  uint16_t *pathmatrix = qsNewPathMatrix(leaf_count);
+  qstWritePathMatrix(fullpathmatrix, tree);
+  qstWriteTruncatedPathMatrix(pathmatrix, fullpathmatrix);
+  qsScoreQuartetChunks(pathmatrix, model->distmatrix, leaf_count, 1, NULL, &totals);
+  model->totmin = totals.totmin;
+  model->totmax = totals.totmax;
+  qsFreePathMatrix(pathmatrix);
+  qsFreeFullPathMatrix(fullpathmatrix);
+  qsFreeTree(tree);
+  return model;
+}
+
+void qsFreeScoreModel(struct QSTScoreModel *model) {
+  free(model->distmatrix);
+  free(model);
+}
+
+uint32_t qsScoreModelLeafCount(const struct QSTScoreModel *model) {
+  return model->leaf_count;
+}
+
+double qsScoreTreeTotalsWithModel(const struct QSTree *tree, const uint16_t *pathmatrix,
+ const struct QSTScoreModel *model, struct QSTScoreTotals *totals) {
+  return qsScoreTreeTotalsWithModelParallel(tree, pathmatrix, model, NULL, totals);
+}
+
+double qsScoreTreeTotalsWithModelParallel(const struct QSTree *tree, const uint16_t *pathmatrix,
+ const struct QSTScoreModel *model, struct QSTThreadPool *pool, struct QSTScoreTotals *totals) {
+  totals->totmin = model->totmin;
+  totals->totmax = model->totmax;
+  totals->totcur = 0.0;
+  qsScoreQuartetChunks(pathmatrix, model->distmatrix, model->leaf_count, 0, pool, totals);
+  return qsScoreFromTotals(totals, 0.0);
+}
+
+double qsScoreTreeTotalsParallel(const struct QSTree *tree, const uint16_t *pathmatrix,
+ const double *distmatrix, struct QSTThreadPool *pool, struct QSTScoreTotals *totals) {
+  totals->totmin = 0.0; totals->totmax = 0.0; totals->totcur = 0.0;
+  qsScoreQuartetChunks(pathmatrix, distmatrix, qsLeafCount(tree), 1, pool, totals);
+  return qsScoreFromTotals(totals, 0.0);
+}
+
+double qsScoreTreeTotalsLayout(const struct QSTree *tree, const uint16_t *pathmatrix,
+ const void *distances, int layout, struct QSTThreadPool *pool, struct QSTScoreTotals *totals) {
+  if (layout & ~(QST_DIST_FLOAT32 | QST_DIST_PACKED)) {
+    fprintf(stderr, "Error, unknown distance layout %d.\n", layout);
+    exit(1);
+  }
+  totals->totmin = 0.0; totals->totmax = 0.0; totals->totcur = 0.0;
+  qsScoreQuartetChunksLayout(pathmatrix, distances, layout, qsLeafCount(tree), 1, pool, totals);
+  return qsScoreFromTotals(totals, 0.0);
+}
+
+double qsScoreTreeFloat(const struct QSTree *tree, const uint16_t *pathmatrix,
+ const float *distmatrix) {
+  struct QSTScoreTotals totals;
+  return qsScoreTreeTotalsLayout(tree, pathmatrix, distmatrix, QST_DIST_FLOAT32, NULL, &totals);
+}
+
+double qsScoreTreePacked(const struct QSTree *tree, const uint16_t *pathmatrix,
+ const double *packed) {
+  struct QSTScoreTotals totals;
+  return qsScoreTreeTotalsLayout(tree, pathmatrix, packed, QST_DIST_PACKED, NULL, &totals);
+}
+
+uint64_t qsDistanceLayoutCount(uint32_t leaf_count, int layout) {
+  uint64_t n = leaf_count;
+  return (layout & QST_DIST_PACKED) ? n * (n - 1) / 2 : n * n;
+}
+
+void qsWriteDistanceLayout(void *distances, int layout, const double *distmatrix,
+                           uint32_t leaf_count) {
+  uint64_t i, j, k = 0, n = leaf_count;
+  for (i = 0; i < n; ++i) {
+    for (j = (layout & QST_DIST_PACKED) ? i + 1 : 0; j < n; ++j, ++k) {
+      if (layout & QST_DIST_FLOAT32) {
+        ((float *) distances)[k] = distmatrix[i*n + j];
+      } else {
+        ((double *) distances)[k] = distmatrix[i*n + j];
+      }
+    }
+  }
+}
+
+double qsScoreTreeParallel(const struct QSTree *tree, const uint16_t *pathmatrix,
+ const double *distmatrix, struct QSTThreadPool *pool) {
+  struct QSTScoreTotals totals;
+  return qsScoreTreeTotalsParallel(tree, pathmatrix, distmatrix, pool, &totals);
+}
+
+double qsScoreTreeWithModel(const struct QSTree *tree, const uint16_t *pathmatrix,
+ const struct QSTScoreModel *model) {
+  struct QSTScoreTotals totals;
+  return qsScoreTreeTotalsWithModel(tree, pathmatrix, model, &totals);
+}
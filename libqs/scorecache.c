@@ -0,0 +1,206 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "qsprivate.h"
+
+/* Score cache.  Exact full scorings are remembered by a key made from the
+ * tree's topology hash, a hash of the distances and how they were scored,
+ * so chains that come back to a topology, or a step that rescores the
+ * tree the last step left, look the score up instead.  Scores do not
+ * depend on the kernel numbering, so a hit returns exactly the bits a new
+ * scoring would and a search runs the same with the cache as without.
+ *
+ * The table is set associative, QST_CACHE_WAYS entries to a bucket, and
+ * sized down to a power of two buckets within the memory cap.  Readers
+ * take no lock: every entry carries a sequence number that is odd while a
+ * writer owns it, and a read that saw it change is counted as a miss.  A
+ * writer that finds its entry owned by another simply drops the insert.
+ * A full bucket evicts by clock: each hit marks its entry, and the hand
+ * clears marks until it finds an unmarked entry to replace.  Clearing the
+ * cache moves it to a new generation that is mixed into every key, so old
+ * entries just stop matching and age out. */
+
+#define QST_CACHE_WAYS 4
+
+struct QSTScoreCacheEntry {
+  uint64_t sequence;            // odd while being written
+  uint64_t key;                 // 0 when empty
+  uint64_t score;               // the doubles below, as bits
+  uint64_t totmin, totmax, totcur;
+  uint64_t referenced;          // set by hits, cleared by the clock hand
+};
+
+struct QSTScoreCache {
+  struct QSTScoreCacheEntry *entries;
+  uint8_t *hands;               // clock hand of every bucket
+  uint64_t bucket_mask;
+  uint64_t generation;
+  uint64_t hits, misses, insertions, evictions;
+};
+
+static __inline__ uint64_t mixKey(uint64_t z) {
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+static __inline__ uint64_t doubleBits(double value) {
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return bits;
+}
+
+static __inline__ double bitsDouble(uint64_t bits) {
+  double value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+struct QSTScoreCache *qsNewScoreCache(size_t max_bytes) {
+  struct QSTScoreCache *cache = calloc(sizeof(struct QSTScoreCache), 1);
+  size_t bucket_bytes = QST_CACHE_WAYS * sizeof(struct QSTScoreCacheEntry);
+  uint64_t bucket_count = 1;
+  if (max_bytes < bucket_bytes) {
+    fprintf(stderr, "Error, a score cache needs at least %lu bytes.\n",
+            (unsigned long) bucket_bytes);
+    exit(1);
+  }
+  while (bucket_count * 2 * bucket_bytes <= max_bytes) {
+    bucket_count *= 2;
+  }
+  cache->entries = calloc(bucket_count * QST_CACHE_WAYS, sizeof(struct QSTScoreCacheEntry));
+  cache->hands = calloc(bucket_count, 1);
+  if (cache->entries == NULL || cache->hands == NULL) {
+    fprintf(stderr, "Error, cannot allocate a score cache of %lu bytes.\n",
+            (unsigned long) (bucket_count * bucket_bytes));
+    exit(1);
+  }
+  cache->bucket_mask = bucket_count - 1;
+  cache->generation = 1;
+  return cache;
+}
+
+void qsFreeScoreCache(struct QSTScoreCache *cache) {
+  free(cache->entries);
+  free(cache->hands);
+  free(cache);
+}
+
+void qsClearScoreCache(struct QSTScoreCache *cache) {
+  __atomic_add_fetch(&cache->generation, 1, __ATOMIC_RELAXED);
+}
+
+void qsGetScoreCacheStats(const struct QSTScoreCache *cache, struct QSTScoreCacheStats *stats) {
+  stats->hits = __atomic_load_n(&cache->hits, __ATOMIC_RELAXED);
+  stats->misses = __atomic_load_n(&cache->misses, __ATOMIC_RELAXED);
+  stats->insertions = __atomic_load_n(&cache->insertions, __ATOMIC_RELAXED);
+  stats->evictions = __atomic_load_n(&cache->evictions, __ATOMIC_RELAXED);
+  stats->capacity = (cache->bucket_mask + 1) * QST_CACHE_WAYS;
+}
+
+/* The key stored for key in the current generation; never 0. */
+static uint64_t entryKey(const struct QSTScoreCache *cache, uint64_t key) {
+  uint64_t stored = mixKey(key ^ __atomic_load_n(&cache->generation, __ATOMIC_RELAXED) *
+                           0x9e3779b97f4a7c15ULL);
+  return stored != 0 ? stored : 1;
+}
+
+static struct QSTScoreCacheEntry *bucketOf(const struct QSTScoreCache *cache, uint64_t stored) {
+  return &cache->entries[(stored & cache->bucket_mask) * QST_CACHE_WAYS];
+}
+
+int qsLookupScore(struct QSTScoreCache *cache, uint64_t key, double *score,
+                  struct QSTScoreTotals *totals) {
+  uint64_t stored = entryKey(cache, key);
+  struct QSTScoreCacheEntry *bucket = bucketOf(cache, stored);
+  int i;
+  for (i = 0; i < QST_CACHE_WAYS; ++i) {
+    struct QSTScoreCacheEntry *entry = &bucket[i];
+    uint64_t sequence = __atomic_load_n(&entry->sequence, __ATOMIC_ACQUIRE);
+    if ((sequence & 1) || __atomic_load_n(&entry->key, __ATOMIC_RELAXED) != stored) {
+      continue;
+    }
+    uint64_t bits = __atomic_load_n(&entry->score, __ATOMIC_RELAXED);
+    uint64_t totmin = __atomic_load_n(&entry->totmin, __ATOMIC_RELAXED);
+    uint64_t totmax = __atomic_load_n(&entry->totmax, __ATOMIC_RELAXED);
+    uint64_t totcur = __atomic_load_n(&entry->totcur, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&entry->sequence, __ATOMIC_RELAXED) != sequence) {
+      break;
+    }
+    if (__atomic_load_n(&entry->referenced, __ATOMIC_RELAXED) == 0) {
+      __atomic_store_n(&entry->referenced, 1, __ATOMIC_RELAXED);
+    }
+    *score = bitsDouble(bits);
+    totals->totmin = bitsDouble(totmin);
+    totals->totmax = bitsDouble(totmax);
+    totals->totcur = bitsDouble(totcur);
+    __atomic_add_fetch(&cache->hits, 1, __ATOMIC_RELAXED);
+    return 1;
+  }
+  __atomic_add_fetch(&cache->misses, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+/* Picks the entry for stored in its bucket: the one already holding it,
+ * else an empty one, else the first unmarked one under the clock hand. */
+static struct QSTScoreCacheEntry *victimFor(struct QSTScoreCache *cache, uint64_t stored,
+                                            int *evicting) {
+  struct QSTScoreCacheEntry *bucket = bucketOf(cache, stored);
+  uint8_t *hand = &cache->hands[stored & cache->bucket_mask];
+  int i;
+  *evicting = 0;
+  for (i = 0; i < QST_CACHE_WAYS; ++i) {
+    uint64_t key = __atomic_load_n(&bucket[i].key, __ATOMIC_RELAXED);
+    if (key == stored || key == 0) {
+      return &bucket[i];
+    }
+  }
+  for (i = 0; i < 2 * QST_CACHE_WAYS; ++i) {
+    int way = __atomic_load_n(hand, __ATOMIC_RELAXED) % QST_CACHE_WAYS;
+    __atomic_store_n(hand, (way + 1) % QST_CACHE_WAYS, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&bucket[way].referenced, __ATOMIC_RELAXED) == 0) {
+      *evicting = 1;
+      return &bucket[way];
+    }
+    __atomic_store_n(&bucket[way].referenced, 0, __ATOMIC_RELAXED);
+  }
+  *evicting = 1;
+  return &bucket[__atomic_load_n(hand, __ATOMIC_RELAXED) % QST_CACHE_WAYS];
+}
+
+void qsStoreScore(struct QSTScoreCache *cache, uint64_t key, double score,
+                  const struct QSTScoreTotals *totals) {
+  uint64_t stored = entryKey(cache, key);
+  int evicting;
+  struct QSTScoreCacheEntry *entry = victimFor(cache, stored, &evicting);
+  uint64_t sequence = __atomic_load_n(&entry->sequence, __ATOMIC_RELAXED);
+  if ((sequence & 1) || !__atomic_compare_exchange_n(&entry->sequence, &sequence, sequence + 1,
+                                                     0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+    return;
+  }
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  if (evicting && __atomic_load_n(&entry->key, __ATOMIC_RELAXED) != 0) {
+    __atomic_add_fetch(&cache->evictions, 1, __ATOMIC_RELAXED);
+  }
+  __atomic_store_n(&entry->key, stored, __ATOMIC_RELAXED);
+  __atomic_store_n(&entry->score, doubleBits(score), __ATOMIC_RELAXED);
+  __atomic_store_n(&entry->totmin, doubleBits(totals->totmin), __ATOMIC_RELAXED);
+  __atomic_store_n(&entry->totmax, doubleBits(totals->totmax), __ATOMIC_RELAXED);
+  __atomic_store_n(&entry->totcur, doubleBits(totals->totcur), __ATOMIC_RELAXED);
+  __atomic_store_n(&entry->referenced, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&entry->sequence, sequence + 2, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&cache->insertions, 1, __ATOMIC_RELAXED);
+}
+
+/* Word at a time, since the matrix can run to hundreds of megabytes. */
+uint64_t qsHashDistances(const double *distmatrix, uint32_t leaf_count) {
+  uint64_t hash = 0xcbf29ce484222325ULL, word;
+  size_t i, count = (size_t) leaf_count * leaf_count;
+  for (i = 0; i < count; ++i) {
+    memcpy(&word, &distmatrix[i], sizeof(word));
+    hash = (hash ^ word) * 0x100000001b3ULL;
+    hash ^= hash >> 29;
+  }
+  return hash;
+}
@@ -0,0 +1,143 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "qsprivate.h"
+
+/* A fixed set of worker threads that run one batch of numbered tasks at a
+ * time.  Tasks are claimed from a shared atomic counter, so idle workers
+ * keep taking work until the batch is drained; the calling thread works
+ * as worker 0 and returns once every task has finished. */
+
+struct QSTThreadPool {
+  int thread_count;            // including the calling thread
+  pthread_t *threads;
+  pthread_mutex_t lock;
+  pthread_cond_t work_ready, work_done;
+  uint64_t generation;
+  int busy_workers;
+  int shutdown;
+  void (*task)(void *obj, int task_index, int worker);
+  void *obj;
+  int task_count;
+  int next_task;
+};
+
+struct QSTWorkerStart {
+  struct QSTThreadPool *pool;
+  int worker;
+};
+
+static __thread const struct QSTThreadPool *running_pool;
+
+static void drainTasks(struct QSTThreadPool *pool, int worker) {
+  int i;
+  running_pool = pool;
+  while ((i = __atomic_fetch_add(&pool->next_task, 1, __ATOMIC_RELAXED)) < pool->task_count) {
+    pool->task(pool->obj, i, worker);
+  }
+  running_pool = NULL;
+}
+
+static void *workerMain(void *arg) {
+  struct QSTWorkerStart *start = (struct QSTWorkerStart *) arg;
+  struct QSTThreadPool *pool = start->pool;
+  int worker = start->worker;
+  uint64_t seen = 0;
+  free(start);
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (!pool->shutdown && pool->generation == seen) {
+      pthread_cond_wait(&pool->work_ready, &pool->lock);
+    }
+    if (pool->shutdown) {
+      break;
+    }
+    seen = pool->generation;
+    pthread_mutex_unlock(&pool->lock);
+    drainTasks(pool, worker);
+    pthread_mutex_lock(&pool->lock);
+    pool->busy_workers -= 1;
+    if (pool->busy_workers == 0) {
+      pthread_cond_signal(&pool->work_done);
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+int qsOnlineCPUCount(void) {
+  long count = sysconf(_SC_NPROCESSORS_ONLN);
+  return count > 0 ? (int) count : 1;
+}
+
+struct QSTThreadPool *qsNewThreadPool(int thread_count) {
+  struct QSTThreadPool *pool = calloc(sizeof(struct QSTThreadPool), 1);
+  int i;
+  if (thread_count <= 0) {
+    thread_count = qsOnlineCPUCount();
+  }
+  pool->thread_count = thread_count;
+  pool->threads = calloc(thread_count, sizeof(pthread_t));
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work_ready, NULL);
+  pthread_cond_init(&pool->work_done, NULL);
+  for (i = 1; i < thread_count; ++i) {
+    struct QSTWorkerStart *start = calloc(sizeof(struct QSTWorkerStart), 1);
+    start->pool = pool;
+    start->worker = i;
+    if (pthread_create(&pool->threads[i], NULL, workerMain, start) != 0) {
+      fprintf(stderr, "Error, cannot start worker thread %d.\n", i);
+      exit(1);
+    }
+  }
+  return pool;
+}
+
+void qsFreeThreadPool(struct QSTThreadPool *pool) {
+  int i;
+  pthread_mutex_lock(&pool->lock);
+  pool->shutdown = 1;
+  pthread_cond_broadcast(&pool->work_ready);
+  pthread_mutex_unlock(&pool->lock);
+  for (i = 1; i < pool->thread_count; ++i) {
+    pthread_join(pool->threads[i], NULL);
+  }
+  pthread_cond_destroy(&pool->work_done);
+  pthread_cond_destroy(&pool->work_ready);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool->threads);
+  free(pool);
+}
+
+int qsThreadPoolSize(const struct QSTThreadPool *pool) {
+  return pool->thread_count;
+}
+
+void qsThreadPoolRun(struct QSTThreadPool *pool, int task_count,
+                     void (*task)(void *obj, int task_index, int worker), void *obj) {
+  int i;
+  /* Serial when there is no pool, one thread, or a task of this pool
+   * itself asks for more parallel work; the workers are all busy then. */
+  if (pool == NULL || pool->thread_count == 1 || running_pool == pool) {
+    for (i = 0; i < task_count; ++i) {
+      task(obj, i, 0);
+    }
+    return;
+  }
+  pthread_mutex_lock(&pool->lock);
+  pool->task = task;
+  pool->obj = obj;
+  pool->task_count = task_count;
+  pool->next_task = 0;
+  pool->busy_workers = pool->thread_count - 1;
+  pool->generation += 1;
+  pthread_cond_broadcast(&pool->work_ready);
+  pthread_mutex_unlock(&pool->lock);
+  drainTasks(pool, 0);
+  pthread_mutex_lock(&pool->lock);
+  while (pool->busy_workers > 0) {
+    pthread_cond_wait(&pool->work_done, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,164 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include "qsprivate.h"
+
+/* Topology hash.  Every edge between two kernels splits the leaves in
+ * two; a side is keyed by the xor of per leaf Zobrist keys, and the split
+ * by the smaller of its two side keys, so neither the kernel numbering nor
+ * which side is looked at matters.  The tree hash is the sum of a mixed
+ * key per split.  Leaf edges give the same splits in every tree and are
+ * left out.
+ *
+ * A mutation only changes the splits on the path between the nodes it
+ * moves, so the hash of a neighbor follows from the loaded tree in time
+ * proportional to that path.  The hasher keeps the tree rooted at leaf 0
+ * with the xor of the leaf keys under every node, which gives the key of
+ * either side of any edge directly. */
+
+struct QSTTopologyHasher {
+  uint32_t leaf_count, node_count;
+  uint64_t all;                 // xor of every leaf key
+  uint64_t hash;                // of the loaded tree
+  uint16_t *parent, *depth;
+  uint64_t *below;              // xor of the leaf keys under each node
+  uint16_t *order, *path;       // traversal and path scratch
+};
+
+static __inline__ uint64_t mix64(uint64_t z) {
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+static __inline__ uint64_t leafKey(uint32_t leaf) {
+  return mix64((leaf + 1) * 0x9e3779b97f4a7c15ULL);
+}
+
+static __inline__ uint64_t splitTerm(const struct QSTTopologyHasher *hasher, uint64_t side) {
+  uint64_t other = side ^ hasher->all;
+  return mix64(side < other ? side : other);
+}
+
+/* Key of the side of edge u - v that holds v. */
+static __inline__ uint64_t sideKey(const struct QSTTopologyHasher *hasher, int u, int v) {
+  return hasher->parent[v] == u ? hasher->below[v] : hasher->all ^ hasher->below[u];
+}
+
+struct QSTTopologyHasher *qsNewTopologyHasher(uint32_t leaf_count) {
+  struct QSTTopologyHasher *hasher = calloc(sizeof(struct QSTTopologyHasher), 1);
+  uint32_t i;
+  hasher->leaf_count = leaf_count;
+  hasher->node_count = QST_NODELIST_COUNT(leaf_count);
+  hasher->parent = calloc(hasher->node_count, sizeof(uint16_t));
+  hasher->depth = calloc(hasher->node_count, sizeof(uint16_t));
+  hasher->below = calloc(hasher->node_count, sizeof(uint64_t));
+  hasher->order = calloc(hasher->node_count, sizeof(uint16_t));
+  hasher->path = calloc(hasher->node_count, sizeof(uint16_t));
+  for (i = 0; i < leaf_count; ++i) {
+    hasher->all ^= leafKey(i);
+  }
+  return hasher;
+}
+
+void qsFreeTopologyHasher(struct QSTTopologyHasher *hasher) {
+  free(hasher->parent);
+  free(hasher->depth);
+  free(hasher->below);
+  free(hasher->order);
+  free(hasher->path);
+  free(hasher);
+}
+
+uint64_t qsLoadTopologyHasher(struct QSTTopologyHasher *hasher, const struct QSTree *tree) {
+  const uint16_t *utree = (const uint16_t *) tree;
+  uint32_t leaf_count = hasher->leaf_count, head = 0, tail = 0, i;
+  if (utree[-1] != leaf_count) {
+    fprintf(stderr, "Error, topology hasher built for %d leaves used with %d.\n",
+            leaf_count, utree[-1]);
+    exit(1);
+  }
+  hasher->parent[0] = QST_EMPTY_FLAG(uint16_t);
+  hasher->depth[0] = 0;
+  hasher->order[tail++] = 0;
+  while (head < tail) {
+    int cur = hasher->order[head++];
+    int nlist = QST_NLIST_BASE(utree, cur);
+    int nsize = QST_NLIST_SIZE(utree, cur);
+    hasher->below[cur] = cur < leaf_count ? leafKey(cur) : 0;
+    for (i = 0; i < nsize; ++i) {
+      int neighbor = utree[nlist+i];
+      if (neighbor == hasher->parent[cur]) { continue; }
+      hasher->parent[neighbor] = cur;
+      hasher->depth[neighbor] = hasher->depth[cur] + 1;
+      hasher->order[tail++] = neighbor;
+    }
+  }
+  hasher->hash = 0;
+  for (i = tail - 1; i > 0; --i) {
+    int v = hasher->order[i], u = hasher->parent[v];
+    hasher->below[u] ^= hasher->below[v];
+    if (v >= leaf_count && u >= leaf_count) {
+      hasher->hash += splitTerm(hasher, hasher->below[v]);
+    }
+  }
+  return hasher->hash;
+}
+
+/* Writes the nodes from a to b into hasher->path, returning their count. */
+static int treePath(struct QSTTopologyHasher *hasher, int a, int b) {
+  uint16_t *path = hasher->path, *tail = hasher->order;
+  int up = 0, down = 0;
+  while (hasher->depth[a] > hasher->depth[b]) { path[up++] = a; a = hasher->parent[a]; }
+  while (hasher->depth[b] > hasher->depth[a]) { tail[down++] = b; b = hasher->parent[b]; }
+  while (a != b) {
+    path[up++] = a; a = hasher->parent[a];
+    tail[down++] = b; b = hasher->parent[b];
+  }
+  path[up++] = a;
+  while (down > 0) { path[up++] = tail[--down]; }
+  return up;
+}
+
+/* Hash change from xoring d into the sides of path edges first .. last-1. */
+static uint64_t shiftPathSplits(const struct QSTTopologyHasher *hasher, int first, int last,
+                                uint64_t d) {
+  uint64_t delta = 0;
+  int k;
+  for (k = first; k < last; ++k) {
+    uint64_t side = sideKey(hasher, hasher->path[k], hasher->path[k+1]);
+    delta += splitTerm(hasher, side ^ d) - splitTerm(hasher, side);
+  }
+  return delta;
+}
+
+uint64_t qsTopologyHashAfterMutation(struct QSTTopologyHasher *hasher, uint64_t mutation_code_64) {
+  const uint16_t *mutation_code = (const uint16_t *) &mutation_code_64;
+  const uint16_t *path = hasher->path;
+  int k1 = mutation_code[1], k2 = mutation_code[2];
+  int len = treePath(hasher, k1, k2);
+  if (mutation_code[0] == 0) {
+    /* the leaves trade places: splits between them swap one for the other */
+    return hasher->hash + shiftPathSplits(hasher, 1, len - 2, leafKey(k1) ^ leafKey(k2));
+  }
+  if (mutation_code[0] == 2) {
+    /* the edges at either end trade subtrees and keep their splits */
+    uint64_t d = sideKey(hasher, path[1], k1) ^ sideKey(hasher, path[len-2], k2);
+    return hasher->hash + shiftPathSplits(hasher, 1, len - 2, d);
+  }
+  /* Transfer: i1 and the subtree past k1 leave the edge between i1's other
+   * neighbors for the edge k2 - m3.  The edge i1 - m_toward disappears,
+   * k2 - i1 appears, and the splits on the path up to k2 lose the subtree. */
+  int i1 = path[1], m_toward = path[2], m3 = mutation_code[3];
+  uint64_t moved = sideKey(hasher, i1, k1);
+  uint64_t delta = shiftPathSplits(hasher, 2, len - 1, moved);
+  delta -= splitTerm(hasher, sideKey(hasher, i1, m_toward));
+  delta += splitTerm(hasher, sideKey(hasher, k2, m3) ^ moved);
+  return hasher->hash + delta;
+}
+
+uint64_t qsTreeTopologyHash(const struct QSTree *tree) {
+  struct QSTTopologyHasher *hasher = qsNewTopologyHasher(qsLeafCount(tree));
+  uint64_t hash = qsLoadTopologyHasher(hasher, tree);
+  qsFreeTopologyHasher(hasher);
+  return hash;
+}
@@ -0,0 +1,167 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include "qsprivate.h"
+
+/* Tree distance oracle.  The tree is rooted at its first kernel node and
+ * walked once to record parent and depth of every node together with an
+ * Euler tour.  A sparse table of shallowest nodes over the tour answers
+ * lowest common ancestor queries, and with them node distances, in O(1). */
+
+static uint32_t floorLog2(uint32_t x) {
+  return 31 - __builtin_clz(x);
+}
+
+struct QSTTreeIndex *qsNewTreeIndex(const struct QSTree *tree) {
+  struct QSTTreeIndex *index = calloc(sizeof(struct QSTTreeIndex), 1);
+  uint32_t leaf_count = qsLeafCount(tree);
+  index->leaf_count = leaf_count;
+  index->node_count = QST_NODELIST_COUNT(leaf_count);
+  index->euler_count = 2 * index->node_count - 1;
+  index->levels = floorLog2(index->euler_count) + 1;
+  index->parent = calloc(index->node_count, sizeof(uint16_t));
+  index->depth = calloc(index->node_count, sizeof(uint16_t));
+  index->first = calloc(index->node_count, sizeof(uint32_t));
+  index->last = calloc(index->node_count, sizeof(uint32_t));
+  index->sparse = calloc(index->levels * index->euler_count, sizeof(uint16_t));
+  index->stack = calloc(2 * index->node_count, sizeof(uint16_t));
+  qsUpdateTreeIndex(index, tree);
+  return index;
+}
+
+void qsFreeTreeIndex(struct QSTTreeIndex *index) {
+  free(index->parent);
+  free(index->depth);
+  free(index->first);
+  free(index->last);
+  free(index->sparse);
+  free(index->stack);
+  free(index);
+}
+
+void qsUpdateTreeIndex(struct QSTTreeIndex *index, const struct QSTree *tree) {
+  const uint16_t *utree = (const uint16_t *) tree;
+  uint16_t *euler = index->sparse;
+  uint16_t *stack = index->stack, *next = index->stack + index->node_count;
+  uint32_t root = index->leaf_count, e = 0, sp = 1, k, i;
+  if (utree[-1] != index->leaf_count) {
+    fprintf(stderr, "Error, tree index built for %d leaves used with %d.\n",
+            index->leaf_count, utree[-1]);
+    exit(1);
+  }
+  index->parent[root] = QST_EMPTY_FLAG(uint16_t);
+  index->depth[root] = 0;
+  index->first[root] = 0;
+  index->last[root] = 0;
+  euler[e++] = root;
+  stack[0] = root;
+  next[0] = 0;
+  while (sp > 0) {
+    uint32_t v = stack[sp-1];
+    if (next[sp-1] < QST_NLIST_SIZE(utree, v)) {
+      uint32_t w = utree[QST_NLIST_BASE(utree, v) + next[sp-1]];
+      next[sp-1] += 1;
+      if (w == index->parent[v]) { continue; }
+      index->parent[w] = v;
+      index->depth[w] = index->depth[v] + 1;
+      index->first[w] = e;
+      index->last[w] = e;
+      euler[e++] = w;
+      stack[sp] = w;
+      next[sp] = 0;
+      sp += 1;
+    } else {
+      sp -= 1;
+      if (sp > 0) {
+        index->last[stack[sp-1]] = e;
+        euler[e++] = stack[sp-1];
+      }
+    }
+  }
+  for (k = 1; k < index->levels; ++k) {
+    const uint16_t *prev = index->sparse + (k-1) * index->euler_count;
+    uint16_t *cur = index->sparse + k * index->euler_count;
+    uint32_t half = 1 << (k-1);
+    for (i = 0; i + (1 << k) <= index->euler_count; ++i) {
+      uint16_t x = prev[i], y = prev[i + half];
+      cur[i] = index->depth[x] <= index->depth[y] ? x : y;
+    }
+  }
+}
+
+uint32_t qsTreeIndexLCA(const struct QSTTreeIndex *index, uint32_t a, uint32_t b) {
+  uint32_t l = index->first[a], r = index->first[b];
+  if (l > r) { uint32_t t = l; l = r; r = t; }
+  uint32_t k = floorLog2(r - l + 1);
+  const uint16_t *row = index->sparse + k * index->euler_count;
+  uint16_t x = row[l], y = row[r + 1 - (1 << k)];
+  return index->depth[x] <= index->depth[y] ? x : y;
+}
+
+uint32_t qsTreeIndexDistance(const struct QSTTreeIndex *index, uint32_t a, uint32_t b) {
+  uint32_t c = qsTreeIndexLCA(index, a, b);
+  return index->depth[a] + index->depth[b] - 2 * index->depth[c];
+}
+
+/* Neighbor of a on the path towards b: the child whose Euler interval
+ * holds b when a is an ancestor of b, and the parent of a otherwise. */
+uint32_t qsTreeIndexNextHop(const struct QSTTreeIndex *index, uint32_t a, uint32_t b) {
+  uint32_t fb = index->first[b];
+  if (index->first[a] <= fb && fb <= index->last[a]) {
+    uint32_t lo = index->first[a] + 1;
+    while (1) {
+      uint32_t child = index->sparse[lo];
+      if (fb <= index->last[child]) {
+        return child;
+      }
+      lo = index->last[child] + 2;
+    }
+  }
+  return index->parent[a];
+}
+
+int qsTreeIndexQuartetTopology(const struct QSTTreeIndex *index,
+                               uint32_t a, uint32_t b, uint32_t c, uint32_t d) {
+  uint32_t t0 = qsTreeIndexDistance(index, a, b) + qsTreeIndexDistance(index, c, d);
+  uint32_t t1 = qsTreeIndexDistance(index, a, c) + qsTreeIndexDistance(index, b, d);
+  if (t0 < t1) { return 0; }
+  if (t1 < t0) { return 1; }
+  return 2;
+}
+
+void qsTreeIndexWritePathMatrix(const struct QSTTreeIndex *index, uint16_t *pathmatrix) {
+  uint32_t n = index->leaf_count, i, j;
+  pathmatrix[-1] = n;
+  for (i = 0; i < n; ++i) {
+    pathmatrix[i*n + i] = 0;
+    for (j = i + 1; j < n; ++j) {
+      pathmatrix[i*n + j] = pathmatrix[j*n + i] = qsTreeIndexDistance(index, i, j);
+    }
+  }
+}
+
+int qsPathFromToIndexed(const struct QSTree *tree, const struct QSTTreeIndex *index,
+                        int a, int b, uint16_t *path_buffer) {
+  uint32_t c = qsTreeIndexLCA(index, a, b);
+  int up = index->depth[a] - index->depth[c];
+  int path_length = up + index->depth[b] - index->depth[c] + 1;
+  int i;
+  for (i = 0; i < up; ++i) {
+    path_buffer[i] = a;
+    a = index->parent[a];
+  }
+  for (i = path_length - 1; i > up; --i) {
+    path_buffer[i] = b;
+    b = index->parent[b];
+  }
+  path_buffer[up] = c;
+  return path_length;
+}
+
+double qsScoreTreeIndexed(const struct QSTree *tree, const struct QSTTreeIndex *index,
+ const double *distmatrix) {
+  uint16_t *pathmatrix = qsNewPathMatrix(index->leaf_count);
+  qsTreeIndexWritePathMatrix(index, pathmatrix);
+  double score = qsScoreTree(tree, pathmatrix, distmatrix);
+  qsFreePathMatrix(pathmatrix);
+  return score;
+}
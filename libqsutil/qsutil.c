@@ -0,0 +1,477 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "qsutil.h"
+
+#define QST_MATRIX_VERSION 1
+#define QST_MATRIX_BYTE_ORDER 0x01020304
+
+struct QSTMatrixHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t leaf_count;
+  uint32_t flags;
+  uint64_t labels_offset;
+  uint64_t labels_size;
+  uint64_t data_offset;
+  uint64_t data_size;
+  uint64_t reserved;
+};
+
+static uint64_t matrixEntryCount(uint32_t leaf_count, uint32_t flags) {
+  uint64_t n = leaf_count;
+  return (flags & QST_MATRIX_PACKED) ? n * (n - 1) / 2 : n * n;
+}
+
+static uint64_t matrixDataSize(uint32_t leaf_count, uint32_t flags) {
+  return matrixEntryCount(leaf_count, flags) *
+         ((flags & QST_MATRIX_FLOAT32) ? sizeof(float) : sizeof(double));
+}
+
+/* Position of i < j in the packed upper triangle. */
+static __inline__ uint64_t packedIndex(uint64_t n, uint64_t i, uint64_t j) {
+  return i * n - i * (i + 1) / 2 + (j - i - 1);
+}
+
+double qsMatrixDistance(const struct QSTMatrixFile *matrix, uint32_t i, uint32_t j) {
+  uint64_t n = matrix->leaf_count, k;
+  if (matrix->flags & QST_MATRIX_PACKED) {
+    if (i == j) {
+      return 0.0;
+    }
+    k = i < j ? packedIndex(n, i, j) : packedIndex(n, j, i);
+  } else {
+    k = i * n + j;
+  }
+  if (matrix->flags & QST_MATRIX_FLOAT32) {
+    return ((const float *) matrix->data)[k];
+  }
+  return ((const double *) matrix->data)[k];
+}
+
+int qsIsBinaryMatrixFile(const char *path) {
+  char magic[8];
+  FILE *fp = fopen(path, "rb");
+  int result;
+  if (fp == NULL) {
+    fprintf(stderr, "Error, cannot open %s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+  result = fread(magic, 1, 8, fp) == 8 && memcmp(magic, QST_MATRIX_MAGIC, 8) == 0;
+  fclose(fp);
+  return result;
+}
+
+static void badMatrixFile(const char *path, const char *why) {
+  fprintf(stderr, "Error, %s is not a usable matrix file: %s.\n", path, why);
+  exit(1);
+}
+
+/* Whether size bytes at offset lie within a map of map_size bytes, without
+ * the sum overflowing for offsets a damaged header makes up. */
+static int sectionFits(uint64_t offset, uint64_t size, uint64_t map_size) {
+  return offset <= map_size && size <= map_size - offset;
+}
+
+static struct QSTMatrixFile *openBinaryMatrix(const char *path) {
+  struct QSTMatrixFile *matrix = calloc(sizeof(struct QSTMatrixFile), 1);
+  struct QSTMatrixHeader header;
+  struct stat st;
+  uint32_t i;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    fprintf(stderr, "Error, cannot open %s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+  if (st.st_size < QST_MATRIX_HEADER_SIZE) {
+    badMatrixFile(path, "truncated header");
+  }
+  matrix->map_size = st.st_size;
+  matrix->map = mmap(NULL, matrix->map_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (matrix->map == MAP_FAILED) {
+    fprintf(stderr, "Error, cannot map %s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+  memcpy(&header, matrix->map, sizeof(header));
+  if (header.byte_order != QST_MATRIX_BYTE_ORDER) {
+    badMatrixFile(path, "written with the other byte order");
+  }
+  if (header.version != QST_MATRIX_VERSION) {
+    badMatrixFile(path, "unknown version");
+  }
+  if (header.leaf_count < 4 || (header.flags & ~(QST_MATRIX_FLOAT32 | QST_MATRIX_PACKED))) {
+    badMatrixFile(path, "bad leaf count or flags");
+  }
+  if (header.data_size != matrixDataSize(header.leaf_count, header.flags) ||
+      header.data_offset % 64 != 0 ||
+      !sectionFits(header.data_offset, header.data_size, matrix->map_size) ||
+      !sectionFits(header.labels_offset, header.labels_size, matrix->map_size)) {
+    badMatrixFile(path, "sections do not fit");
+  }
+  matrix->leaf_count = header.leaf_count;
+  matrix->flags = header.flags;
+  matrix->data = (const char *) matrix->map + header.data_offset;
+  matrix->labels = calloc(header.leaf_count, sizeof(char *));
+  const char *label = (const char *) matrix->map + header.labels_offset;
+  const char *labels_end = label + header.labels_size;
+  for (i = 0; i < header.leaf_count; ++i) {
+    const char *end = memchr(label, 0, labels_end - label);
+    if (end == NULL) {
+      badMatrixFile(path, "labels are cut short");
+    }
+    matrix->labels[i] = label;
+    label = end + 1;
+  }
+  if (header.flags == 0) {
+    matrix->distmatrix = (const double *) matrix->data;
+  } else {
+    uint32_t j, n = header.leaf_count;
+    matrix->owned = malloc(sizeof(double) * n * n);
+    for (i = 0; i < n; ++i) {
+      for (j = 0; j < n; ++j) {
+        matrix->owned[i*n + j] = qsMatrixDistance(matrix, i, j);
+      }
+    }
+    matrix->distmatrix = matrix->owned;
+  }
+  return matrix;
+}
+
+static char *readWholeFile(const char *path, size_t *size) {
+  FILE *fp = fopen(path, "rb");
+  char *text;
+  long len;
+  if (fp == NULL) {
+    fprintf(stderr, "Error, cannot open %s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+  fseek(fp, 0, SEEK_END);
+  len = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  text = malloc(len + 1);
+  if (fread(text, 1, len, fp) != (size_t) len) {
+    fprintf(stderr, "Error, cannot read %s.\n", path);
+    exit(1);
+  }
+  fclose(fp);
+  text[len] = '\0';
+  *size = len;
+  return text;
+}
+
+/* Each nonblank line holds an optional label and then one distance per
+ * column.  The first row fixes the number of columns, which must equal
+ * the number of rows. */
+static struct QSTMatrixFile *openTextMatrix(const char *path) {
+  struct QSTMatrixFile *matrix = calloc(sizeof(struct QSTMatrixFile), 1);
+  size_t size, capacity = 0, count = 0, label_pos = 0;
+  char *text = readWholeFile(path, &size), *cur = text;
+  uint32_t row = 0, columns = 0;
+  double *values = NULL;
+  char *label_text = malloc(size + 1);
+  size_t *label_at = NULL;
+  while (*cur != '\0') {
+    char *line = cur, *eol = strchr(cur, '\n');
+    uint32_t found = 0;
+    if (eol != NULL) {
+      *eol = '\0';
+      cur = eol + 1;
+    } else {
+      cur += strlen(cur);
+    }
+    line += strspn(line, " \t\r");
+    if (*line == '\0') {
+      continue;
+    }
+    label_at = realloc(label_at, (row + 1) * sizeof(size_t));
+    label_at[row] = label_pos;
+    char *end;
+    strtod(line, &end);
+    if (end == line || (*end != '\0' && strchr(" \t\r", *end) == NULL)) {
+      size_t len = strcspn(line, " \t\r");
+      memcpy(label_text + label_pos, line, len);
+      label_pos += len;
+      line += len;
+    } else {
+      label_pos += sprintf(label_text + label_pos, "%u", row);
+    }
+    label_text[label_pos++] = '\0';
+    for (;;) {
+      double value = strtod(line, &end);
+      if (end == line) {
+        break;
+      }
+      if (count == capacity) {
+        capacity = capacity ? 2 * capacity : 1024;
+        values = realloc(values, capacity * sizeof(double));
+      }
+      values[count++] = value;
+      found += 1;
+      line = end;
+    }
+    if (line[strspn(line, " \t\r")] != '\0') {
+      fprintf(stderr, "Error, %s row %u has something other than a distance: %s\n",
+              path, row + 1, line);
+      exit(1);
+    }
+    if (row == 0) {
+      columns = found;
+    }
+    if (found != columns) {
+      fprintf(stderr, "Error, %s row %u has %u distances, not %u.\n",
+              path, row + 1, found, columns);
+      exit(1);
+    }
+    row += 1;
+  }
+  if (row != columns || row < 4) {
+    fprintf(stderr, "Error, %s holds %u rows of %u distances, not a square of at least 4.\n",
+            path, row, columns);
+    exit(1);
+  }
+  free(text);
+  matrix->leaf_count = row;
+  matrix->flags = 0;
+  matrix->owned = values;
+  matrix->data = values;
+  matrix->distmatrix = values;
+  matrix->label_text = label_text;
+  matrix->labels = calloc(row, sizeof(char *));
+  for (row = 0; row < matrix->leaf_count; ++row) {
+    matrix->labels[row] = label_text + label_at[row];
+  }
+  free(label_at);
+  return matrix;
+}
+
+struct QSTMatrixFile *qsOpenMatrixFile(const char *path) {
+  if (qsIsBinaryMatrixFile(path)) {
+    return openBinaryMatrix(path);
+  }
+  return openTextMatrix(path);
+}
+
+void qsCloseMatrixFile(struct QSTMatrixFile *matrix) {
+  if (matrix->map != NULL) {
+    munmap(matrix->map, matrix->map_size);
+  }
+  free(matrix->owned);
+  free(matrix->label_text);
+  free(matrix->labels);
+  free(matrix);
+}
+
+static void writeOrDie(FILE *fp, const void *buf, size_t size, const char *path) {
+  if (size > 0 && fwrite(buf, 1, size, fp) != size) {
+    fprintf(stderr, "Error, cannot write %s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+}
+
+void qsWriteMatrixFile(const char *path, uint32_t leaf_count, const double *distmatrix,
+                       const char *const *labels, uint32_t flags) {
+  struct QSTMatrixHeader header;
+  static const char zeros[64];
+  char number[16];
+  uint64_t i, j, n = leaf_count;
+  FILE *fp;
+  if (flags & ~(QST_MATRIX_FLOAT32 | QST_MATRIX_PACKED)) {
+    fprintf(stderr, "Error, unknown matrix flags %u.\n", flags);
+    exit(1);
+  }
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, QST_MATRIX_MAGIC, 8);
+  header.version = QST_MATRIX_VERSION;
+  header.byte_order = QST_MATRIX_BYTE_ORDER;
+  header.leaf_count = leaf_count;
+  header.flags = flags;
+  header.labels_offset = QST_MATRIX_HEADER_SIZE;
+  for (i = 0; i < n; ++i) {
+    header.labels_size += (labels ? strlen(labels[i]) : sprintf(number, "%u", (uint32_t) i)) + 1;
+  }
+  header.data_offset = (header.labels_offset + header.labels_size + 63) / 64 * 64;
+  header.data_size = matrixDataSize(leaf_count, flags);
+  fp = fopen(path, "wb");
+  if (fp == NULL) {
+    fprintf(stderr, "Error, cannot create %s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+  writeOrDie(fp, &header, sizeof(header), path);
+  for (i = 0; i < n; ++i) {
+    const char *label = labels ? labels[i] : number;
+    sprintf(number, "%u", (uint32_t) i);
+    writeOrDie(fp, label, strlen(label) + 1, path);
+  }
+  writeOrDie(fp, zeros, header.data_offset - header.labels_offset - header.labels_size, path);
+  for (i = 0; i < n; ++i) {
+    j = (flags & QST_MATRIX_PACKED) ? i + 1 : 0;
+    if (flags & QST_MATRIX_FLOAT32) {
+      for (; j < n; ++j) {
+        float value = distmatrix[i*n + j];
+        writeOrDie(fp, &value, sizeof(value), path);
+      }
+    } else {
+      writeOrDie(fp, &distmatrix[i*n + j], (n - j) * sizeof(double), path);
+    }
+  }
+  if (fclose(fp) != 0) {
+    fprintf(stderr, "Error, cannot write %s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+}
+
+void qsConvertTextMatrix(const char *text_path, const char *binary_path, uint32_t flags) {
+  struct QSTMatrixFile *matrix = openTextMatrix(text_path);
+  qsWriteMatrixFile(binary_path, matrix->leaf_count, matrix->distmatrix,
+                    (const char *const *) matrix->labels, flags);
+  qsCloseMatrixFile(matrix);
+}
+
+static const char *treeLabel(const char *const *labels, uint32_t leaf, char number[16]) {
+  if (labels != NULL) {
+    return labels[leaf];
+  }
+  sprintf(number, "%u", leaf);
+  return number;
+}
+
+/* Newick labels go in single quotes when they hold a character the format
+ * gives a meaning to, with embedded quotes doubled. */
+static void writeNewickLabel(FILE *fp, const char *label) {
+  if (*label != '\0' && strpbrk(label, " \t\r\n()[]':;,") == NULL) {
+    fputs(label, fp);
+    return;
+  }
+  fputc('\'', fp);
+  for (; *label != '\0'; ++label) {
+    if (*label == '\'') {
+      fputc('\'', fp);
+    }
+    fputc(*label, fp);
+  }
+  fputc('\'', fp);
+}
+
+static void writeNewickSubtree(FILE *fp, const uint16_t *utree, uint32_t node, uint32_t parent,
+                               const char *const *labels) {
+  uint32_t leaf_count = utree[-1], base = QST_NLIST_BASE(utree, node), j;
+  int first = 1;
+  char number[16];
+  if (node < leaf_count) {
+    writeNewickLabel(fp, treeLabel(labels, node, number));
+    return;
+  }
+  fputc('(', fp);
+  for (j = 0; j < 3; ++j) {
+    if (utree[base + j] != parent) {
+      if (!first) {
+        fputc(',', fp);
+      }
+      writeNewickSubtree(fp, utree, utree[base + j], node, labels);
+      first = 0;
+    }
+  }
+  fputc(')', fp);
+}
+
+static void writeNewick(FILE *fp, const uint16_t *utree, const char *const *labels) {
+  writeNewickSubtree(fp, utree, utree[0], QST_EMPTY_FLAG(uint16_t), labels);
+  fputs(";\n", fp);
+}
+
+static void writeDot(FILE *fp, const uint16_t *utree, const char *const *labels, double score) {
+  uint32_t leaf_count = utree[-1], i, j;
+  char number[16];
+  fprintf(fp, "graph tree {\n  /* score %.17g */\n", score);
+  for (i = 0; i < leaf_count; ++i) {
+    const char *label = treeLabel(labels, i, number);
+    fprintf(fp, "  n%u [label=\"", i);
+    for (; *label != '\0'; ++label) {
+      if (*label == '"' || *label == '\\') {
+        fputc('\\', fp);
+      }
+      fputc(*label, fp);
+    }
+    fprintf(fp, "\"];\n");
+  }
+  for (i = leaf_count; i < 2*leaf_count - 2; ++i) {
+    fprintf(fp, "  n%u [label=\"\" shape=point];\n", i);
+  }
+  for (i = 0; i < 2*leaf_count - 2; ++i) {
+    uint32_t base = QST_NLIST_BASE(utree, i);
+    for (j = 0; j < QST_NLIST_SIZE(utree, i); ++j) {
+      if (utree[base + j] > i) {
+        fprintf(fp, "  n%u -- n%u;\n", i, utree[base + j]);
+      }
+    }
+  }
+  fprintf(fp, "}\n");
+}
+
+static void writeNexus(FILE *fp, const uint16_t *utree, const char *const *labels, double score) {
+  uint32_t leaf_count = utree[-1], i;
+  char number[16];
+  fprintf(fp, "#NEXUS\n\nBEGIN TAXA;\n  DIMENSIONS NTAX=%u;\n  TAXLABELS", leaf_count);
+  for (i = 0; i < leaf_count; ++i) {
+    fputc(' ', fp);
+    writeNewickLabel(fp, treeLabel(labels, i, number));
+  }
+  fprintf(fp, ";\nEND;\n\nBEGIN TREES;\n  [score %.17g]\n  TREE qsearch = [&U] ", score);
+  writeNewick(fp, utree, labels);
+  fprintf(fp, "END;\n");
+}
+
+void qsWriteTree(FILE *fp, const struct QSTree *tree, const char *const *labels, int format,
+                 double score) {
+  const uint16_t *utree = (const uint16_t *) tree;
+  switch (format) {
+    case QST_TREE_DOT: writeDot(fp, utree, labels, score); break;
+    case QST_TREE_NEWICK: writeNewick(fp, utree, labels); break;
+    case QST_TREE_NEXUS: writeNexus(fp, utree, labels, score); break;
+    default:
+      fprintf(stderr, "Error, unknown tree format %d.\n", format);
+      exit(1);
+  }
+}
+
+void qsSaveTree(const char *path, const struct QSTree *tree, const char *const *labels,
+                int format, double score) {
+  size_t len = strlen(path);
+  char *temp_path = malloc(len + 5);
+  FILE *fp;
+  memcpy(temp_path, path, len);
+  memcpy(temp_path + len, ".tmp", 5);
+  fp = fopen(temp_path, "w");
+  if (fp == NULL) {
+    fprintf(stderr, "Error, cannot create %s: %s\n", temp_path, strerror(errno));
+    exit(1);
+  }
+  qsWriteTree(fp, tree, labels, format, score);
+  if (fflush(fp) != 0 || ferror(fp) || fclose(fp) != 0) {
+    fprintf(stderr, "Error, cannot write %s: %s\n", temp_path, strerror(errno));
+    exit(1);
+  }
+  if (rename(temp_path, path) != 0) {
+    fprintf(stderr, "Error, cannot rename %s to %s: %s\n", temp_path, path, strerror(errno));
+    exit(1);
+  }
+  free(temp_path);
+}
+
+int qsTreeFormatByName(const char *name) {
+  static const char *const names[] = { "dot", "newick", "nexus" };
+  int i;
+  for (i = 0; i < 3; ++i) {
+    if (strcmp(name, names[i]) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
@@ -0,0 +1,84 @@
+#ifndef __QSUTIL_H
+#define __QSUTIL_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <qsearch/libqs.h>
+
+/* Binary distance matrix files.  A 64 byte header, all fields in the
+ * writing host's byte order; the loader rejects files whose byte order
+ * tag shows the other one:
+ *
+ *   offset  0  magic "QSDMATRX"
+ *           8  uint32 version, 1
+ *          12  uint32 byte order tag 0x01020304, as written by the host
+ *          16  uint32 leaf count
+ *          20  uint32 flags, QST_MATRIX_FLOAT32 | QST_MATRIX_PACKED
+ *          24  uint64 offset of the labels
+ *          32  uint64 size of the labels in bytes
+ *          40  uint64 offset of the distances, a multiple of 64
+ *          48  uint64 size of the distances in bytes
+ *          56  reserved, zero
+ *
+ * The labels are leaf count NUL terminated strings back to back.  The
+ * distances are doubles, or floats with QST_MATRIX_FLOAT32, either as the
+ * full row major leaf count square or, with QST_MATRIX_PACKED, as the
+ * rows of the upper triangle above the diagonal.  Scoring only ever reads
+ * the upper triangle, so packing loses nothing it needs. */
+
+/* The same bits as the QST_DIST layouts, so data and flags of an opened
+ * file can go straight to qsScoreTreeTotalsLayout. */
+#define QST_MATRIX_FLOAT32 QST_DIST_FLOAT32
+#define QST_MATRIX_PACKED  QST_DIST_PACKED
+
+#define QST_MATRIX_MAGIC "QSDMATRX"
+#define QST_MATRIX_HEADER_SIZE 64
+
+struct QSTMatrixFile {
+  uint32_t leaf_count;
+  uint32_t flags;               // layout of data
+  const void *data;             // distances as stored
+  const char **labels;          // leaf_count of them
+  const double *distmatrix;     // dense doubles, leaf_count stride
+  void *map;                    // the mapped file, NULL for text input
+  size_t map_size;
+  double *owned;                // distmatrix when it is not the mapping itself
+  char *label_text;             // labels of text input
+};
+
+/* Opens a binary matrix file by mapping it, or reads a text one.  A
+ * binary file of dense doubles is used in place: distmatrix points into
+ * the mapping and nothing is copied, so it opens in constant time.  Other
+ * layouts are expanded to dense doubles on open.  Text input has one row
+ * per line, an optional label followed by leaf count distances. */
+struct QSTMatrixFile *qsOpenMatrixFile(const char *path);
+void qsCloseMatrixFile(struct QSTMatrixFile *matrix);
+int qsIsBinaryMatrixFile(const char *path);
+
+/* labels may be NULL to number the rows. */
+void qsWriteMatrixFile(const char *path, uint32_t leaf_count, const double *distmatrix,
+                       const char *const *labels, uint32_t flags);
+void qsConvertTextMatrix(const char *text_path, const char *binary_path, uint32_t flags);
+
+/* Distance between leaves i and j as stored, in any layout. */
+double qsMatrixDistance(const struct QSTMatrixFile *matrix, uint32_t i, uint32_t j);
+
+/* Tree output.  Graphviz dot draws the tree with a point for every
+ * kernel node; Newick writes the unrooted tree as a trifurcation at the
+ * kernel next to leaf 0; Nexus wraps that Newick string with a TAXA
+ * block.  labels may be NULL to number the leaves.  qsSaveTree writes
+ * path.tmp and renames it over path, so path always holds a whole tree
+ * even if the writer is stopped partway. */
+#define QST_TREE_DOT    0
+#define QST_TREE_NEWICK 1
+#define QST_TREE_NEXUS  2
+
+void qsWriteTree(FILE *fp, const struct QSTree *tree, const char *const *labels, int format,
+                 double score);
+void qsSaveTree(const char *path, const struct QSTree *tree, const char *const *labels,
+                int format, double score);
+/* "dot", "newick" or "nexus"; -1 for anything else. */
+int qsTreeFormatByName(const char *name);
+
+#endif
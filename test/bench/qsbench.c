@@ -0,0 +1,314 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <qsearch.h>
+
+/* Timings of the library's hot paths over a range of leaf counts, as
+ * JSON on stdout.  Every case runs in a child process of its own, so the
+ * peak resident size reported is that case's alone and one case cannot
+ * warm or fragment the heap for the next.  A case repeats its operation
+ * until min_time has passed and reports the mean.  Leaf counts double
+ * from 8 up to max_leaves; a benchmark stops growing once its next size
+ * is projected, from its growth rate, to take longer than budget seconds
+ * per operation.  Distances come from seeded random points, so a run is
+ * repeatable and two builds can be compared case by case. */
+
+#ifndef PACKAGE_VERSION
+#define PACKAGE_VERSION "unknown"
+#endif
+
+#ifdef __GLIBC__
+/* Allocation counts, by interposing on the allocator; the library's
+ * calls resolve to these as well. */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+static uint64_t alloc_count, alloc_bytes;
+
+static void countAllocation(size_t size) {
+  __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&alloc_bytes, size, __ATOMIC_RELAXED);
+}
+
+void *malloc(size_t size) {
+  countAllocation(size);
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+  countAllocation(count * size);
+  return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  countAllocation(size);
+  return __libc_realloc(ptr, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size) {
+  countAllocation(size);
+  *ptr = __libc_memalign(alignment, size);
+  return *ptr == NULL ? 12 : 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+  countAllocation(size);
+  return __libc_memalign(alignment, size);
+}
+#define QST_COUNTS_ALLOCATIONS 1
+#else
+static uint64_t alloc_count, alloc_bytes;
+#define QST_COUNTS_ALLOCATIONS 0
+#endif
+
+struct BenchCase {
+  uint32_t leaf_count;
+  struct QSTree *tree;
+  double *distmatrix;
+  uint16_t *fullpathmatrix;
+  uint16_t *pathmatrix;
+  uint64_t sink;
+};
+
+struct Benchmark {
+  const char *name;
+  double growth;                  // time per operation grows as leaf count to this power
+  void (*op)(struct BenchCase *bc);
+};
+
+struct BenchResult {
+  uint64_t ops;
+  double ns_per_op;
+  double allocs_per_op;
+  double alloc_bytes_per_op;
+  long peak_rss_kb;
+};
+
+static uint64_t benchRandom(uint64_t *state) {
+  uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+/* Euclidean distances between points drawn uniformly from the unit cube
+ * in 8 dimensions. */
+static double *newSyntheticMatrix(uint32_t leaf_count, uint64_t seed) {
+  double *points = malloc(sizeof(double) * 8 * leaf_count);
+  double *distmatrix = malloc(sizeof(double) * leaf_count * leaf_count);
+  uint32_t i, j, k;
+  for (i = 0; i < 8 * leaf_count; ++i) {
+    points[i] = (benchRandom(&seed) >> 11) * (1.0 / 9007199254740992.0);
+  }
+  for (i = 0; i < leaf_count; ++i) {
+    for (j = 0; j < leaf_count; ++j) {
+      double sum = 0;
+      for (k = 0; k < 8; ++k) {
+        double diff = points[8*i + k] - points[8*j + k];
+        sum += diff * diff;
+      }
+      distmatrix[i*leaf_count + j] = sqrt(sum);
+    }
+  }
+  free(points);
+  return distmatrix;
+}
+
+static void benchWritePathMatrix(struct BenchCase *bc) {
+  qstWritePathMatrix(bc->fullpathmatrix, bc->tree);
+}
+
+static void benchScoreTree(struct BenchCase *bc) {
+  bc->sink += qsScoreTree(bc->tree, bc->pathmatrix, bc->distmatrix) > 0.5;
+}
+
+static int countMutation(const struct QSTree *tree, const struct QSTree *nexttree,
+                         int sequence_number, uint64_t mutation_code, void *obj) {
+  *(uint64_t *) obj += 1;
+  return 0;
+}
+
+static void benchIterateMutations(struct BenchCase *bc) {
+  qsIterateMutations(bc->tree, bc->fullpathmatrix, &bc->sink, countMutation);
+}
+
+static void benchApplyRandomMutation(struct BenchCase *bc) {
+  qsApplyRandomMutation(bc->tree);
+}
+
+static void benchStepMCMC(struct BenchCase *bc) {
+  bc->sink += qsStepMCMC(bc->tree, bc->distmatrix, 20.0) > 0.5;
+}
+
+static void benchSolveMCMC(struct BenchCase *bc) {
+  struct QSTree *result;
+  bc->sink += qsSolveMCMC(&result, bc->leaf_count, bc->distmatrix) > 0.5;
+  qsFreeTree(result);
+}
+
+static const struct Benchmark benchmarks[] = {
+  { "write_path_matrix", 2, benchWritePathMatrix },
+  { "score_tree", 4, benchScoreTree },
+  { "iterate_mutations", 3, benchIterateMutations },
+  { "apply_random_mutation", 1, benchApplyRandomMutation },
+  { "step_mcmc", 5, benchStepMCMC },
+  { "solve_mcmc", 8, benchSolveMCMC },
+};
+
+static double secondsNow(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+static void runCase(const struct Benchmark *bench, uint32_t leaf_count, uint64_t seed,
+                    double min_time, struct BenchResult *result) {
+  struct BenchCase bc;
+  uint64_t batch = 1, ops = 0;
+  srand((unsigned) seed);
+  bc.leaf_count = leaf_count;
+  bc.distmatrix = newSyntheticMatrix(leaf_count, seed ^ leaf_count);
+  bc.tree = qsNewRandomTree(leaf_count);
+  bc.fullpathmatrix = qsNewFullPathMatrix(leaf_count);
+  bc.pathmatrix = qsNewPathMatrix(leaf_count);
+  bc.sink = 0;
+  qstWritePathMatrix(bc.fullpathmatrix, bc.tree);
+  qstWriteTruncatedPathMatrix(bc.pathmatrix, bc.fullpathmatrix);
+  uint64_t allocs = __atomic_load_n(&alloc_count, __ATOMIC_RELAXED);
+  uint64_t bytes = __atomic_load_n(&alloc_bytes, __ATOMIC_RELAXED);
+  double start = secondsNow(), elapsed;
+  for (;;) {
+    uint64_t i;
+    for (i = 0; i < batch; ++i) {
+      bench->op(&bc);
+    }
+    ops += batch;
+    elapsed = secondsNow() - start;
+    if (elapsed >= min_time) {
+      break;
+    }
+    batch *= 2;
+  }
+  result->ops = ops;
+  result->ns_per_op = elapsed * 1e9 / ops;
+  result->allocs_per_op = (double) (__atomic_load_n(&alloc_count, __ATOMIC_RELAXED) - allocs) / ops;
+  result->alloc_bytes_per_op = (double) (__atomic_load_n(&alloc_bytes, __ATOMIC_RELAXED) - bytes) / ops;
+  if (bc.sink == 0x5eed) {
+    fprintf(stderr, "\n");
+  }
+  qsFreePathMatrix(bc.pathmatrix);
+  qsFreeFullPathMatrix(bc.fullpathmatrix);
+  qsFreeTree(bc.tree);
+  free(bc.distmatrix);
+}
+
+/* Runs one case in a child and collects its result and peak RSS. */
+static void forkCase(const struct Benchmark *bench, uint32_t leaf_count, uint64_t seed,
+                     double min_time, struct BenchResult *result) {
+  int fds[2], status;
+  struct rusage usage;
+  if (pipe(fds) != 0) {
+    fprintf(stderr, "Error, cannot create a pipe.\n");
+    exit(1);
+  }
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid < 0) {
+    fprintf(stderr, "Error, cannot fork.\n");
+    exit(1);
+  }
+  if (pid == 0) {
+    close(fds[0]);
+    runCase(bench, leaf_count, seed, min_time, result);
+    if (write(fds[1], result, sizeof(*result)) != sizeof(*result)) {
+      _exit(1);
+    }
+    _exit(0);
+  }
+  close(fds[1]);
+  ssize_t got = read(fds[0], result, sizeof(*result));
+  close(fds[0]);
+  if (wait4(pid, &status, 0, &usage) != pid || got != sizeof(*result) ||
+      !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "Error, benchmark %s at %u leaves failed.\n", bench->name, leaf_count);
+    exit(1);
+  }
+  result->peak_rss_kb = usage.ru_maxrss;
+}
+
+static void usage(void) {
+  fprintf(stderr, "Usage: qsbench [-s seed] [-m max_leaves] [-b budget] [-t min_time] "
+                  "[-f name]\n");
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  static struct option long_options[] = {
+    { "seed", required_argument, NULL, 's' },
+    { "max-leaves", required_argument, NULL, 'm' },
+    { "budget", required_argument, NULL, 'b' },
+    { "min-time", required_argument, NULL, 't' },
+    { "filter", required_argument, NULL, 'f' },
+    { NULL, 0, NULL, 0 }
+  };
+  uint64_t seed = 1;
+  uint32_t max_leaves = 4096, leaf_count;
+  double budget = 2.0, min_time = 0.25;
+  const char *filter = NULL;
+  int c, first = 1;
+  size_t b;
+  while ((c = getopt_long(argc, argv, "s:m:b:t:f:", long_options, NULL)) != -1) {
+    switch (c) {
+      case 's': seed = strtoull(optarg, NULL, 0); break;
+      case 'm': max_leaves = atoi(optarg); break;
+      case 'b': budget = atof(optarg); break;
+      case 't': min_time = atof(optarg); break;
+      case 'f': filter = optarg; break;
+      default: usage();
+    }
+  }
+  if (optind != argc || max_leaves < 8 || max_leaves > 16000) {
+    usage();
+  }
+  printf("{\n  \"benchmark\": \"qsearch\",\n  \"version\": \"%s\",\n", PACKAGE_VERSION);
+  printf("  \"seed\": %llu,\n  \"score_kernel\": \"%s\",\n  \"cpus\": %d,\n",
+         (unsigned long long) seed, qsScoreKernelName(), qsOnlineCPUCount());
+  printf("  \"min_time\": %g,\n  \"counts_allocations\": %s,\n  \"results\": [",
+         min_time, QST_COUNTS_ALLOCATIONS ? "true" : "false");
+  for (b = 0; b < sizeof(benchmarks) / sizeof(benchmarks[0]); ++b) {
+    const struct Benchmark *bench = &benchmarks[b];
+    if (filter != NULL && strstr(bench->name, filter) == NULL) {
+      continue;
+    }
+    for (leaf_count = 8; leaf_count <= max_leaves; leaf_count *= 2) {
+      struct BenchResult result;
+      forkCase(bench, leaf_count, seed, min_time, &result);
+      fprintf(stderr, "%-22s %5u leaves %14.0f ns/op\n", bench->name, leaf_count,
+              result.ns_per_op);
+      printf("%s\n    { \"name\": \"%s\", \"leaves\": %u, \"ops\": %llu, \"ns_per_op\": %.1f, "
+             "\"allocs_per_op\": %.2f, \"alloc_bytes_per_op\": %.1f, \"peak_rss_kb\": %ld }",
+             first ? "" : ",", bench->name, leaf_count, (unsigned long long) result.ops,
+             result.ns_per_op, result.allocs_per_op, result.alloc_bytes_per_op,
+             result.peak_rss_kb);
+      first = 0;
+      if (result.ns_per_op * 1e-9 * pow(2.0, bench->growth) > budget) {
+        break;
+      }
+    }
+  }
+  printf("\n  ]\n}\n");
+  return 0;
+}
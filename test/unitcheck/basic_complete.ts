@@ -274,3 +274,1185 @@ int mutationHandler(const struct QSTree *tree, const struct QSTree *nexttree, in
     free(distmatrix);
   }
 
+
+#test qsearch_scoremutationdelta_test
+struct DeltaCheck {
+  const uint16_t *fullpathmatrix;
+  const double *distmatrix;
+  struct QSTScoreTotals totals;
+};
+int deltaHandler(const struct QSTree *tree, const struct QSTree *nexttree, int sequence_number,
+                       uint64_t mutation_code, void *obj) {
+  struct DeltaCheck *dc = (struct DeltaCheck *) obj;
+  QST_DECLARE_PATH_LENGTH(uint16_t, nextpath, MAX_LEAVES_TEST);
+  QST_DECLARE_TRUNCATED_PATH_LENGTH(uint16_t, nextsmallpath, MAX_LEAVES_TEST);
+  qstWritePathMatrix(nextpath, nexttree);
+  qstWriteTruncatedPathMatrix(nextsmallpath, nextpath);
+  double full = qsScoreTree(nexttree, nextsmallpath, dc->distmatrix);
+  double delta = qsScoreMutationDelta(tree, dc->fullpathmatrix, dc->distmatrix, mutation_code);
+  ck_assert(fabs(qsScoreFromTotals(&dc->totals, delta) - full) < 1e-9);
+  return 0;
+}
+  int leaf_count;
+  QST_DECLARE_PATH_LENGTH(uint16_t, pathlen, MAX_LEAVES_TEST);
+  QST_DECLARE_TRUNCATED_PATH_LENGTH(uint16_t, smallpathlen, MAX_LEAVES_TEST);
+  for (leaf_count = 4; leaf_count < MAX_LEAVES_TEST; ++leaf_count) {
+    struct QSTree *tree = qsNewRandomTree(leaf_count);
+    double *distmatrix = calloc(leaf_count * leaf_count , sizeof(double));
+    int i, j;
+    for (i = 0; i < leaf_count; ++i) {
+      for (j = 0; j < leaf_count; ++j) {
+        double min = (i < j ? i : j);
+        double max = (i > j ? i : j);
+        double sum = (i + j) * 0.17 + min * min * 0.3 + max * max * max * 0.01;
+        distmatrix[i*leaf_count + j] = fabs(sin(sum));
+      }
+      distmatrix[i*leaf_count + i] = 0;
+    }
+    struct DeltaCheck dc;
+    qstWritePathMatrix(pathlen, tree);
+    qstWriteTruncatedPathMatrix(smallpathlen, pathlen);
+    qsScoreTreeTotals(tree, smallpathlen, distmatrix, &dc.totals);
+    dc.fullpathmatrix = pathlen;
+    dc.distmatrix = distmatrix;
+    qsIterateMutations(tree, pathlen, &dc, deltaHandler);
+    qsFreeTree(tree);
+    free(distmatrix);
+  }
+
+#test qsearch_scoremodel_test
+struct RefScore {
+  const double *distmatrix;
+  const uint16_t *pathmatrix;
+  double totmin, totmax, totcur;
+};
+void refScoreFunc(uint16_t *tree, struct RefScore *rs, int a, int b, int c, int d) {
+  int n = tree[-1];
+  int topos[3][4] = { { a, b, c, d }, { a, c, b, d }, { a, d, b, c } };
+  double s[3], mn, mx;
+  int i;
+  for (i = 0; i < 3; ++i) {
+    s[i] = rs->distmatrix[topos[i][0]*n+topos[i][1]] + rs->distmatrix[topos[i][2]*n+topos[i][3]];
+  }
+  mn = fmin(s[0], fmin(s[1], s[2]));
+  mx = fmax(s[0], fmax(s[1], s[2]));
+  for (i = 0; i < 3; ++i) {
+    int *q = topos[i];
+    if (rs->pathmatrix[q[0]*n+q[1]] + rs->pathmatrix[q[2]*n+q[3]] <
+        rs->pathmatrix[q[0]*n+q[2]] + rs->pathmatrix[q[1]*n+q[3]]) {
+      rs->totcur += s[i]; rs->totmin += mn; rs->totmax += mx;
+    }
+  }
+}
+  int leaf_count;
+  QST_DECLARE_PATH_LENGTH(uint16_t, pathlen, 16);
+  QST_DECLARE_TRUNCATED_PATH_LENGTH(uint16_t, smallpathlen, 16);
+  for (leaf_count = 4; leaf_count < 16; ++leaf_count) {
+    struct QSTree *tree = qsNewRandomTree(leaf_count);
+    double *distmatrix = calloc(leaf_count * leaf_count , sizeof(double));
+    int i, j;
+    for (i = 0; i < leaf_count; ++i) {
+      for (j = 0; j < leaf_count; ++j) {
+        distmatrix[i*leaf_count + j] = fabs(sin(i * 0.37 + j * 0.11 + i * j * 0.05));
+      }
+      distmatrix[i*leaf_count + i] = 0;
+    }
+    qstWritePathMatrix(pathlen, tree);
+    qstWriteTruncatedPathMatrix(smallpathlen, pathlen);
+    struct RefScore rs = { distmatrix, smallpathlen, 0.0, 0.0, 0.0 };
+    qstIterateQuartetsForTree((uint16_t *) tree, refScoreFunc, &rs);
+    double ref = 1.0 - (rs.totcur - rs.totmin) / (rs.totmax - rs.totmin);
+    struct QSTScoreModel *model = qsNewScoreModel(leaf_count, distmatrix);
+    ck_assert(qsScoreModelLeafCount(model) == leaf_count);
+    ck_assert(fabs(qsScoreTree(tree, smallpathlen, distmatrix) - ref) < 1e-9);
+    ck_assert(fabs(qsScoreTreeWithModel(tree, smallpathlen, model) - ref) < 1e-9);
+    qsFreeScoreModel(model);
+    qsFreeTree(tree);
+    free(distmatrix);
+  }
+
+#test qsearch_treeindex_test
+struct CodeList {
+  uint64_t codes[4096];
+  int count;
+};
+int codeCollector(const struct QSTree *tree, const struct QSTree *nexttree, int sequence_number,
+                       uint64_t mutation_code, void *obj) {
+  struct CodeList *cl = (struct CodeList *) obj;
+  cl->codes[cl->count++] = mutation_code;
+  return 0;
+}
+  int leaf_count;
+  QST_DECLARE_PATH_LENGTH(uint16_t, pathlen, MAX_LEAVES_TEST);
+  QST_DECLARE_TRUNCATED_PATH_LENGTH(uint16_t, smallpathlen, MAX_LEAVES_TEST);
+  uint16_t path[2*MAX_LEAVES_TEST], ipath[2*MAX_LEAVES_TEST];
+  static struct CodeList full_codes, index_codes;
+  for (leaf_count = 4; leaf_count < MAX_LEAVES_TEST; ++leaf_count) {
+    struct QSTree *tree = qsNewRandomTree(leaf_count);
+    struct QSTTreeIndex *index = qsNewTreeIndex(tree);
+    int node_count = qsNodeCount(tree);
+    int i, j, k;
+    qstWritePathMatrix(pathlen, tree);
+    qsTreeIndexWritePathMatrix(index, smallpathlen);
+    for (i = 0; i < node_count; ++i) {
+      for (j = 0; j < node_count; ++j) {
+        ck_assert(qsTreeIndexDistance(index, i, j) == pathlen[i*node_count + j]);
+        if (i < leaf_count && j < leaf_count) {
+          ck_assert(smallpathlen[i*leaf_count + j] == pathlen[i*node_count + j]);
+        }
+        int len = qsPathFromTo(tree, pathlen, i, j, path);
+        ck_assert(qsPathFromToIndexed(tree, index, i, j, ipath) == len);
+        for (k = 0; k < len; ++k) {
+          ck_assert(path[k] == ipath[k]);
+        }
+        if (i != j) {
+          ck_assert(qsTreeIndexNextHop(index, i, j) == path[1]);
+        }
+      }
+    }
+    full_codes.count = 0;
+    index_codes.count = 0;
+    qsIterateMutations(tree, pathlen, &full_codes, codeCollector);
+    qsIterateMutationsIndexed(tree, index, &index_codes, codeCollector);
+    ck_assert(full_codes.count == index_codes.count);
+    for (i = 0; i < full_codes.count; ++i) {
+      ck_assert(full_codes.codes[i] == index_codes.codes[i]);
+    }
+    struct QSTree *other = qsNewCloneOf(tree);
+    qsApplyMutation(tree, pathlen, full_codes.codes[full_codes.count / 2]);
+    qsApplyMutationIndexed(other, index, full_codes.codes[full_codes.count / 2]);
+    ck_assert(qsTreeCompare(tree, other) == 0);
+    qsUpdateTreeIndex(index, tree);
+    qstWritePathMatrix(pathlen, tree);
+    for (i = 0; i < node_count; ++i) {
+      for (j = 0; j < node_count; ++j) {
+        ck_assert(qsTreeIndexDistance(index, i, j) == pathlen[i*node_count + j]);
+      }
+    }
+    qsFreeTree(other);
+    qsFreeTreeIndex(index);
+    qsFreeTree(tree);
+  }
+
+#test qsearch_parallelscore_test
+  int leaf_count, i, j, t;
+  int thread_counts[] = { 1, 2, 3, 8 };
+  for (leaf_count = 4; leaf_count < 36; leaf_count += 7) {
+    struct QSTree *tree = qsNewTree(leaf_count);
+    uint16_t *fullpathmatrix = qsNewFullPathMatrix(leaf_count);
+    uint16_t *pathmatrix = qsNewPathMatrix(leaf_count);
+    double *distmatrix = calloc(leaf_count * leaf_count , sizeof(double));
+    for (i = 0; i < 20; ++i) {
+      qsApplyRandomMutation(tree);
+    }
+    for (i = 0; i < leaf_count; ++i) {
+      for (j = 0; j < leaf_count; ++j) {
+        distmatrix[i*leaf_count + j] = fabs(sin(i * 0.37 + j * 0.11 + i * j * 0.05));
+      }
+      distmatrix[i*leaf_count + i] = 0;
+    }
+    qstWritePathMatrix(fullpathmatrix, tree);
+    qstWriteTruncatedPathMatrix(pathmatrix, fullpathmatrix);
+    struct QSTScoreModel *model = qsNewScoreModel(leaf_count, distmatrix);
+    double serial = qsScoreTree(tree, pathmatrix, distmatrix);
+    double modelled = qsScoreTreeWithModel(tree, pathmatrix, model);
+    for (t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]); ++t) {
+      struct QSTThreadPool *pool = qsNewThreadPool(thread_counts[t]);
+      struct QSTScoreTotals totals;
+      ck_assert(qsThreadPoolSize(pool) == thread_counts[t]);
+      ck_assert(qsScoreTreeParallel(tree, pathmatrix, distmatrix, pool) == serial);
+      ck_assert(qsScoreTreeTotalsWithModelParallel(tree, pathmatrix, model, pool, &totals) == modelled);
+      qsFreeThreadPool(pool);
+    }
+    qsFreeScoreModel(model);
+    free(distmatrix);
+    qsFreePathMatrix(pathmatrix);
+    qsFreeFullPathMatrix(fullpathmatrix);
+    qsFreeTree(tree);
+  }
+
+#test qsearch_parallelmcmc_test
+  int leaf_count, i, j;
+  struct QSTThreadPool *pool = qsNewThreadPool(3);
+  for (leaf_count = 4; leaf_count < MAX_LEAVES_TEST; ++leaf_count) {
+    struct QSTree *tree = qsNewTree(leaf_count);
+    struct QSTree *other = qsNewTree(leaf_count);
+    double *distmatrix = calloc(leaf_count * leaf_count , sizeof(double));
+    for (i = 0; i < leaf_count; ++i) {
+      for (j = 0; j < leaf_count; ++j) {
+        distmatrix[i*leaf_count + j] = fabs(sin(i * 0.37 + j * 0.11 + i * j * 0.05));
+      }
+      distmatrix[i*leaf_count + i] = 0;
+    }
+    struct QSTScoreModel *model = qsNewScoreModel(leaf_count, distmatrix);
+    srand(leaf_count);
+    for (i = 0; i < 10; ++i) {
+      qsStepMCMCWithModel(tree, model, 4.0);
+    }
+    srand(leaf_count);
+    for (i = 0; i < 10; ++i) {
+      double score = qsStepMCMCParallel(other, model, 4.0, pool);
+      ck_assert(score >= 0);
+      ck_assert(score <= 1);
+    }
+    ck_assert(qsVerifyTree(other) == 0);
+    ck_assert(qsTreeCompare(tree, other) == 0);
+    qsFreeScoreModel(model);
+    free(distmatrix);
+    qsFreeTree(other);
+    qsFreeTree(tree);
+  }
+  qsFreeThreadPool(pool);
+
+#test qsearch_threadedsolver_test
+  int leaf_count;
+  QST_DECLARE_PATH_LENGTH(uint16_t, pathlen, 6);
+  QST_DECLARE_TRUNCATED_PATH_LENGTH(uint16_t, smallpathlen, 6);
+  for (leaf_count = 4; leaf_count < 6; ++leaf_count) {
+    struct QSTree *tree;
+    double *distmatrix = calloc(leaf_count * leaf_count , sizeof(double));
+    int i, j;
+    for (i = 0; i < leaf_count; ++i) {
+      for (j = 0; j < leaf_count; ++j) {
+        double min = (i < j ? i : j);
+        double max = (i > j ? i : j);
+        double sum = (i + j) * 0.17 + min * min * 0.3 + max * max * max * 0.01;
+        distmatrix[i*leaf_count + j] = fabs(sin(sum));
+      }
+      distmatrix[i*leaf_count + i] = 0;
+    }
+    const double score = qsSolveMCMCThreaded(&tree, leaf_count, distmatrix);
+    ck_assert(qsLeafCount(tree) == leaf_count);
+    ck_assert(qsVerifyTree(tree) == 0);
+    qstWritePathMatrix(pathlen, tree);
+    qstWriteTruncatedPathMatrix(smallpathlen, pathlen);
+    ck_assert(score == 1);
+    ck_assert(fabs(score - qsScoreTree(tree, smallpathlen, distmatrix)) < 1e-12);
+    qsFreeTree(tree);
+    free(distmatrix);
+  }
+
+#test qsearch_workspace_test
+struct CodeList {
+  uint64_t codes[4096];
+  int count;
+};
+int codeRecorder(const struct QSTree *tree, const struct QSTree *nexttree, int sequence_number,
+                 uint64_t mutation_code, void *obj) {
+  struct CodeList *cl = (struct CodeList *) obj;
+  ck_assert(cl->count < 4096);
+  cl->codes[cl->count++] = mutation_code;
+  return 0;
+}
+  int leaf_count, i, j;
+  QST_DECLARE_PATH_LENGTH(uint16_t, pathlen, MAX_LEAVES_TEST);
+  static struct CodeList plain, reused;
+  for (leaf_count = 4; leaf_count < MAX_LEAVES_TEST; ++leaf_count) {
+    struct QSTree *tree = qsNewRandomTree(leaf_count);
+    struct QSTree *other = qsNewCloneOf(tree);
+    struct QSTSearchWorkspace *workspace = qsNewSearchWorkspace(leaf_count, 2);
+    double *distmatrix = calloc(leaf_count * leaf_count , sizeof(double));
+    for (i = 0; i < leaf_count; ++i) {
+      for (j = 0; j < leaf_count; ++j) {
+        distmatrix[i*leaf_count + j] = fabs(sin(i * 0.37 + j * 0.11 + i * j * 0.05));
+      }
+      distmatrix[i*leaf_count + i] = 0;
+    }
+    qstWritePathMatrix(pathlen, tree);
+    plain.count = 0;
+    qsIterateMutations(tree, pathlen, &plain, codeRecorder);
+    for (i = 0; i < 2; ++i) {
+      reused.count = 0;
+      qsIterateMutationsWorkspace(tree, pathlen, workspace, &reused, codeRecorder);
+      ck_assert(reused.count == plain.count);
+      ck_assert(memcmp(reused.codes, plain.codes, plain.count * sizeof(uint64_t)) == 0);
+    }
+    struct QSTScoreModel *model = qsNewScoreModel(leaf_count, distmatrix);
+    struct QSTThreadPool *pool = qsNewThreadPool(2);
+    srand(leaf_count);
+    for (i = 0; i < 10; ++i) {
+      qsStepMCMCWithModel(tree, model, 4.0);
+    }
+    srand(leaf_count);
+    for (i = 0; i < 10; ++i) {
+      qsStepMCMCWorkspace(other, model, 4.0, i % 2 ? pool : NULL, workspace);
+    }
+    ck_assert(qsTreeCompare(tree, other) == 0);
+    qsFreeThreadPool(pool);
+    qsFreeScoreModel(model);
+    qsFreeSearchWorkspace(workspace);
+    free(distmatrix);
+    qsFreeTree(other);
+    qsFreeTree(tree);
+  }
+
+#test qsearch_uint64table_test
+  struct QSTUInt64Table *hashtab = qsNewUInt64Table();
+  uint64_t i;
+  int round;
+  for (round = 0; round < 3; ++round) {
+    ck_assert(!qsIsUInt64InTable(hashtab, 0));
+    qsAddUInt64ToTable(hashtab, 0);
+    ck_assert(qsIsUInt64InTable(hashtab, 0));
+    for (i = 1; i < 5000; ++i) {
+      qsAddUInt64ToTable(hashtab, i * 0x10000ULL);
+      qsAddUInt64ToTable(hashtab, i * 0x10000ULL);
+    }
+    for (i = 1; i < 5000; ++i) {
+      ck_assert(qsIsUInt64InTable(hashtab, i * 0x10000ULL));
+      ck_assert(!qsIsUInt64InTable(hashtab, i * 0x10000ULL + 1));
+    }
+    qsResetUInt64Table(hashtab);
+    for (i = 0; i < 5000; ++i) {
+      ck_assert(!qsIsUInt64InTable(hashtab, i * 0x10000ULL));
+    }
+  }
+  qsFreeUInt64Table(hashtab);
+
+#test qsearch_samplemutation_test
+struct NeighborSet {
+  uint64_t hashes[4096];
+  int hits[4096];
+  int count;
+};
+int neighborRecorder(const struct QSTree *tree, const struct QSTree *nexttree, int sequence_number,
+                     uint64_t mutation_code, void *obj) {
+  struct NeighborSet *ns = (struct NeighborSet *) obj;
+  ck_assert(ns->count < 4096);
+  ns->hits[ns->count] = 0;
+  ns->hashes[ns->count++] = qsTreeTopologyHash(nexttree);
+  return 0;
+}
+  int leaf_count, i, k;
+  QST_DECLARE_PATH_LENGTH(uint16_t, pathlen, 9);
+  static struct NeighborSet ns;
+  for (leaf_count = 4; leaf_count < 9; ++leaf_count) {
+    struct QSTree *tree = qsNewRandomTree(leaf_count);
+    struct QSTree *next = qsNewTree(leaf_count);
+    qstWritePathMatrix(pathlen, tree);
+    ns.count = 0;
+    qsIterateMutations(tree, pathlen, &ns, neighborRecorder);
+    for (i = 0; i < 60 * ns.count; ++i) {
+      uint64_t mutation_code = qsSampleMutation(tree);
+      qsCopyTreeOver(next, tree);
+      qsApplyMutation(next, pathlen, mutation_code);
+      ck_assert(qsVerifyTree(next) == 0);
+      uint64_t hash = qsTreeTopologyHash(next);
+      for (k = 0; k < ns.count && ns.hashes[k] != hash; ++k) { }
+      ck_assert(k < ns.count);
+      ns.hits[k] += 1;
+    }
+    for (k = 0; k < ns.count; ++k) {
+      ck_assert(ns.hits[k] > 0);
+    }
+    qsFreeTree(next);
+    qsFreeTree(tree);
+  }
+
+#test qsearch_topologyhash_test
+  int leaf_count, i, k;
+  QST_DECLARE_PATH_LENGTH(uint16_t, pathlen, MAX_LEAVES_TEST);
+  for (leaf_count = 4; leaf_count < MAX_LEAVES_TEST; ++leaf_count) {
+    struct QSTree *tree = qsNewRandomTree(leaf_count);
+    struct QSTree *next = qsNewTree(leaf_count);
+    struct QSTTopologyHasher *hasher = qsNewTopologyHasher(leaf_count);
+    uint16_t *utree = (uint16_t *) tree, *unext = (uint16_t *) next;
+    int kern_count = leaf_count - 2;
+    uint16_t perm[2 * MAX_LEAVES_TEST];
+    /* renumbering the kernels leaves the topology alone */
+    for (i = 0; i < leaf_count; ++i) { perm[i] = i; }
+    for (i = 0; i < kern_count; ++i) { perm[leaf_count + i] = leaf_count + kern_count - 1 - i; }
+    for (i = 0; i < leaf_count; ++i) {
+      unext[i] = perm[utree[i]];
+    }
+    for (i = leaf_count; i < leaf_count + kern_count; ++i) {
+      for (k = 0; k < 3; ++k) {
+        unext[QST_NLIST_BASE(unext, perm[i]) + k] = perm[utree[QST_NLIST_BASE(utree, i) + k]];
+      }
+    }
+    qsNormalizeTree(next);
+    ck_assert(qsVerifyTree(next) == 0);
+    uint64_t hash = qsLoadTopologyHasher(hasher, tree);
+    ck_assert(hash == qsTreeTopologyHash(next));
+    /* neighbor hashes agree with hashing the mutated tree */
+    qstWritePathMatrix(pathlen, tree);
+    for (i = 0; i < 200; ++i) {
+      uint64_t mutation_code = qsSampleMutation(tree);
+      qsCopyTreeOver(next, tree);
+      qsApplyMutation(next, pathlen, mutation_code);
+      ck_assert(qsTopologyHashAfterMutation(hasher, mutation_code) == qsTreeTopologyHash(next));
+      ck_assert(qsTreeTopologyHash(next) != hash);
+    }
+    qsFreeTopologyHasher(hasher);
+    qsFreeTree(next);
+    qsFreeTree(tree);
+  }
+
+#test qsearch_context_test
+  int leaf_count, i, j;
+  struct QSTContext *ctx = qsNewContext(42), *other = qsNewContext(42);
+  struct QSTThreadPool *pool = qsNewThreadPool(2);
+  for (i = 0; i < 100; ++i) {
+    ck_assert(qsContextRandom(ctx) == qsContextRandom(other));
+  }
+  for (leaf_count = 4; leaf_count < MAX_LEAVES_TEST; ++leaf_count) {
+    struct QSTree *tree = qsNewRandomTreeCtx(leaf_count, ctx);
+    struct QSTree *replay = qsNewRandomTreeCtx(leaf_count, other);
+    double *distmatrix = calloc(leaf_count * leaf_count , sizeof(double));
+    ck_assert(qsTreeCompare(tree, replay) == 0);
+    for (i = 0; i < leaf_count; ++i) {
+      for (j = 0; j < leaf_count; ++j) {
+        distmatrix[i*leaf_count + j] = fabs(sin(i * 0.37 + j * 0.11 + i * j * 0.05));
+      }
+      distmatrix[i*leaf_count + i] = 0;
+    }
+    struct QSTScoreModel *model = qsNewScoreModel(leaf_count, distmatrix);
+    /* the pool changes who does the work, not what the stream picks */
+    qsSetContextThreadPool(other, leaf_count % 2 ? pool : NULL);
+    for (i = 0; i < 10; ++i) {
+      double score = qsStepMCMCCtx(tree, model, 4.0, ctx);
+      ck_assert(qsStepMCMCCtx(replay, model, 4.0, other) == score);
+      ck_assert(qsTreeCompare(tree, replay) == 0);
+      qsApplyRandomMutationCtx(tree, ctx);
+      qsApplyRandomMutationCtx(replay, other);
+      ck_assert(qsSampleMutationCtx(tree, ctx) == qsSampleMutationCtx(replay, other));
+    }
+    qsFreeScoreModel(model);
+    free(distmatrix);
+    qsFreeTree(replay);
+    qsFreeTree(tree);
+  }
+  for (leaf_count = 4; leaf_count < 8; ++leaf_count) {
+    struct QSTree *tree, *replay;
+    double *distmatrix = calloc(leaf_count * leaf_count , sizeof(double));
+    for (i = 0; i < leaf_count; ++i) {
+      for (j = 0; j < leaf_count; ++j) {
+        double min = (i < j ? i : j);
+        double max = (i > j ? i : j);
+        double sum = (i + j) * 0.17 + min * min * 0.3 + max * max * max * 0.01;
+        distmatrix[i*leaf_count + j] = fabs(sin(sum));
+      }
+      distmatrix[i*leaf_count + i] = 0;
+    }
+    qsSeedContext(ctx, leaf_count);
+    qsSeedContext(other, leaf_count);
+    qsSetContextChainCount(ctx, 2);
+    qsSetContextChainCount(other, 2);
+    double score = qsSolveMCMCCtx(&tree, leaf_count, distmatrix, ctx);
+    ck_assert(qsSolveMCMCCtx(&replay, leaf_count, distmatrix, other) == score);
+    ck_assert(qsTreeCompare(tree, replay) == 0);
+    qsFreeTree(replay);
+    qsFreeTree(tree);
+    free(distmatrix);
+  }
+  qsFreeThreadPool(pool);
+  qsFreeContext(other);
+  qsFreeContext(ctx);
+
+#test qsearch_metropolis_test
+  int leaf_count, i, j;
+  QST_DECLARE_PATH_LENGTH(uint16_t, pathlen, MAX_LEAVES_TEST);
+  QST_DECLARE_TRUNCATED_PATH_LENGTH(uint16_t, smallpathlen, MAX_LEAVES_TEST);
+  struct QSTContext *ctx = qsNewContext(7);
+  qsSetContextStepMode(ctx, QST_STEP_METROPOLIS);
+  for (leaf_count = 4; leaf_count < MAX_LEAVES_TEST; ++leaf_count) {
+    struct QSTree *tree = qsNewRandomTreeCtx(leaf_count, ctx);
+    double *distmatrix = calloc(leaf_count * leaf_count , sizeof(double));
+    for (i = 0; i < leaf_count; ++i) {
+      for (j = 0; j < leaf_count; ++j) {
+        distmatrix[i*leaf_count + j] = fabs(sin(i * 0.37 + j * 0.11 + i * j * 0.05));
+      }
+      distmatrix[i*leaf_count + i] = 0;
+    }
+    struct QSTScoreModel *model = qsNewScoreModel(leaf_count, distmatrix);
+    for (i = 0; i < 200; ++i) {
+      /* tracked scores follow the tree; a stray mutation forces a rescore */
+      double score = qsStepMCMCCtx(tree, model, i % 3 ? 50.0 : 0.0, ctx);
+      qstWritePathMatrix(pathlen, tree);
+      qstWriteTruncatedPathMatrix(smallpathlen, pathlen);
+      ck_assert(fabs(score - qsScoreTreeWithModel(tree, smallpathlen, model)) < 1e-9);
+      if (i % 50 == 49) {
+        qsApplyRandomMutationCtx(tree, ctx);
+      }
+    }
+    /* a new model over new distances, likely at the old one's address */
+    qsStepMCMCCtx(tree, model, 50.0, ctx);
+    qsFreeScoreModel(model);
+    for (i = 0; i < leaf_count; ++i) {
+      for (j = 0; j < leaf_count; ++j) {
+        distmatrix[i*leaf_count + j] = i == j ? 0 : fabs(cos(i * 0.23 + j * 0.19));
+      }
+    }
+    model = qsNewScoreModel(leaf_count, distmatrix);
+    for (i = 0; i < 3; ++i) {
+      double score = qsStepMCMCCtx(tree, model, 50.0, ctx);
+      qstWritePathMatrix(pathlen, tree);
+      qstWriteTruncatedPathMatrix(smallpathlen, pathlen);
+      ck_assert(fabs(score - qsScoreTreeWithModel(tree, smallpathlen, model)) < 1e-9);
+    }
+    qsFreeScoreModel(model);
+    free(distmatrix);
+    qsFreeTree(tree);
+  }
+  for (leaf_count = 4; leaf_count < 8; ++leaf_count) {
+    struct QSTree *tree;
+    double *distmatrix = calloc(leaf_count * leaf_count , sizeof(double));
+    for (i = 0; i < leaf_count; ++i) {
+      for (j = 0; j < leaf_count; ++j) {
+        distmatrix[i*leaf_count + j] = fabs(i - j);
+      }
+    }
+    qsSeedContext(ctx, leaf_count);
+    qsSetContextChainCount(ctx, 2);
+    double score = qsSolveMCMCCtx(&tree, leaf_count, distmatrix, ctx);
+    struct QSTScoreModel *model = qsNewScoreModel(leaf_count, distmatrix);
+    qstWritePathMatrix(pathlen, tree);
+    qstWriteTruncatedPathMatrix(smallpathlen, pathlen);
+    ck_assert(fabs(score - qsScoreTreeWithModel(tree, smallpathlen, model)) < 1e-9);
+    qsFreeScoreModel(model);
+    qsFreeTree(tree);
+    if (leaf_count < 6) {
+      score = qsSolveMCMCWithMode(&tree, leaf_count, distmatrix, QST_STEP_METROPOLIS);
+      ck_assert(score == 1.0);
+      qsFreeTree(tree);
+    }
+    free(distmatrix);
+  }
+  qsFreeContext(ctx);
+
+#test qsearch_tempering_test
+  int leaf_count, i, j;
+  QST_DECLARE_PATH_LENGTH(uint16_t, pathlen, MAX_LEAVES_TEST);
+  QST_DECLARE_TRUNCATED_PATH_LENGTH(uint16_t, smallpathlen, MAX_LEAVES_TEST);
+  struct QSTContext *ctx = qsNewContext(11), *other = qsNewContext(11);
+  struct QSTThreadPool *pool = qsNewThreadPool(2);
+  struct QSTTemperingStats stats, replay_stats;
+  double betas[4];
+  qsGeometricLadder(betas, 4, 2.0, 200.0);
+  ck_assert(fabs(betas[0] - 2.0) < 1e-9 && fabs(betas[3] - 200.0) < 1e-9);
+  ck_assert(betas[1] < betas[2]);
+  qsSetContextStepMode(ctx, QST_STEP_METROPOLIS);
+  qsSetContextStepMode(other, QST_STEP_METROPOLIS);
+  qsSetContextThreadPool(other, pool);
+  for (leaf_count = 4; leaf_count < 9; ++leaf_count) {
+    struct QSTree *tree, *replay;
+    double *distmatrix = calloc(leaf_count * leaf_count , sizeof(double));
+    for (i = 0; i < leaf_count; ++i) {
+      for (j = 0; j < leaf_count; ++j) {
+        distmatrix[i*leaf_count + j] = fabs(i - j);
+      }
+    }
+    /* a path metric has a perfectly scoring tree for the ladder to find */
+    double score = qsSolveTemperingCtx(&tree, leaf_count, distmatrix, betas, 4, 20, 1000,
+                                       &stats, ctx);
+    ck_assert(score == 1.0);
+    ck_assert(stats.best_score == score);
+    ck_assert(stats.replica_count == 4);
+    for (i = 0; i < 3; ++i) {
+      ck_assert(stats.swap_accepts[i] <= stats.swap_attempts[i]);
+    }
+    ck_assert(stats.swap_attempts[0] + stats.swap_attempts[1] + stats.swap_attempts[2] ==
+              2 * ((stats.round_count + 1) / 2) + stats.round_count / 2);
+    struct QSTScoreModel *model = qsNewScoreModel(leaf_count, distmatrix);
+    qstWritePathMatrix(pathlen, tree);
+    qstWriteTruncatedPathMatrix(smallpathlen, pathlen);
+    ck_assert(qsScoreTreeWithModel(tree, smallpathlen, model) == 1.0);
+    qsFreeScoreModel(model);
+    /* trades are drawn on the calling thread: a pool changes nothing */
+    qsSeedContext(ctx, leaf_count);
+    qsSeedContext(other, leaf_count);
+    qsFreeTree(tree);
+    score = qsSolveTemperingCtx(&tree, leaf_count, distmatrix, betas, 4, 3, 5, &stats, ctx);
+    ck_assert(qsSolveTemperingCtx(&replay, leaf_count, distmatrix, betas, 4, 3, 5,
+                                  &replay_stats, other) == score);
+    ck_assert(qsTreeCompare(tree, replay) == 0);
+    ck_assert(memcmp(&stats, &replay_stats, sizeof(stats)) == 0);
+    qsFreeTree(replay);
+    qsFreeTree(tree);
+    if (leaf_count < 6) {
+      score = qsSolveTempering(&tree, leaf_count, distmatrix, betas, 3, 2, 1000, NULL);
+      ck_assert(score == 1.0);
+      qsFreeTree(tree);
+    }
+    free(distmatrix);
+  }
+  qsFreeThreadPool(pool);
+  qsFreeContext(other);
+  qsFreeContext(ctx);
+
+#test qsearch_leanworkspace_test
+  int leaf_count, i, j;
+  QST_DECLARE_PATH_LENGTH(uint16_t, pathlen, MAX_LEAVES_TEST);
+  QST_DECLARE_TRUNCATED_PATH_LENGTH(uint16_t, smallpathlen, MAX_LEAVES_TEST);
+  struct QSTContext *ctx = qsNewContext(5), *lean = qsNewContext(5);
+  struct QSTThreadPool *pool = qsNewThreadPool(2);
+  qsSetContextLeanMemory(lean, 1);
+  qsSetContextThreadPool(lean, pool);
+  for (leaf_count = 4; leaf_count < MAX_LEAVES_TEST; ++leaf_count) {
+    struct QSTree *tree = qsNewRandomTreeCtx(leaf_count, ctx);
+    struct QSTree *other = qsNewRandomTreeCtx(leaf_count, lean);
+    double *distmatrix = calloc(leaf_count * leaf_count , sizeof(double));
+    ck_assert(qsTreeCompare(tree, other) == 0);
+    for (i = 0; i < leaf_count; ++i) {
+      for (j = 0; j < leaf_count; ++j) {
+        distmatrix[i*leaf_count + j] = fabs(sin(i * 0.37 + j * 0.11 + i * j * 0.05));
+      }
+      distmatrix[i*leaf_count + i] = 0;
+    }
+    /* the indexed delta agrees with the full path matrix one */
+    struct QSTTreeIndex *index = qsNewTreeIndex(tree);
+    qstWritePathMatrix(pathlen, tree);
+    qstWriteTruncatedPathMatrix(smallpathlen, pathlen);
+    for (i = 0; i < 20; ++i) {
+      uint64_t code = qsSampleMutationCtx(tree, ctx);
+      qsSampleMutationCtx(other, lean);
+      ck_assert(qsScoreMutationDeltaIndexed(tree, index, smallpathlen, distmatrix, code) ==
+                qsScoreMutationDelta(tree, pathlen, distmatrix, code));
+    }
+    qsFreeTreeIndex(index);
+    /* and lean steps, either mode, follow the same path */
+    struct QSTScoreModel *model = qsNewScoreModel(leaf_count, distmatrix);
+    for (i = 0; i < 20; ++i) {
+      int mode = i < 10 ? QST_STEP_HEAT_BATH : QST_STEP_METROPOLIS;
+      qsSetContextStepMode(ctx, mode);
+      qsSetContextStepMode(lean, mode);
+      double score = qsStepMCMCCtx(tree, model, 20.0, ctx);
+      ck_assert(qsStepMCMCCtx(other, model, 20.0, lean) == score);
+      ck_assert(qsTreeCompare(tree, other) == 0);
+    }
+    qsFreeScoreModel(model);
+    free(distmatrix);
+    qsFreeTree(other);
+    qsFreeTree(tree);
+  }
+  struct QSTSearchWorkspace *workspace = qsNewLeanSearchWorkspace(8, 1);
+  ck_assert(qsIsLeanSearchWorkspace(workspace));
+  qsFreeSearchWorkspace(workspace);
+  workspace = qsNewSearchWorkspace(8, 1);
+  ck_assert(!qsIsLeanSearchWorkspace(workspace));
+  qsFreeSearchWorkspace(workspace);
+  qsFreeThreadPool(pool);
+  qsFreeContext(lean);
+  qsFreeContext(ctx);
+
+#test qsearch_distancelayout_test
+  uint32_t leaf_count, i, j;
+  struct QSTThreadPool *pool = qsNewThreadPool(2);
+  for (leaf_count = 4; leaf_count < 40; leaf_count += 5) {
+    struct QSTree *tree = qsNewTree(leaf_count);
+    uint16_t *fullpathmatrix = qsNewFullPathMatrix(leaf_count);
+    uint16_t *pathmatrix = qsNewPathMatrix(leaf_count);
+    double *distmatrix = calloc(leaf_count * leaf_count , sizeof(double));
+    double *rounded = calloc(leaf_count * leaf_count , sizeof(double));
+    for (i = 0; i < 20; ++i) {
+      qsApplyRandomMutation(tree);
+    }
+    for (i = 0; i < leaf_count; ++i) {
+      for (j = 0; j < leaf_count; ++j) {
+        distmatrix[i*leaf_count + j] = fabs(sin(i * 0.37 + j * 0.11 + i * j * 0.05));
+      }
+      distmatrix[i*leaf_count + i] = 0;
+    }
+    for (i = 0; i < leaf_count * leaf_count; ++i) {
+      rounded[i] = (float) distmatrix[i];
+    }
+    qstWritePathMatrix(fullpathmatrix, tree);
+    qstWriteTruncatedPathMatrix(pathmatrix, fullpathmatrix);
+    double dense = qsScoreTree(tree, pathmatrix, distmatrix);
+    double dense_rounded = qsScoreTree(tree, pathmatrix, rounded);
+    ck_assert(qsDistanceLayoutCount(leaf_count, QST_DIST_PACKED) == leaf_count * (leaf_count - 1) / 2);
+    double *packed = malloc(sizeof(double) * qsDistanceLayoutCount(leaf_count, QST_DIST_PACKED));
+    float *floats = malloc(sizeof(float) * qsDistanceLayoutCount(leaf_count, QST_DIST_FLOAT32));
+    float *packed_floats = malloc(sizeof(float) * qsDistanceLayoutCount(leaf_count,
+                                  QST_DIST_FLOAT32 | QST_DIST_PACKED));
+    qsWriteDistanceLayout(packed, QST_DIST_PACKED, distmatrix, leaf_count);
+    qsWriteDistanceLayout(floats, QST_DIST_FLOAT32, distmatrix, leaf_count);
+    qsWriteDistanceLayout(packed_floats, QST_DIST_FLOAT32 | QST_DIST_PACKED, distmatrix, leaf_count);
+    /* packing drops only entries scoring never reads, and floats widen
+     * exactly, so each layout matches dense doubles bit for bit */
+    struct QSTScoreTotals totals;
+    ck_assert(qsScoreTreePacked(tree, pathmatrix, packed) == dense);
+    ck_assert(qsScoreTreeTotalsLayout(tree, pathmatrix, packed, QST_DIST_PACKED, pool, &totals) == dense);
+    ck_assert(qsScoreTreeFloat(tree, pathmatrix, floats) == dense_rounded);
+    ck_assert(qsScoreTreeTotalsLayout(tree, pathmatrix, packed_floats,
+                                      QST_DIST_FLOAT32 | QST_DIST_PACKED, pool, &totals) == dense_rounded);
+    ck_assert(fabs(dense_rounded - dense) < 1e-6);
+    free(packed_floats);
+    free(floats);
+    free(packed);
+    free(rounded);
+    free(distmatrix);
+    qsFreePathMatrix(pathmatrix);
+    qsFreeFullPathMatrix(fullpathmatrix);
+    qsFreeTree(tree);
+  }
+  qsFreeThreadPool(pool);
+
+#test qsearch_checkpoint_test
+  char path[] = "/tmp/qsearch_checkpointXXXXXX";
+  int leaf_count = 11, i, j, mode;
+  double *distmatrix = calloc(leaf_count * leaf_count , sizeof(double));
+  for (i = 0; i < leaf_count; ++i) {
+    for (j = 0; j < leaf_count; ++j) {
+      distmatrix[i*leaf_count + j] = fabs(sin(i * 0.37 + j * 0.11 + i * j * 0.05));
+    }
+    distmatrix[i*leaf_count + i] = 0;
+  }
+  close(mkstemp(path));
+  for (mode = QST_STEP_HEAT_BATH; mode <= QST_STEP_METROPOLIS; ++mode) {
+    struct QSTContext *ctx = qsNewContext(21);
+    struct QSTree *expected, *resumed, *again;
+    qsSetContextStepMode(ctx, mode);
+    double score = qsSolveMCMCCtx(&expected, leaf_count, distmatrix, ctx);
+    /* stop partway, save, scramble the stream and carry on from the file */
+    qsSeedContext(ctx, 21);
+    struct QSTSolverState *state = qsNewSolverStateCtx(leaf_count, distmatrix, ctx);
+    ck_assert(!qsAdvanceSolverState(state, 7));
+    qsSaveSolverState(state, path);
+    qsFreeSolverState(state);
+    qsSeedContext(ctx, 99);
+    qsSetContextStepMode(ctx, QST_STEP_HEAT_BATH);
+    state = qsLoadSolverStateCtx(path, leaf_count, distmatrix, ctx);
+    while (!qsAdvanceSolverState(state, 3)) {
+      qsSaveSolverState(state, path);
+      qsFreeSolverState(state);
+      state = qsLoadSolverStateCtx(path, leaf_count, distmatrix, ctx);
+    }
+    ck_assert(qsSolverStateResult(state, &resumed) == score);
+    ck_assert(qsTreeCompare(resumed, expected) == 0);
+    qsFreeSolverState(state);
+    /* the checkpointed solve matches too, and a rerun returns at once */
+    unlink(path);
+    qsSeedContext(ctx, 21);
+    qsSetContextStepMode(ctx, mode);
+    ck_assert(qsSolveMCMCCheckpointCtx(&again, leaf_count, distmatrix, path, 0.0, ctx) == score);
+    ck_assert(qsTreeCompare(again, expected) == 0);
+    qsFreeTree(again);
+    uint64_t next = qsContextRandom(ctx);
+    qsSeedContext(ctx, 5);
+    ck_assert(qsSolveMCMCCheckpointCtx(&again, leaf_count, distmatrix, path, 0.0, ctx) == score);
+    ck_assert(qsTreeCompare(again, expected) == 0);
+    ck_assert(qsContextRandom(ctx) == next);
+    qsFreeTree(again);
+    unlink(path);
+    qsFreeTree(resumed);
+    qsFreeTree(expected);
+    qsFreeContext(ctx);
+  }
+  free(distmatrix);
+
+#test qsearch_solverstats_test
+  int leaf_count = 10, i, j, mode;
+  double *distmatrix = calloc(leaf_count * leaf_count , sizeof(double));
+  for (i = 0; i < leaf_count; ++i) {
+    for (j = 0; j < leaf_count; ++j) {
+      distmatrix[i*leaf_count + j] = fabs(sin(i * 0.37 + j * 0.11 + i * j * 0.05));
+    }
+    distmatrix[i*leaf_count + i] = 0;
+  }
+  for (mode = QST_STEP_HEAT_BATH; mode <= QST_STEP_METROPOLIS; ++mode) {
+    struct QSTContext *ctx = qsNewContext(8), *plain = qsNewContext(8);
+    struct QSTSolverStats stats;
+    struct QSTree *tree, *other;
+    qsSetContextStepMode(ctx, mode);
+    qsSetContextStepMode(plain, mode);
+    qsResetSolverStats(&stats);
+    qsSetContextStats(ctx, &stats);
+    /* counting changes nothing about the search */
+    double score = qsSolveMCMCCtx(&tree, leaf_count, distmatrix, ctx);
+    ck_assert(qsSolveMCMCCtx(&other, leaf_count, distmatrix, plain) == score);
+    ck_assert(qsTreeCompare(tree, other) == 0);
+    if (stats.enabled) {
+      ck_assert(stats.steps > 0);
+      ck_assert(stats.stays <= stats.steps);
+      ck_assert(stats.candidates >= stats.steps);
+      ck_assert(stats.full_scores > 0);
+      ck_assert(stats.best_score >= score);
+      ck_assert(stats.agreement_checks == stats.steps + 1 || score == 1.0);
+      ck_assert(stats.chain_count == 2);
+      ck_assert(stats.agreeing_chains == 2 || score == 1.0);
+      ck_assert(stats.score_ns > 0);
+      if (mode == QST_STEP_METROPOLIS) {
+        ck_assert(stats.candidates == stats.steps);
+      }
+    } else {
+      ck_assert(stats.steps == 0 && stats.score_ns == 0);
+    }
+    uint64_t steps = stats.steps;
+    qsSetContextStats(ctx, NULL);
+    qsStepMCMCCtx(tree, qsNewScoreModel(leaf_count, distmatrix), 5.0, ctx);
+    ck_assert(stats.steps == steps);
+    qsFreeTree(other);
+    qsFreeTree(tree);
+    qsFreeContext(plain);
+    qsFreeContext(ctx);
+  }
+  free(distmatrix);
+
+#test qsearch_anytime_test
+struct AnytimeProgress {
+  int calls;
+  int cancel_after;
+  double last_score;
+  uint64_t last_steps;
+};
+int anytimeProgress(const struct QSTree *best, double score, uint64_t steps, void *arg) {
+  struct AnytimeProgress *progress = (struct AnytimeProgress *) arg;
+  ck_assert(qsVerifyTree(best) == 0);
+  ck_assert(score >= progress->last_score);
+  ck_assert(steps > progress->last_steps);
+  progress->calls += 1;
+  progress->last_score = score;
+  progress->last_steps = steps;
+  return progress->cancel_after != 0 && progress->calls >= progress->cancel_after;
+}
+  int leaf_count = 10, big_count = 24, i, j, reason;
+  double *distmatrix = calloc(big_count * big_count, sizeof(double));
+  double *bigmatrix = calloc(big_count * big_count, sizeof(double));
+  for (i = 0; i < big_count; ++i) {
+    for (j = 0; j < big_count; ++j) {
+      double d = fabs(sin(i * 0.37 + j * 0.11 + i * j * 0.05));
+      bigmatrix[i*big_count + j] = i == j ? 0 : d;
+      if (i < leaf_count && j < leaf_count) {
+        distmatrix[i*leaf_count + j] = i == j ? 0 : d;
+      }
+    }
+  }
+  struct QSTSolverOptions options;
+  struct QSTree *tree, *other;
+  struct QSTContext *ctx = qsNewContext(21), *plain = qsNewContext(21);
+  qsInitSolverOptions(&options);
+  /* without limits it is qsSolveMCMCCtx */
+  double score = qsSolveMCMCAnytimeCtx(&tree, leaf_count, distmatrix, &options, &reason, ctx);
+  ck_assert(qsSolveMCMCCtx(&other, leaf_count, distmatrix, plain) == score);
+  ck_assert(qsTreeCompare(tree, other) == 0);
+  ck_assert(reason == QST_SOLVE_AGREED || reason == QST_SOLVE_PERFECT);
+  qsFreeTree(tree);
+  qsFreeTree(other);
+
+  struct AnytimeProgress progress;
+  memset(&progress, 0, sizeof(progress));
+  options.max_steps = 6;
+  options.progress = anytimeProgress;
+  options.progress_arg = &progress;
+  options.progress_interval = 2;
+  score = qsSolveMCMCAnytimeCtx(&tree, big_count, bigmatrix, &options, &reason, ctx);
+  ck_assert(reason == QST_SOLVE_STEP_LIMIT);
+  ck_assert(progress.calls >= 3);
+  ck_assert(progress.last_steps == 6);
+  ck_assert(score == progress.last_score);
+  ck_assert(qsVerifyTree(tree) == 0);
+  qsFreeTree(tree);
+
+  memset(&progress, 0, sizeof(progress));
+  progress.cancel_after = 2;
+  options.max_steps = 0;
+  qsSolveMCMCAnytimeCtx(&tree, big_count, bigmatrix, &options, &reason, ctx);
+  ck_assert(reason == QST_SOLVE_CANCELLED);
+  ck_assert(progress.calls == 2);
+  qsFreeTree(tree);
+
+  int cancel = 1;
+  qsInitSolverOptions(&options);
+  options.cancel = &cancel;
+  qsSolveMCMCAnytimeCtx(NULL, big_count, bigmatrix, &options, &reason, ctx);
+  ck_assert(reason == QST_SOLVE_CANCELLED);
+
+  qsInitSolverOptions(&options);
+  options.seconds = 1e-6;
+  qsSolveMCMCAnytimeCtx(NULL, big_count, bigmatrix, &options, &reason, ctx);
+  ck_assert(reason == QST_SOLVE_TIME_LIMIT);
+
+  qsInitSolverOptions(&options);
+  options.max_fail_count = 1;
+  qsSolveMCMCAnytimeCtx(NULL, big_count, bigmatrix, &options, &reason, ctx);
+  ck_assert(reason == QST_SOLVE_STAGNATED || reason == QST_SOLVE_AGREED);
+  qsFreeContext(plain);
+  qsFreeContext(ctx);
+  free(bigmatrix);
+  free(distmatrix);
+
+#test qsearch_scorecache_test
+  int leaf_count = 12, i, j, mode;
+  double *distmatrix = calloc(leaf_count * leaf_count, sizeof(double));
+  for (i = 0; i < leaf_count; ++i) {
+    for (j = 0; j < leaf_count; ++j) {
+      distmatrix[i*leaf_count + j] = i == j ? 0 : fabs(sin(i * 0.29 + j * 0.13 + i * j * 0.07));
+    }
+  }
+  struct QSTScoreCacheStats cache_stats;
+  for (mode = QST_STEP_HEAT_BATH; mode <= QST_STEP_METROPOLIS; ++mode) {
+    struct QSTScoreCache *cache = qsNewScoreCache(1 << 20);
+    struct QSTContext *ctx = qsNewContext(33), *plain = qsNewContext(33);
+    struct QSTree *tree, *other;
+    qsSetContextStepMode(ctx, mode);
+    qsSetContextStepMode(plain, mode);
+    qsSetContextScoreCache(ctx, cache);
+    /* a hit is bit for bit a fresh scoring, so the search is unchanged */
+    double score = qsSolveMCMCCtx(&tree, leaf_count, distmatrix, ctx);
+    ck_assert(qsSolveMCMCCtx(&other, leaf_count, distmatrix, plain) == score);
+    ck_assert(qsTreeCompare(tree, other) == 0);
+    qsGetScoreCacheStats(cache, &cache_stats);
+    ck_assert(cache_stats.misses > 0);
+    ck_assert(cache_stats.insertions == cache_stats.misses);
+    ck_assert(cache_stats.evictions == 0);
+    if (mode == QST_STEP_HEAT_BATH) {
+      /* every step starts by rescoring the tree the last step scored */
+      ck_assert(cache_stats.hits >= cache_stats.misses);
+    }
+    qsFreeTree(tree);
+    qsFreeTree(other);
+    qsFreeContext(plain);
+    qsFreeContext(ctx);
+    qsFreeScoreCache(cache);
+  }
+
+  /* one bucket: a fifth tree evicts, and clearing forgets everything */
+  struct QSTScoreCache *small = qsNewScoreCache(256);
+  struct QSTContext *ctx = qsNewContext(5);
+  struct QSTScoreModel *model = qsNewScoreModel(leaf_count, distmatrix);
+  struct QSTree *trees[5];
+  qsSetContextScoreCache(ctx, small);
+  qsGetScoreCacheStats(small, &cache_stats);
+  ck_assert(cache_stats.capacity == 4);
+  for (i = 0; i < 5; ++i) {
+    trees[i] = qsNewRandomTreeCtx(leaf_count, ctx);
+    qsStepMCMCCtx(trees[i], model, 0.0, ctx);
+  }
+  qsGetScoreCacheStats(small, &cache_stats);
+  ck_assert(cache_stats.evictions > 0);
+  qsClearScoreCache(small);
+  uint64_t hits = cache_stats.hits;
+  struct QSTree *again = qsNewCloneOf(trees[4]);
+  qsStepMCMCCtx(again, model, 0.0, ctx);
+  qsGetScoreCacheStats(small, &cache_stats);
+  ck_assert(cache_stats.hits == hits);
+  qsFreeTree(again);
+  for (i = 0; i < 5; ++i) {
+    qsFreeTree(trees[i]);
+  }
+  qsFreeScoreModel(model);
+  qsFreeContext(ctx);
+  qsFreeScoreCache(small);
+
+  /* matrices of one size solved in turn on one context, whose models may
+   * well come back at the same address, are never mistaken for another */
+  struct QSTScoreCache *shared = qsNewScoreCache(1 << 20);
+  struct QSTContext *cached = qsNewContext(8), *plain = qsNewContext(8);
+  double *seven = calloc(7 * 7, sizeof(double));
+  int k;
+  qsSetContextScoreCache(cached, shared);
+  for (k = 0; k < 20; ++k) {
+    struct QSTree *tree, *other;
+    for (i = 0; i < 7; ++i) {
+      for (j = 0; j < 7; ++j) {
+        seven[i*7 + j] = i == j ? 0 : fabs(sin(i * 0.29 + j * 0.13 + i * j * (0.07 + k * 0.11)));
+      }
+    }
+    double score = qsSolveMCMCCtx(&tree, 7, seven, cached);
+    ck_assert(qsSolveMCMCCtx(&other, 7, seven, plain) == score);
+    ck_assert(qsTreeCompare(tree, other) == 0);
+    qsFreeTree(tree);
+    qsFreeTree(other);
+  }
+  qsFreeContext(plain);
+  qsFreeContext(cached);
+  qsFreeScoreCache(shared);
+  free(seven);
+  free(distmatrix);
+
+#test qsearch_screened_test
+  int leaf_count = 30, i, j, covered = 0;
+  double *distmatrix = calloc(leaf_count * leaf_count, sizeof(double));
+  for (i = 0; i < leaf_count; ++i) {
+    for (j = 0; j < leaf_count; ++j) {
+      distmatrix[i*leaf_count + j] = i == j ? 0 : fabs(sin(i * 0.41 + j * 0.17 + i * j * 0.03));
+    }
+  }
+  struct QSTContext *ctx = qsNewContext(77);
+  struct QSTree *tree = qsNewRandomTreeCtx(leaf_count, ctx);
+  struct QSTTreeIndex *index = qsNewTreeIndex(tree);
+  double exact = qsScoreTreeIndexed(tree, index, distmatrix);
+  struct QSTScoreEstimate estimate;
+  for (i = 0; i < 20; ++i) {
+    qsEstimateTreeScoreCtx(tree, distmatrix, 0.02, &estimate, ctx);
+    ck_assert(!estimate.exact);
+    ck_assert(estimate.sample_count < 27405);
+    ck_assert(estimate.low <= estimate.score && estimate.score <= estimate.high);
+    ck_assert(fabs(estimate.score - exact) < 0.05);
+    covered += estimate.low <= exact && exact <= estimate.high;
+  }
+  ck_assert(covered >= 15);
+  /* asking for more than sampling can give scores every quartet */
+  ck_assert(qsEstimateTreeScoreCtx(tree, distmatrix, 1e-9, &estimate, ctx) == exact);
+  ck_assert(estimate.exact && estimate.sample_count == 27405);
+  qsFreeTreeIndex(index);
+  qsFreeTree(tree);
+
+  /* screened searches end on a correctly scored tree, whatever the pool */
+  double *small = calloc(12 * 12, sizeof(double));
+  for (i = 0; i < 12; ++i) {
+    for (j = 0; j < 12; ++j) {
+      small[i*12 + j] = distmatrix[i*leaf_count + j];
+    }
+  }
+  struct QSTThreadPool *pool = qsNewThreadPool(2);
+  struct QSTContext *pooled = qsNewContext(78);
+  struct QSTSolverOptions options;
+  struct QSTree *other;
+  int reason, other_reason;
+  qsSeedContext(ctx, 78);
+  qsSetContextStepMode(ctx, QST_STEP_SCREENED);
+  qsSetContextStepMode(pooled, QST_STEP_SCREENED);
+  qsSetContextScreening(pooled, 256, 8);
+  qsSetContextThreadPool(pooled, pool);
+  qsInitSolverOptions(&options);
+  options.max_steps = 5000;
+  double score = qsSolveMCMCAnytimeCtx(&tree, 12, small, &options, &reason, ctx);
+  ck_assert(qsSolveMCMCAnytimeCtx(&other, 12, small, &options, &other_reason, pooled) == score);
+  ck_assert(reason == other_reason && reason != QST_SOLVE_STEP_LIMIT);
+  ck_assert(qsTreeCompare(tree, other) == 0);
+  index = qsNewTreeIndex(tree);
+  ck_assert(fabs(qsScoreTreeIndexed(tree, index, small) - score) < 1e-9);
+  qsFreeTreeIndex(index);
+  qsFreeTree(tree);
+  qsFreeTree(other);
+  qsFreeContext(pooled);
+  qsFreeThreadPool(pool);
+  qsFreeContext(ctx);
+  free(small);
+  free(distmatrix);
+
+#test qsearch_batch_test
+  int leaf_counts[] = {12, 8, 14, 12, 10, 8}, job_count = 6, i, j, k;
+  double *matrices[6];
+  struct QSTree *trees[6], *pooled_trees[6], *single;
+  double scores[6], pooled_scores[6];
+  for (k = 0; k < job_count; ++k) {
+    int n = leaf_counts[k];
+    matrices[k] = calloc(n * n, sizeof(double));
+    for (i = 0; i < n; ++i) {
+      for (j = 0; j < n; ++j) {
+        matrices[k][i*n + j] = i == j ? 0 : fabs(sin(i * 0.41 + j * (0.17 + k * 0.05) + i * j * 0.03));
+      }
+    }
+  }
+  struct QSTContext *ctx = qsNewContext(91);
+  struct QSTContext *pooled = qsNewContext(91);
+  struct QSTThreadPool *pool = qsNewThreadPool(3);
+  struct QSTSolverStats stats;
+  qsResetSolverStats(&stats);
+  qsSetContextThreadPool(pooled, pool);
+  qsSetContextStats(pooled, &stats);
+  qsSolveMCMCBatchCtx(trees, scores, job_count, leaf_counts, (const double *const *) matrices, ctx);
+  qsSolveMCMCBatchCtx(pooled_trees, pooled_scores, job_count, leaf_counts,
+                      (const double *const *) matrices, pooled);
+  /* the results come back in input order whatever the pool */
+  for (k = 0; k < job_count; ++k) {
+    ck_assert(qsLeafCount(trees[k]) == leaf_counts[k]);
+    ck_assert(scores[k] == pooled_scores[k]);
+    ck_assert(qsTreeCompare(trees[k], pooled_trees[k]) == 0);
+    struct QSTTreeIndex *index = qsNewTreeIndex(trees[k]);
+    ck_assert(fabs(qsScoreTreeIndexed(trees[k], index, matrices[k]) - scores[k]) < 1e-9);
+    qsFreeTreeIndex(index);
+    qsFreeTree(trees[k]);
+    qsFreeTree(pooled_trees[k]);
+  }
+  if (stats.enabled) {
+    ck_assert(stats.steps > 0 && stats.best_score > 0);
+  }
+  /* workers keep their workspaces for the next batch, which draws anew */
+  qsSolveMCMCBatchCtx(pooled_trees, pooled_scores, 1, leaf_counts + 2,
+                      (const double *const *) matrices + 2, pooled);
+  ck_assert(qsLeafCount(pooled_trees[0]) == 14);
+  qsFreeTree(pooled_trees[0]);
+  qsSolveMCMCBatchCtx(&single, scores, 0, leaf_counts, (const double *const *) matrices, ctx);
+  qsFreeContext(pooled);
+  qsFreeContext(ctx);
+  qsFreeThreadPool(pool);
+  for (k = 0; k < job_count; ++k) {
+    free(matrices[k]);
+  }
+
+#test qsearch_warmstart_test
+  int leaf_count = 12, n1 = 13, i, j, k, u, v;
+  double *grown = calloc(n1 * n1, sizeof(double)), *distmatrix = calloc(leaf_count * leaf_count, sizeof(double));
+  for (i = 0; i < n1; ++i) {
+    for (j = 0; j < n1; ++j) {
+      grown[i*n1 + j] = i == j ? 0 : fabs(sin(i * 0.41 + j * 0.41 + i * j * 0.03));
+    }
+  }
+  for (i = 0; i < leaf_count; ++i) {
+    for (j = 0; j < leaf_count; ++j) {
+      distmatrix[i*leaf_count + j] = grown[i*n1 + j];
+    }
+  }
+  double treeScore(struct QSTree *tree, const double *dist) {
+    struct QSTTreeIndex *index = qsNewTreeIndex(tree);
+    double score = qsScoreTreeIndexed(tree, index, dist);
+    qsFreeTreeIndex(index);
+    return score;
+  }
+  struct QSTContext *ctx = qsNewContext(33);
+  struct QSTree *tree, *inserted, *refined, *again;
+  qsSolveMCMCCtx(&tree, leaf_count, distmatrix, ctx);
+  inserted = qsInsertLeaf(tree, grown);
+  ck_assert(qsLeafCount(inserted) == n1);
+  ck_assert(qsVerifyTree(inserted) == 0);
+  double inserted_score = treeScore(inserted, grown);
+  /* no edge takes the new leaf better than the one chosen */
+  uint16_t *old = (uint16_t *) tree;
+  struct QSTree *candidate = qsNewTree(n1);
+  uint16_t *cand = (uint16_t *) candidate;
+  for (u = 0; u < 2 * leaf_count - 2; ++u) {
+    for (v = u + 1; v < 2 * leaf_count - 2; ++v) {
+      if (!qsIsConnected(tree, u, v)) {
+        continue;
+      }
+      QST_DISINTEGRATE_TREE(cand);
+      for (i = 0; i < 2 * leaf_count - 2; ++i) {
+        for (k = 0; k < QST_NLIST_SIZE(old, i); ++k) {
+          j = old[QST_NLIST_BASE(old, i) + k];
+          if (j > i && !(i == u && j == v)) {
+            int ri = i < leaf_count ? i : i + 1, rj = j < leaf_count ? j : j + 1;
+            QST_CONNECT_BOTH(uint16_t, cand, ri, rj);
+          }
+        }
+      }
+      int kernel = 2 * n1 - 3, ru = u < leaf_count ? u : u + 1, rv = v < leaf_count ? v : v + 1;
+      QST_CONNECT_BOTH(uint16_t, cand, kernel, ru);
+      QST_CONNECT_BOTH(uint16_t, cand, kernel, rv);
+      QST_CONNECT_BOTH(uint16_t, cand, kernel, leaf_count);
+      ck_assert(qsVerifyTree(candidate) == 0);
+      ck_assert(treeScore(candidate, grown) <= inserted_score + 1e-12);
+    }
+  }
+  qsFreeTree(candidate);
+
+  /* a refinement from the grown tree ends on a correctly scored tree */
+  const struct QSTree *starts[2] = { inserted, inserted };
+  double score = qsSolveMCMCFromCtx(&refined, grown, starts, 1, ctx);
+  ck_assert(qsLeafCount(refined) == n1);
+  ck_assert(fabs(treeScore(refined, grown) - score) < 1e-9);
+  /* chains that all start on one tree have nothing to search */
+  qsSetContextChainCount(ctx, 2);
+  ck_assert(qsSolveMCMCFromCtx(&again, grown, starts, 2, ctx) == inserted_score);
+  ck_assert(qsTreeCompare(again, inserted) == 0);
+  qsFreeTree(again);
+  qsSetContextChainCount(ctx, 0);
+  /* and the anytime options take start trees too */
+  struct QSTSolverOptions options;
+  int reason;
+  qsInitSolverOptions(&options);
+  options.starts = starts;
+  options.start_count = 1;
+  options.max_fail_count = 200;
+  score = qsSolveMCMCAnytimeCtx(&again, n1, grown, &options, &reason, ctx);
+  ck_assert(fabs(treeScore(again, grown) - score) < 1e-9);
+  qsFreeTree(again);
+  qsFreeTree(refined);
+  qsFreeTree(inserted);
+  qsFreeTree(tree);
+  qsFreeContext(ctx);
+  free(distmatrix);
+  free(grown);
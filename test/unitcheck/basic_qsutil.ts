@@ -1,7 +1,127 @@
 /* A complete test example */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
 #include <qsearch.h>
+#include <qsutil.h>
 
 #test qsearch_test
   ck_assert(10 == 10);
+
+#test qsutil_matrixfile_test
+  char text_path[] = "/tmp/qsutil_textXXXXXX";
+  char binary_path[] = "/tmp/qsutil_binXXXXXX";
+  const char *labels[] = { "alpha", "beta", "gamma", "delta", "epsilon" };
+  double distmatrix[25];
+  uint32_t leaf_count = 5, flags, i, j;
+  int fd = mkstemp(text_path);
+  FILE *fp = fdopen(fd, "w");
+  close(mkstemp(binary_path));
+  for (i = 0; i < leaf_count; ++i) {
+    fprintf(fp, "%s", labels[i]);
+    for (j = 0; j < leaf_count; ++j) {
+      distmatrix[i*leaf_count + j] = i == j ? 0 : 0.25 + fabs(sin(i + j + i * j * 0.3));
+      fprintf(fp, " %.17g", distmatrix[i*leaf_count + j]);
+    }
+    fprintf(fp, "\n");
+  }
+  fclose(fp);
+  ck_assert(!qsIsBinaryMatrixFile(text_path));
+  struct QSTMatrixFile *text = qsOpenMatrixFile(text_path);
+  ck_assert(text->leaf_count == leaf_count);
+  ck_assert(memcmp(text->distmatrix, distmatrix, sizeof(distmatrix)) == 0);
+  ck_assert(strcmp(text->labels[4], "epsilon") == 0);
+  for (flags = 0; flags < 4; ++flags) {
+    qsConvertTextMatrix(text_path, binary_path, flags);
+    ck_assert(qsIsBinaryMatrixFile(binary_path));
+    struct QSTMatrixFile *binary = qsOpenMatrixFile(binary_path);
+    ck_assert(binary->leaf_count == leaf_count);
+    ck_assert(binary->flags == flags);
+    /* dense doubles are read straight out of the mapping */
+    ck_assert((flags == 0) == (binary->owned == NULL));
+    for (i = 0; i < leaf_count; ++i) {
+      ck_assert(strcmp(binary->labels[i], labels[i]) == 0);
+      for (j = 0; j < leaf_count; ++j) {
+        double expected = distmatrix[i*leaf_count + j];
+        if (flags & QST_MATRIX_PACKED && j < i) {
+          expected = distmatrix[j*leaf_count + i];
+        }
+        if (flags & QST_MATRIX_FLOAT32) {
+          expected = (float) expected;
+        }
+        ck_assert(binary->distmatrix[i*leaf_count + j] == expected);
+        ck_assert(qsMatrixDistance(binary, i, j) == expected);
+      }
+    }
+    qsCloseMatrixFile(binary);
+  }
+  /* unlabeled rows are numbered */
+  qsWriteMatrixFile(binary_path, leaf_count, distmatrix, NULL, 0);
+  struct QSTMatrixFile *numbered = qsOpenMatrixFile(binary_path);
+  ck_assert(strcmp(numbered->labels[3], "3") == 0);
+  struct QSTree *tree = qsNewTree(leaf_count);
+  QST_DECLARE_PATH_LENGTH(uint16_t, pathlen, 5);
+  QST_DECLARE_TRUNCATED_PATH_LENGTH(uint16_t, smallpathlen, 5);
+  qstWritePathMatrix(pathlen, tree);
+  qstWriteTruncatedPathMatrix(smallpathlen, pathlen);
+  ck_assert(qsScoreTree(tree, smallpathlen, numbered->distmatrix) ==
+            qsScoreTree(tree, smallpathlen, text->distmatrix));
+  qsFreeTree(tree);
+  qsCloseMatrixFile(numbered);
+  qsCloseMatrixFile(text);
+  unlink(text_path);
+  unlink(binary_path);
+
+#test qsutil_treewriter_test
+  char path[] = "/tmp/qsutil_treeXXXXXX";
+  const char *labels[] = { "alpha", "beta gamma", "it's", "delta", "epsilon" };
+  struct QSTree *tree = qsNewTree(5);
+  char text[1024];
+  int format;
+  size_t len;
+  close(mkstemp(path));
+  ck_assert(qsTreeFormatByName("newick") == QST_TREE_NEWICK);
+  ck_assert(qsTreeFormatByName("png") == -1);
+  for (format = QST_TREE_DOT; format <= QST_TREE_NEXUS; ++format) {
+    qsSaveTree(path, tree, labels, format, 0.75);
+    FILE *fp = fopen(path, "r");
+    len = fread(text, 1, sizeof(text) - 1, fp);
+    text[len] = '\0';
+    fclose(fp);
+    if (format == QST_TREE_DOT) {
+      ck_assert(strstr(text, "graph tree {") == text);
+      ck_assert(strstr(text, "n1 [label=\"beta gamma\"];") != NULL);
+      /* 2n - 3 edges */
+      int edges = 0;
+      const char *at;
+      for (at = strstr(text, " -- "); at != NULL; at = strstr(at + 1, " -- ")) {
+        edges += 1;
+      }
+      ck_assert(edges == 7);
+    } else {
+      /* every leaf once, quoted where Newick needs it */
+      ck_assert(strstr(text, "alpha") != NULL);
+      ck_assert(strstr(text, "'beta gamma'") != NULL);
+      ck_assert(strstr(text, "'it''s'") != NULL);
+      ck_assert(strstr(text, "epsilon") != NULL);
+      ck_assert(strstr(text, ";\n") != NULL);
+      int depth = 0, commas = 0;
+      const char *at = format == QST_TREE_NEXUS ? strstr(text, "[&U] ") + 5 : text;
+      for (; *at != ';'; ++at) {
+        depth += *at == '(' ? 1 : *at == ')' ? -1 : 0;
+        commas += *at == ',';
+        ck_assert(depth >= 0);
+      }
+      ck_assert(depth == 0);
+      ck_assert(commas == 4);
+    }
+    if (format == QST_TREE_NEXUS) {
+      ck_assert(strstr(text, "#NEXUS") == text);
+      ck_assert(strstr(text, "NTAX=5;") != NULL);
+    }
+  }
+  qsFreeTree(tree);
+  unlink(path);
@@ -0,0 +1,32 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <qsutil.h>
+
+static void usage(void) {
+  fprintf(stderr, "Usage: convertmatrix [-f] [-p] distmatrix.txt distmatrix.qsdm\n");
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  static struct option long_options[] = {
+    { "float", no_argument, NULL, 'f' },
+    { "packed", no_argument, NULL, 'p' },
+    { NULL, 0, NULL, 0 }
+  };
+  uint32_t flags = 0;
+  int c;
+  while ((c = getopt_long(argc, argv, "fp", long_options, NULL)) != -1) {
+    switch (c) {
+      case 'f': flags |= QST_MATRIX_FLOAT32; break;
+      case 'p': flags |= QST_MATRIX_PACKED; break;
+      default: usage();
+    }
+  }
+  if (argc - optind != 2) {
+    usage();
+  }
+  qsConvertTextMatrix(argv[optind], argv[optind + 1], flags);
+  return 0;
+}
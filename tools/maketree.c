@@ -1,4 +1,368 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <qsearch.h>
+#include <qsutil.h>
+
+#define MAX_CHAINS 10
+
+/* Every chain steps on its own thread with its own context, and beta
+ * follows the shared step count the way qsSolveMCMC's schedule does.  The
+ * search ends once all chains hold the same topology, at a perfect score,
+ * on SIGINT, or when a time or stagnation limit given on the command line
+ * runs out.  A chain that finds a better tree than any before copies
+ * it into best under the lock and wakes the writer thread; the chains
+ * never touch the disk, so a slow write cannot hold up a step. */
+
+struct MakeTree;
+
+struct Chain {
+  struct MakeTree *run;
+  struct QSTree *tree;
+  struct QSTContext *ctx;
+  struct QSTThreadPool *pool;
+  struct QSTSolverStats stats;
+  uint64_t hash;                  // topology of tree, published after every step
+  pthread_t thread;
+};
+
+struct MakeTree {
+  const struct QSTScoreModel *model;
+  const char *const *labels;
+  const char *output;
+  int format;
+  struct Chain chains[MAX_CHAINS];
+  struct QSTScoreCache *cache;    // shared by every chain, may be NULL
+  int chain_count;
+  uint64_t itercount;
+  uint64_t improved_at;           // itercount when best last improved
+  uint64_t max_fail_count;        // 0 for no stagnation limit
+  double deadline;                // 0 for no time limit
+  int stop;
+  int limited;                    // stopped by one of the two limits above
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  struct QSTree *best;            // guarded by lock, like the two below
+  double best_score;
+  uint64_t best_version;
+  int done;
+};
+
+static volatile sig_atomic_t interrupted;
+
+static void onInterrupt(int signum) {
+  (void) signum;
+  interrupted = 1;
+}
+
+static void offerTree(struct MakeTree *run, const struct QSTree *tree, double score) {
+  pthread_mutex_lock(&run->lock);
+  if (score > run->best_score) {
+    qsCopyTreeOver(run->best, tree);
+    run->best_score = score;
+    run->best_version += 1;
+    uint64_t itercount = __atomic_load_n(&run->itercount, __ATOMIC_RELAXED);
+    __atomic_store_n(&run->improved_at, itercount, __ATOMIC_RELAXED);
+    pthread_cond_signal(&run->wake);
+  }
+  pthread_mutex_unlock(&run->lock);
+}
+
+static double secondsNow(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+static void *chainMain(void *arg) {
+  struct Chain *chain = (struct Chain *) arg;
+  struct MakeTree *run = chain->run;
+  int i, same;
+  while (!__atomic_load_n(&run->stop, __ATOMIC_ACQUIRE) && !interrupted) {
+    uint64_t itercount = __atomic_add_fetch(&run->itercount, 1, __ATOMIC_RELAXED);
+    double lg = log(itercount);
+    double beta = lg*lg*lg;
+    double score = qsStepMCMCCtx(chain->tree, run->model, beta, chain->ctx);
+    offerTree(run, chain->tree, score);
+    uint64_t hash = qsTreeTopologyHash(chain->tree);
+    __atomic_store_n(&chain->hash, hash, __ATOMIC_RELEASE);
+    for (i = 0, same = 0; i < run->chain_count; ++i) {
+      same += __atomic_load_n(&run->chains[i].hash, __ATOMIC_ACQUIRE) == hash;
+    }
+    chain->stats.agreement_checks += 1;
+    chain->stats.agreeing_chains = same;
+    chain->stats.chain_count = run->chain_count;
+    if (score == 1.0 || same == run->chain_count) {
+      __atomic_store_n(&run->stop, 1, __ATOMIC_RELEASE);
+    } else if ((run->max_fail_count != 0 &&
+                itercount - __atomic_load_n(&run->improved_at, __ATOMIC_RELAXED) >=
+                run->max_fail_count) ||
+               (run->deadline != 0 && secondsNow() >= run->deadline)) {
+      __atomic_store_n(&run->limited, 1, __ATOMIC_RELAXED);
+      __atomic_store_n(&run->stop, 1, __ATOMIC_RELEASE);
+    }
+  }
+  return NULL;
+}
+
+/* Writes the newest best tree whenever one is published, and whatever is
+ * still unwritten once the search is done. */
+static void *writerMain(void *arg) {
+  struct MakeTree *run = (struct MakeTree *) arg;
+  struct QSTree *tree = qsNewCloneOf(run->best);
+  uint64_t written = 0;
+  pthread_mutex_lock(&run->lock);
+  for (;;) {
+    while (!run->done && run->best_version == written) {
+      pthread_cond_wait(&run->wake, &run->lock);
+    }
+    if (run->best_version == written) {
+      break;
+    }
+    qsCopyTreeOver(tree, run->best);
+    double score = run->best_score;
+    written = run->best_version;
+    pthread_mutex_unlock(&run->lock);
+    qsSaveTree(run->output, tree, run->labels, run->format, score);
+    pthread_mutex_lock(&run->lock);
+  }
+  pthread_mutex_unlock(&run->lock);
+  qsFreeTree(tree);
+  return NULL;
+}
+
+static void printStats(const struct MakeTree *run) {
+  struct QSTSolverStats total;
+  int i;
+  if (!run->chains[0].stats.enabled) {
+    fprintf(stderr, "stats: not available, libqsearch was configured with --disable-stats\n");
+    return;
+  }
+  qsResetSolverStats(&total);
+  for (i = 0; i < run->chain_count; ++i) {
+    const struct QSTSolverStats *stats = &run->chains[i].stats;
+    fprintf(stderr, "stats: chain %d: %llu steps, %llu stayed, %llu candidates, "
+            "best %f, %d of %d chains agreeing\n", i, (unsigned long long) stats->steps,
+            (unsigned long long) stats->stays, (unsigned long long) stats->candidates,
+            stats->best_score, stats->agreeing_chains, stats->chain_count);
+    total.steps += stats->steps;
+    total.stays += stats->stays;
+    total.candidates += stats->candidates;
+    total.full_scores += stats->full_scores;
+    total.path_ns += stats->path_ns;
+    total.enumerate_ns += stats->enumerate_ns;
+    total.score_ns += stats->score_ns;
+  }
+  fprintf(stderr, "stats: %llu steps, %.1f%% stayed, %.1f candidates a step, "
+          "%llu full scorings\n", (unsigned long long) total.steps,
+          total.steps ? 100.0 * total.stays / total.steps : 0.0,
+          total.steps ? (double) total.candidates / total.steps : 0.0,
+          (unsigned long long) total.full_scores);
+  fprintf(stderr, "stats: seconds in path matrices %.3f, neighbor listing %.3f, scoring %.3f\n",
+          total.path_ns * 1e-9, total.enumerate_ns * 1e-9, total.score_ns * 1e-9);
+  if (run->cache != NULL) {
+    struct QSTScoreCacheStats cache_stats;
+    qsGetScoreCacheStats(run->cache, &cache_stats);
+    uint64_t lookups = cache_stats.hits + cache_stats.misses;
+    fprintf(stderr, "stats: score cache %llu hits, %llu misses (%.1f%% hits), %llu evictions\n",
+            (unsigned long long) cache_stats.hits, (unsigned long long) cache_stats.misses,
+            lookups ? 100.0 * cache_stats.hits / lookups : 0.0,
+            (unsigned long long) cache_stats.evictions);
+  }
+}
+
+static int formatFromFileName(const char *path) {
+  const char *dot = strrchr(path, '.');
+  if (dot != NULL && (strcmp(dot, ".nwk") == 0 || strcmp(dot, ".newick") == 0 ||
+                      strcmp(dot, ".tre") == 0)) {
+    return QST_TREE_NEWICK;
+  }
+  if (dot != NULL && (strcmp(dot, ".nex") == 0 || strcmp(dot, ".nexus") == 0)) {
+    return QST_TREE_NEXUS;
+  }
+  return QST_TREE_DOT;
+}
+
+static void usage(void) {
+  fprintf(stderr, "Usage: maketree [-n] [-o filename] [-F dot|newick|nexus] [-c chains]\n"
+                  "                [-s seed] [-m] [-t seconds] [-f max_fail_count]\n"
+                  "                [--cache megabytes] [--stats] distmatrix.txt\n");
+  exit(1);
+}
+
 int main(int argc, char **argv)
 {
-  return 0;
+  static struct option long_options[] = {
+    { "output", required_argument, NULL, 'o' },
+    { "nexus", no_argument, NULL, 'n' },
+    { "format", required_argument, NULL, 'F' },
+    { "chains", required_argument, NULL, 'c' },
+    { "seed", required_argument, NULL, 's' },
+    { "metropolis", no_argument, NULL, 'm' },
+    { "time", required_argument, NULL, 't' },
+    { "max-fail-count", required_argument, NULL, 'f' },
+    { "cache", required_argument, NULL, 'C' },
+    { "stats", no_argument, NULL, 'S' },
+    { NULL, 0, NULL, 0 }
+  };
+  struct MakeTree run;
+  const char *output = NULL;
+  int format = -1, chain_count = 2, metropolis = 0, show_stats = 0, c, i;
+  double seconds = 0, cache_megabytes = 0;
+  uint64_t max_fail_count = 0;
+  uint64_t seed = (uint64_t) time(NULL) << 20 ^ (uint64_t) getpid();
+  while ((c = getopt_long(argc, argv, "o:nF:c:s:mt:f:", long_options, NULL)) != -1) {
+    switch (c) {
+      case 'o': output = optarg; break;
+      case 'n': format = QST_TREE_NEXUS; break;
+      case 'F':
+        format = qsTreeFormatByName(optarg);
+        if (format < 0) {
+          fprintf(stderr, "Error, unknown tree format %s.\n", optarg);
+          exit(1);
+        }
+        break;
+      case 'c':
+        chain_count = atoi(optarg);
+        if (chain_count < 2 || chain_count > MAX_CHAINS) {
+          fprintf(stderr, "Error, the chain count must be from 2 to %d.\n", MAX_CHAINS);
+          exit(1);
+        }
+        break;
+      case 's': seed = strtoull(optarg, NULL, 0); break;
+      case 'm': metropolis = 1; break;
+      case 't':
+        seconds = atof(optarg);
+        if (seconds <= 0) {
+          fprintf(stderr, "Error, the time limit must be a positive number of seconds.\n");
+          exit(1);
+        }
+        break;
+      case 'f': max_fail_count = strtoull(optarg, NULL, 0); break;
+      case 'C':
+        cache_megabytes = atof(optarg);
+        if (cache_megabytes < 1) {
+          fprintf(stderr, "Error, the score cache needs at least a megabyte.\n");
+          exit(1);
+        }
+        break;
+      case 'S': show_stats = 1; break;
+      default: usage();
+    }
+  }
+  if (argc - optind != 1) {
+    usage();
+  }
+  if (output == NULL) {
+    output = format == QST_TREE_NEXUS ? "treefile.nex" :
+             format == QST_TREE_NEWICK ? "treefile.nwk" : "treefile.dot";
+  }
+  if (format < 0) {
+    format = formatFromFileName(output);
+  }
+  struct QSTMatrixFile *matrix = qsOpenMatrixFile(argv[optind]);
+  uint32_t leaf_count = matrix->leaf_count;
+  memset(&run, 0, sizeof(run));
+  run.model = qsNewScoreModel(leaf_count, matrix->distmatrix);
+  run.labels = matrix->labels;
+  run.output = output;
+  run.format = format;
+  run.chain_count = chain_count;
+  run.itercount = 5;
+  run.improved_at = 5;
+  run.max_fail_count = max_fail_count;
+  run.best = qsNewTree(leaf_count);
+  run.best_score = -1.0;
+  if (cache_megabytes > 0) {
+    run.cache = qsNewScoreCache((size_t) (cache_megabytes * 1048576));
+  }
+  pthread_mutex_init(&run.lock, NULL);
+  pthread_cond_init(&run.wake, NULL);
+
+  /* The threads are started with SIGINT blocked so that it lands on this
+   * one, which only has to be waiting in pthread_join.  A second SIGINT
+   * kills the process the usual way. */
+  struct sigaction action;
+  sigset_t block, saved;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = onInterrupt;
+  action.sa_flags = SA_RESTART | SA_RESETHAND;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, NULL);
+  sigemptyset(&block);
+  sigaddset(&block, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &block, &saved);
+
+  int threads_per_chain = qsOnlineCPUCount() / chain_count;
+  for (i = 0; i < chain_count; ++i) {
+    struct Chain *chain = &run.chains[i];
+    chain->run = &run;
+    chain->ctx = qsNewContext(seed + i);
+    if (threads_per_chain > 1) {
+      chain->pool = qsNewThreadPool(threads_per_chain);
+      qsSetContextThreadPool(chain->ctx, chain->pool);
+    }
+    if (metropolis) {
+      qsSetContextStepMode(chain->ctx, QST_STEP_METROPOLIS);
+    }
+    qsSetContextScoreCache(chain->ctx, run.cache);
+    qsResetSolverStats(&chain->stats);
+    if (show_stats) {
+      qsSetContextStats(chain->ctx, &chain->stats);
+    }
+    chain->tree = qsNewRandomTreeCtx(leaf_count, chain->ctx);
+    chain->hash = qsTreeTopologyHash(chain->tree);
+  }
+  if (seconds > 0) {
+    run.deadline = secondsNow() + seconds;
+  }
+  pthread_t writer;
+  if (pthread_create(&writer, NULL, writerMain, &run) != 0) {
+    fprintf(stderr, "Error, cannot start the writer thread.\n");
+    exit(1);
+  }
+  for (i = 0; i < chain_count; ++i) {
+    if (pthread_create(&run.chains[i].thread, NULL, chainMain, &run.chains[i]) != 0) {
+      fprintf(stderr, "Error, cannot start chain thread %d.\n", i);
+      exit(1);
+    }
+  }
+  pthread_sigmask(SIG_SETMASK, &saved, NULL);
+  for (i = 0; i < chain_count; ++i) {
+    pthread_join(run.chains[i].thread, NULL);
+  }
+  pthread_mutex_lock(&run.lock);
+  run.done = 1;
+  pthread_cond_signal(&run.wake);
+  pthread_mutex_unlock(&run.lock);
+  pthread_join(writer, NULL);
+
+  printf("%s tree with score %f written to %s\n",
+         interrupted ? "Interrupted, best" : run.limited ? "Limit reached, best" : "Best",
+         run.best_score, output);
+  if (show_stats) {
+    printStats(&run);
+  }
+  for (i = 0; i < chain_count; ++i) {
+    qsFreeTree(run.chains[i].tree);
+    qsFreeContext(run.chains[i].ctx);
+    if (run.chains[i].pool != NULL) {
+      qsFreeThreadPool(run.chains[i].pool);
+    }
+  }
+  qsFreeTree(run.best);
+  if (run.cache != NULL) {
+    qsFreeScoreCache(run.cache);
+  }
+  qsFreeScoreModel((struct QSTScoreModel *) run.model);
+  qsCloseMatrixFile(matrix);
+  pthread_cond_destroy(&run.wake);
+  pthread_mutex_destroy(&run.lock);
+  return interrupted ? 128 + SIGINT : 0;
 }